@@ -0,0 +1,69 @@
+// Heap allocation counter for the benchmark suite (bench/bench.c).
+//
+// Loaded into rfd with LD_PRELOAD, it counts calls to malloc(), calloc(),
+// realloc() and free() and passes them on to the C library. When the
+// program exits, the totals are written to the file named by the
+// RFD_BENCH_ALLOC_LOG environment variable as one line:
+//
+//     allocs N reallocs N frees N bytes N
+//
+// glibc only: the real allocator is reached through its __libc_ entry
+// points, which need no dlsym() (and so no allocation) to look up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static atomic_ullong g_Allocs = 0;      // malloc(), calloc(), realloc(NULL, n)
+static atomic_ullong g_Reallocs = 0;    // realloc() of an existing block
+static atomic_ullong g_Frees = 0;       // free() of a block (not of NULL)
+static atomic_ullong g_Bytes = 0;       // Bytes asked for, in total
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&g_Allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_Bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&g_Allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_Bytes, count * size, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    atomic_fetch_add_explicit(ptr ? &g_Reallocs : &g_Allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_Bytes, size, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    if (ptr != NULL) atomic_fetch_add_explicit(&g_Frees, 1, memory_order_relaxed);
+    __libc_free(ptr);
+}
+
+// Writes the totals out with plain system calls, so reporting doesn't
+// count (or need) any allocation of its own
+__attribute__((destructor)) static void ReportAllocations(void) {
+    const char* path = getenv("RFD_BENCH_ALLOC_LOG");
+    if (path == NULL) return;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    char line[160];
+    int length = snprintf(line, sizeof(line), "allocs %llu reallocs %llu frees %llu bytes %llu\n",
+                          (unsigned long long)atomic_load(&g_Allocs), (unsigned long long)atomic_load(&g_Reallocs),
+                          (unsigned long long)atomic_load(&g_Frees), (unsigned long long)atomic_load(&g_Bytes));
+    if (length > 0) {
+        ssize_t ignored = write(fd, line, (size_t)length);
+        (void)ignored;
+    }
+    close(fd);
+}
@@ -0,0 +1,610 @@
+// Benchmark suite for rfd (see "Benchmarks" in README.md).
+//
+// Generates a synthetic directory tree in a temporary directory, runs the
+// rfd binary against it and prints one JSON object per measurement on
+// standard output, so results can be appended to a file and compared run
+// to run. Progress messages go to standard error.
+//
+// Measured:
+//  - scan_cold: a --count run with no saved index (a full scan)
+//  - scan_warm: a --count run with the saved index (load and revalidate)
+//  - pick, pick_filtered: round trips to a --serve server, as percentiles
+//  - storm_create, storm_rename, storm_delete: files created, moved over
+//    each other or deleted in a burst, and how long the server's watcher
+//    takes to catch up with them. A count that never matches the files
+//    on disk fails the run.
+//  - server: peak memory and allocations of the server over all of that
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// ====================================================================
+// --- Settings ---
+// ====================================================================
+
+typedef struct {
+    const char* rfd;        // The rfd binary to measure
+    const char* preload;    // Allocation counter (alloccount.so), NULL = none
+    const char* tmpBase;    // Where the temporary directory is made
+    const char* rev;        // Label of the build being measured (a git revision)
+    int depth;              // Levels of directories below the top one
+    int fanout;             // Subdirectories per directory
+    int files;              // Files per directory
+    int nameLength;         // Characters per generated name
+    int statFallback;       // Run rfd with --ignore-dtype
+    int runs;               // Repetitions of each scan measurement
+    int picks;              // Requests per latency measurement
+    int storm;              // Files created, then deleted, by the storm
+    uint64_t seed;          // Makes the generated names repeatable
+    int keep;               // Leave the generated tree behind
+    char** rfdArgs;         // Extra rfd options (everything after "--")
+    int rfdArgCount;
+} BenchConfig;
+
+// Socket of the server started for the latency and storm measurements,
+// relative to the work directory
+#define BENCH_SOCKET "bench.sock"
+
+// How long (seconds) to wait for the server to start or catch up
+#define BENCH_TIMEOUT 120.0
+
+// Extensions given to generated files, in turn
+static const char* g_Extensions[] = {".txt", ".jpg", ".png", ".dat"};
+
+// (Shorter than PATH_MAX, to leave room for the names appended to them)
+static char g_TempDir[PATH_MAX - 64];   // Everything generated lives in here
+static char g_TreeDir[PATH_MAX - 32];   // The tree rfd indexes
+static char g_WorkDir[PATH_MAX - 32];   // rfd's working directory (dirs.txt, dirs.idx)
+static char g_AllocLog[PATH_MAX - 32];  // Where alloccount.so reports
+static pid_t g_ServerPid = -1;
+static time_t g_StartTime;
+
+// Every generated directory, for spreading the storm over the tree
+static char** g_Dirs = NULL;
+static int g_DirCount = 0;
+static int g_DirCapacity = 0;
+static long long g_FileCount = 0;
+
+// ====================================================================
+// --- Helpers ---
+// ====================================================================
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int RemoveEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+// Removes the temporary directory, unless asked to keep it
+static void Cleanup(int keep) {
+    if (g_ServerPid > 0) {
+        kill(g_ServerPid, SIGKILL);
+        waitpid(g_ServerPid, NULL, 0);
+        g_ServerPid = -1;
+    }
+    if (g_TempDir[0] == '\0') return;
+    if (keep) {
+        fprintf(stderr, "Kept %s\n", g_TempDir);
+    } else {
+        nftw(g_TempDir, RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+static void Fail(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "rfd-bench: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    Cleanup(0);
+    exit(1);
+}
+
+// ====================================================================
+// --- Tree Generator ---
+// ====================================================================
+
+static uint64_t g_RandomState;
+
+// xorshift64*: plenty for names, and the same seed gives the same tree
+static uint64_t NextRandom(void) {
+    g_RandomState ^= g_RandomState >> 12;
+    g_RandomState ^= g_RandomState << 25;
+    g_RandomState ^= g_RandomState >> 27;
+    return g_RandomState * 0x2545F4914F6CDD1Dull;
+}
+
+// Writes a name of exactly 'length' characters (at least 8) that is
+// unique for each 'serial': random letters, then the serial in base 36
+static void MakeName(char* out, int length, long long serial) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char tail[16];
+    int tailLength = 0;
+    do {
+        tail[tailLength++] = digits[serial % 36];
+        serial /= 36;
+    } while (serial > 0);
+    int head = length - tailLength - 1;
+    for (int i = 0; i < head; i++) out[i] = letters[NextRandom() % 26];
+    out[head] = '-';
+    for (int i = 0; i < tailLength; i++) out[head + 1 + i] = tail[tailLength - 1 - i];
+    out[length] = '\0';
+}
+
+static void RememberDir(const char* path) {
+    if (g_DirCount == g_DirCapacity) {
+        g_DirCapacity = g_DirCapacity ? g_DirCapacity * 2 : 256;
+        g_Dirs = (char**)realloc(g_Dirs, g_DirCapacity * sizeof(char*));
+        if (g_Dirs == NULL) Fail("out of memory");
+    }
+    g_Dirs[g_DirCount] = strdup(path);
+    if (g_Dirs[g_DirCount] == NULL) Fail("out of memory");
+    g_DirCount++;
+}
+
+// Fills 'path' (which exists) with files and, above the last level,
+// 'fanout' subdirectories filled the same way
+static void GenerateTree(const BenchConfig* cfg, const char* path, int level) {
+    static long long serial = 0;
+    RememberDir(path);
+    char child[PATH_MAX];
+    char name[256];
+    for (int i = 0; i < cfg->files; i++) {
+        MakeName(name, cfg->nameLength, serial++);
+        snprintf(child, sizeof(child), "%s/%s%s", path, name, g_Extensions[i % 4]);
+        int fd = open(child, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) Fail("can't create %s: %s", child, strerror(errno));
+        close(fd);
+        g_FileCount++;
+    }
+    if (level >= cfg->depth) return;
+    for (int i = 0; i < cfg->fanout; i++) {
+        MakeName(name, cfg->nameLength, serial++);
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+        if (mkdir(child, 0755) != 0) Fail("can't create %s: %s", child, strerror(errno));
+        GenerateTree(cfg, child, level + 1);
+    }
+}
+
+// ====================================================================
+// --- Running rfd ---
+// ====================================================================
+
+typedef struct {
+    double seconds;         // Wall-clock time
+    double cpuSeconds;      // User plus system time
+    long maxRssKb;          // Peak resident set size
+    int haveAllocs;         // The counters below are filled in
+    unsigned long long allocs, reallocs, frees, bytes;
+} RunResult;
+
+// Starts rfd in the work directory with the configured options plus
+// 'extra' (NULL-terminated). Its output is thrown away.
+static pid_t StartRfd(const BenchConfig* cfg, const char* const* extra) {
+    const char* argv[64];
+    int argc = 0;
+    argv[argc++] = cfg->rfd;
+    if (cfg->statFallback) argv[argc++] = "--ignore-dtype";
+    for (int i = 0; i < cfg->rfdArgCount && argc < 48; i++) argv[argc++] = cfg->rfdArgs[i];
+    for (int i = 0; extra[i] != NULL && argc < 63; i++) argv[argc++] = extra[i];
+    argv[argc] = NULL;
+
+    unlink(g_AllocLog);
+    pid_t pid = fork();
+    if (pid < 0) Fail("fork failed: %s", strerror(errno));
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        if (chdir(g_WorkDir) != 0 || null < 0) _exit(127);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        if (cfg->preload != NULL) {
+            setenv("LD_PRELOAD", cfg->preload, 1);
+            setenv("RFD_BENCH_ALLOC_LOG", g_AllocLog, 1);
+        }
+        execv(cfg->rfd, (char* const*)argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Waits for 'pid' and fills in what the kernel and alloccount.so saw
+static void FinishRfd(pid_t pid, double started, RunResult* result) {
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) Fail("wait4 failed: %s", strerror(errno));
+    result->seconds = Now() - started;
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 && WEXITSTATUS(status) != 1)) {
+        Fail("rfd failed (status %d)", status);
+    }
+    result->cpuSeconds = (double)usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         (double)usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->maxRssKb = usage.ru_maxrss;
+    result->haveAllocs = 0;
+    FILE* fp = fopen(g_AllocLog, "r");
+    if (fp != NULL) {
+        result->haveAllocs = (fscanf(fp, "allocs %llu reallocs %llu frees %llu bytes %llu", &result->allocs,
+                                     &result->reallocs, &result->frees, &result->bytes) == 4);
+        fclose(fp);
+    }
+}
+
+// ====================================================================
+// --- Output ---
+// ====================================================================
+
+// Starts a JSON record: the fields every record shares, so each line can
+// be compared with the same benchmark of another run on its own
+static void BeginRecord(const BenchConfig* cfg, const char* bench) {
+    printf("{\"suite\":\"rfd-bench\",\"bench\":\"%s\",\"rev\":\"%s\",\"time\":%lld,"
+           "\"tree\":\"depth%d-fanout%d-files%d-name%d\",\"stat_fallback\":%d,\"files\":%lld,\"dirs\":%d",
+           bench, cfg->rev, (long long)g_StartTime, cfg->depth, cfg->fanout, cfg->files, cfg->nameLength,
+           cfg->statFallback, g_FileCount, g_DirCount);
+}
+
+static void EndRecord(void) {
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void RecordResource(const RunResult* result) {
+    printf(",\"max_rss_kb\":%ld,\"cpu_seconds\":%.6f", result->maxRssKb, result->cpuSeconds);
+    if (result->haveAllocs) {
+        printf(",\"allocs\":%llu,\"reallocs\":%llu,\"frees\":%llu,\"alloc_bytes\":%llu",
+               result->allocs, result->reallocs, result->frees, result->bytes);
+    }
+}
+
+static int CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// The value below which 'p' of the sorted 'values' lie
+static double Percentile(const double* values, int count, double p) {
+    int i = (int)(p * (count - 1) + 0.5);
+    return values[i];
+}
+
+// ====================================================================
+// --- Benchmarks ---
+// ====================================================================
+
+// Times 'runs' --count runs; 'cold' removes the saved index before each
+static void BenchScan(const BenchConfig* cfg, int cold) {
+    const char* extra[] = {"--count", "1", NULL};
+    double* seconds = (double*)malloc(cfg->runs * sizeof(double));
+    if (seconds == NULL) Fail("out of memory");
+    RunResult last;
+    memset(&last, 0, sizeof(last));
+    char index[PATH_MAX];
+    snprintf(index, sizeof(index), "%s/dirs.idx", g_WorkDir);
+    for (int r = 0; r < cfg->runs; r++) {
+        if (cold) unlink(index);
+        double started = Now();
+        pid_t pid = StartRfd(cfg, extra);
+        FinishRfd(pid, started, &last);
+        seconds[r] = last.seconds;
+    }
+    qsort(seconds, cfg->runs, sizeof(double), CompareDoubles);
+    const char* name = cold ? "scan_cold" : "scan_warm";
+    fprintf(stderr, "%-14s median %.3f s\n", name, seconds[cfg->runs / 2]);
+    BeginRecord(cfg, name);
+    printf(",\"runs\":%d,\"seconds_min\":%.6f,\"seconds_median\":%.6f,\"seconds_max\":%.6f",
+           cfg->runs, seconds[0], seconds[cfg->runs / 2], seconds[cfg->runs - 1]);
+    RecordResource(&last);
+    EndRecord();
+    free(seconds);
+}
+
+static int Connect(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(g_WorkDir) + sizeof(BENCH_SOCKET) + 1 > sizeof(addr.sun_path)) Fail("socket path too long");
+    memcpy(addr.sun_path, g_WorkDir, strlen(g_WorkDir));
+    strcat(addr.sun_path, "/" BENCH_SOCKET);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) Fail("socket failed: %s", strerror(errno));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends 'request' and reads the reply (up to its closing empty line)
+// into 'reply'
+static void RoundTrip(int fd, const char* request, char* reply, size_t size) {
+    size_t length = strlen(request);
+    if (write(fd, request, length) != (ssize_t)length) Fail("lost the server: %s", strerror(errno));
+    size_t used = 0;
+    while (used < 2 || reply[used - 1] != '\n' || reply[used - 2] != '\n') {
+        if (used == size - 1) Fail("reply too long");
+        ssize_t n = read(fd, reply + used, size - 1 - used);
+        if (n <= 0) Fail("lost the server");
+        used += (size_t)n;
+    }
+    reply[used] = '\0';
+}
+
+// A figure from the server's "stats" reply
+static long long ServerStat(int fd, const char* name) {
+    char reply[4096];
+    RoundTrip(fd, "stats\n", reply, sizeof(reply));
+    size_t length = strlen(name);
+    for (char* line = reply; *line != '\0'; line = strchr(line, '\n') + 1) {
+        if (strncmp(line, name, length) == 0 && line[length] == ' ') {
+            if (strncmp(line + length + 1, "yes", 3) == 0) return 1;
+            return strtoll(line + length + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+// Starts the server and waits until its watcher vouches for the index
+static int StartServer(const BenchConfig* cfg, double* started) {
+    const char* extra[] = {"--serve", "--socket", BENCH_SOCKET, "--verbosity", "0", NULL};
+    char socketPath[PATH_MAX];
+    snprintf(socketPath, sizeof(socketPath), "%s/%s", g_WorkDir, BENCH_SOCKET);
+    unlink(socketPath);
+    *started = Now();
+    g_ServerPid = StartRfd(cfg, extra);
+    int fd = -1;
+    while ((fd = Connect()) < 0) {
+        if (waitpid(g_ServerPid, NULL, WNOHANG) == g_ServerPid) {
+            g_ServerPid = -1;
+            Fail("the server exited");
+        }
+        if (Now() - *started > BENCH_TIMEOUT) Fail("the server didn't start");
+        usleep(1000);
+    }
+    while (ServerStat(fd, "watching") != 1) {
+        if (Now() - *started > BENCH_TIMEOUT) Fail("the server's watcher didn't start");
+        usleep(1000);
+    }
+    return fd;
+}
+
+// Times 'cfg->picks' round trips of 'request'
+static void BenchPicks(const BenchConfig* cfg, int fd, const char* name, const char* request) {
+    char reply[PATH_MAX + 64];
+    for (int i = 0; i < 100; i++) RoundTrip(fd, request, reply, sizeof(reply)); // Warm up
+    double* micros = (double*)malloc(cfg->picks * sizeof(double));
+    if (micros == NULL) Fail("out of memory");
+    double total = 0.0;
+    for (int i = 0; i < cfg->picks; i++) {
+        double started = Now();
+        RoundTrip(fd, request, reply, sizeof(reply));
+        micros[i] = (Now() - started) * 1e6;
+        total += micros[i];
+        if (strncmp(reply, "error: ", 7) == 0) Fail("%s: %s", name, reply + 7);
+    }
+    qsort(micros, cfg->picks, sizeof(double), CompareDoubles);
+    fprintf(stderr, "%-14s p50 %.1f us, p99 %.1f us\n", name, Percentile(micros, cfg->picks, 0.5),
+            Percentile(micros, cfg->picks, 0.99));
+    BeginRecord(cfg, name);
+    printf(",\"requests\":%d,\"us_mean\":%.3f,\"us_p50\":%.3f,\"us_p90\":%.3f,\"us_p99\":%.3f,\"us_p999\":%.3f,\"us_max\":%.3f",
+           cfg->picks, total / cfg->picks, Percentile(micros, cfg->picks, 0.5), Percentile(micros, cfg->picks, 0.9),
+           Percentile(micros, cfg->picks, 0.99), Percentile(micros, cfg->picks, 0.999), micros[cfg->picks - 1]);
+    EndRecord();
+    free(micros);
+}
+
+// What a storm does to its files
+enum { STORM_CREATE, STORM_RENAME, STORM_DELETE };
+
+// Files storm-i.txt and storm-(i + g_DirCount).txt share a directory, so
+// the rename storm moves each file over the next one there: only the last
+// 'g_DirCount' names are left afterwards
+static int StormSurvivors(const BenchConfig* cfg) {
+    return (cfg->storm < g_DirCount) ? cfg->storm : g_DirCount;
+}
+
+// Creates, renames or deletes storm files spread over the tree as fast as
+// possible, then times how long the watcher takes to bring the index's
+// file count to 'expected'
+static void BenchStorm(const BenchConfig* cfg, int fd, int mode, long long expected) {
+    char path[PATH_MAX], target[PATH_MAX];
+    int first = (mode == STORM_DELETE) ? cfg->storm - StormSurvivors(cfg) : 0;
+    int last = (mode == STORM_RENAME) ? cfg->storm - StormSurvivors(cfg) : cfg->storm;
+    double started = Now();
+    for (int i = first; i < last; i++) {
+        snprintf(path, sizeof(path), "%s/storm-%d.txt", g_Dirs[i % g_DirCount], i);
+        if (mode == STORM_CREATE) {
+            int file = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (file < 0) Fail("can't create %s: %s", path, strerror(errno));
+            close(file);
+        } else if (mode == STORM_RENAME) {
+            snprintf(target, sizeof(target), "%s/storm-%d.txt", g_Dirs[i % g_DirCount], i + g_DirCount);
+            if (rename(path, target) != 0) Fail("can't rename %s: %s", path, strerror(errno));
+        } else if (unlink(path) != 0) {
+            Fail("can't delete %s: %s", path, strerror(errno));
+        }
+    }
+    double issued = Now() - started;
+    int events = last - first;
+    long long files;
+    while ((files = ServerStat(fd, "files")) != expected) {
+        if (Now() - started > BENCH_TIMEOUT) Fail("the watcher saw %lld files, not %lld", files, expected);
+        usleep(200);
+    }
+    double settled = Now() - started;
+    const char* names[] = {"storm_create", "storm_rename", "storm_delete"};
+    const char* name = names[mode];
+    fprintf(stderr, "%-14s %d files in %.3f s (%.0f/s)\n", name, events, settled, events / settled);
+    BeginRecord(cfg, name);
+    printf(",\"events\":%d,\"issue_seconds\":%.6f,\"settle_seconds\":%.6f,\"events_per_second\":%.1f",
+           events, issued, settled, events / settled);
+    EndRecord();
+}
+
+// ====================================================================
+// --- Entry Point ---
+// ====================================================================
+
+// Returns non-zero if the options passed to rfd hold 'option value'
+static int RfdArgsHave(const BenchConfig* cfg, const char* option, const char* value) {
+    for (int i = 0; i + 1 < cfg->rfdArgCount; i++) {
+        if (strcmp(cfg->rfdArgs[i], option) == 0 && strcmp(cfg->rfdArgs[i + 1], value) == 0) return 1;
+    }
+    return 0;
+}
+
+static void Usage(const char* self) {
+    fprintf(stderr,
+            "Usage: %s [--rfd PATH] [--preload alloccount.so] [--tmpdir DIR] [--rev LABEL]\n"
+            "          [--depth D] [--fanout F] [--files N] [--name-length L] [--stat-fallback]\n"
+            "          [--runs R] [--picks N] [--storm N] [--seed S] [--keep] [-- RFD OPTIONS...]\n", self);
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig cfg = {"./rfd", NULL, NULL, "unknown", 3, 8, 20, 12, 0, 3, 20000, 2000, 1, 0, NULL, 0};
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--") == 0) {
+            cfg.rfdArgs = argv + i + 1;
+            cfg.rfdArgCount = argc - i - 1;
+            break;
+        } else if (strcmp(arg, "--stat-fallback") == 0) {
+            cfg.statFallback = 1;
+        } else if (strcmp(arg, "--keep") == 0) {
+            cfg.keep = 1;
+        } else if (value == NULL) {
+            Usage(argv[0]);
+        } else if (strcmp(arg, "--rfd") == 0) {
+            cfg.rfd = argv[++i];
+        } else if (strcmp(arg, "--preload") == 0) {
+            cfg.preload = argv[++i];
+        } else if (strcmp(arg, "--tmpdir") == 0) {
+            cfg.tmpBase = argv[++i];
+        } else if (strcmp(arg, "--rev") == 0) {
+            cfg.rev = argv[++i];
+        } else if (strcmp(arg, "--depth") == 0) {
+            cfg.depth = atoi(argv[++i]);
+        } else if (strcmp(arg, "--fanout") == 0) {
+            cfg.fanout = atoi(argv[++i]);
+        } else if (strcmp(arg, "--files") == 0) {
+            cfg.files = atoi(argv[++i]);
+        } else if (strcmp(arg, "--name-length") == 0) {
+            cfg.nameLength = atoi(argv[++i]);
+        } else if (strcmp(arg, "--runs") == 0) {
+            cfg.runs = atoi(argv[++i]);
+        } else if (strcmp(arg, "--picks") == 0) {
+            cfg.picks = atoi(argv[++i]);
+        } else if (strcmp(arg, "--storm") == 0) {
+            cfg.storm = atoi(argv[++i]);
+        } else if (strcmp(arg, "--seed") == 0) {
+            cfg.seed = strtoull(argv[++i], NULL, 10);
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    if (cfg.depth < 0 || cfg.fanout < 0 || cfg.files < 0 || cfg.runs < 1 || cfg.picks < 1 || cfg.storm < 0 ||
+        cfg.nameLength < 8 || cfg.nameLength > 200) {
+        fprintf(stderr, "rfd-bench: sizes out of range (names take 8 to 200 characters)\n");
+        return 1;
+    }
+    g_RandomState = cfg.seed ? cfg.seed : 1;
+    g_StartTime = time(NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // rfd runs in another directory, so it needs absolute paths
+    static char rfdPath[PATH_MAX], preloadPath[PATH_MAX];
+    if (realpath(cfg.rfd, rfdPath) == NULL) Fail("can't find %s", cfg.rfd);
+    cfg.rfd = rfdPath;
+    if (cfg.preload != NULL) {
+        if (realpath(cfg.preload, preloadPath) == NULL) Fail("can't find %s", cfg.preload);
+        cfg.preload = preloadPath;
+    }
+
+    // The tree and rfd's files, all in one temporary directory
+    const char* base = cfg.tmpBase ? cfg.tmpBase : getenv("TMPDIR");
+    int length = snprintf(g_TempDir, sizeof(g_TempDir), "%s/rfd-bench-XXXXXX", base ? base : "/tmp");
+    if (length >= (int)sizeof(g_TempDir) || mkdtemp(g_TempDir) == NULL) {
+        g_TempDir[0] = '\0';
+        Fail("can't make a temporary directory: %s", strerror(errno));
+    }
+    snprintf(g_TreeDir, sizeof(g_TreeDir), "%s/tree", g_TempDir);
+    snprintf(g_WorkDir, sizeof(g_WorkDir), "%s/work", g_TempDir);
+    snprintf(g_AllocLog, sizeof(g_AllocLog), "%s/allocs.txt", g_TempDir);
+    if (mkdir(g_TreeDir, 0755) != 0 || mkdir(g_WorkDir, 0755) != 0) Fail("can't populate %s", g_TempDir);
+    char dirsFile[PATH_MAX];
+    snprintf(dirsFile, sizeof(dirsFile), "%s/dirs.txt", g_WorkDir);
+    FILE* fp = fopen(dirsFile, "w");
+    if (fp == NULL) Fail("can't write %s", dirsFile);
+    fprintf(fp, "%s\n", g_TreeDir);
+    fclose(fp);
+
+    double started = Now();
+    GenerateTree(&cfg, g_TreeDir, 0);
+    double generated = Now() - started;
+    fprintf(stderr, "Generated %lld files in %d directories under %s (%.2f s)\n", g_FileCount, g_DirCount,
+            g_TreeDir, generated);
+    BeginRecord(&cfg, "generate");
+    printf(",\"seconds\":%.6f", generated);
+    EndRecord();
+
+    BenchScan(&cfg, 1);
+    BenchScan(&cfg, 0);
+
+    double serverStarted;
+    int fd = StartServer(&cfg, &serverStarted);
+    BeginRecord(&cfg, "server_start");
+    printf(",\"seconds\":%.6f", Now() - serverStarted);
+    EndRecord();
+    BenchPicks(&cfg, fd, "pick", "pick\n");
+    // The tree sampler keeps no names to filter
+    if (!RfdArgsHave(&cfg, "--sampler", "tree")) BenchPicks(&cfg, fd, "pick_filtered", "pick ext=jpg\n");
+    if (cfg.storm > 0 && g_DirCount > 0) {
+        long long files = ServerStat(fd, "files");
+        BenchStorm(&cfg, fd, STORM_CREATE, files + cfg.storm);
+        BenchStorm(&cfg, fd, STORM_RENAME, files + StormSurvivors(&cfg));
+        BenchStorm(&cfg, fd, STORM_DELETE, files);
+    }
+    close(fd);
+
+    // Stopping the server reports its peak memory and allocations
+    RunResult server;
+    kill(g_ServerPid, SIGTERM);
+    FinishRfd(g_ServerPid, serverStarted, &server);
+    g_ServerPid = -1;
+    BeginRecord(&cfg, "server");
+    printf(",\"seconds\":%.6f", server.seconds);
+    RecordResource(&server);
+    EndRecord();
+    fprintf(stderr, "%-14s peak RSS %ld KiB\n", "server", server.maxRssKb);
+
+    for (int i = 0; i < g_DirCount; i++) free(g_Dirs[i]);
+    free(g_Dirs);
+    Cleanup(cfg.keep);
+    return 0;
+}
@@ -1,16 +1,36 @@
+#define _GNU_SOURCE         // For accept4() and the other Linux-only calls
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>         // For fixed-width integers (uint32_t)
 #include <pthread.h>        // For threading (pthread_create, pthread_join)
 #include <unistd.h>         // For system calls (read, close, access, usleep)
 #include <signal.h>         // For signal handling (Ctrl+C)
 #include <dirent.h>         // For directory listing (opendir, readdir)
-#include <sys/stat.h>       // For file/directory info (stat)
+#include <sys/stat.h>       // For file/directory info (stat, fstatat)
+#include <sys/sysmacros.h>  // For splitting device numbers (major, minor)
+#include <sys/syscall.h>    // For raw directory reads (SYS_getdents64)
+#include <sys/resource.h>   // For the file descriptor limit (getrlimit)
+#include <fcntl.h>          // For opening directories relative to a parent (openat)
+#include <sys/mman.h>       // For mapping the index snapshot (mmap)
 #include <sys/inotify.h>    // For file watching (inotify_init, inotify_add_watch)
+#include <sys/epoll.h>      // For waiting on several descriptors at once (epoll_wait)
+#include <sys/eventfd.h>    // For waking the watcher thread (eventfd)
+#include <sys/socket.h>     // For the server's socket (socket, accept4)
+#include <sys/un.h>         // For Unix domain socket addresses (sockaddr_un)
+#include <sys/wait.h>       // For reaping opener processes (waitpid)
+#include <spawn.h>          // For starting the opener without a shell (posix_spawnp)
+#include <fnmatch.h>        // For exclude patterns with wildcards (fnmatch)
+#include <limits.h>         // For integer limits (INT_MAX)
 #include <linux/limits.h>   // For path size limits (PATH_MAX)
-#include <time.h>           // For seeding random numbers (srand, time)
+#include <time.h>           // For seeding random numbers (clock_gettime)
+#include <math.h>           // For reservoir skip lengths (log, exp, floor)
 #include <locale.h>         // For setting the character encoding (setlocale)
 #include <errno.h>          // For error codes (errno)
+#include <sched.h>          // For yielding while a slot or the ring is busy (sched_yield)
+#include <stdatomic.h>      // For flags shared between threads (atomic_int)
+#include <linux/stat.h>     // For the statx() result layout (struct statx)
+#include <linux/io_uring.h> // For batched stat/open calls (io_uring_setup)
 
 // ANSI escape codes for coloring text in the terminal
 #define COLOR_RESET   "\x1b[0m"
@@ -27,63 +47,649 @@
 // A dynamic array structure to hold a list of strings
 typedef struct {
     char** items;
-    int count;
-    int capacity;
+    int64_t count;
+    int64_t capacity;
 } StringList;
 
 // File to store directories
 #define DIRS_FILE "dirs.txt"
 
-// Tracks if the random number generator has been seeded
-static int g_RngSeeded = 0;
+// Binary snapshot of the file index, kept next to DIRS_FILE
+#define INDEX_FILE "dirs.idx"
+
+// Socket of the server (--serve), also next to DIRS_FILE unless --socket says otherwise
+#define SOCKET_FILE "rfd.sock"
+
+// Base seed of the random number generators (see RandomSeed)
+static uint64_t g_RngSeed = 0;
+
+// Set by --seed: scans then put what they find in a fixed order, so the
+// same seed picks the same files however the scanner threads raced
+static int g_SeedFixed = 0;
 
 // Global flag to signal all threads to stop (e.g., on Ctrl+C)
 // 'volatile sig_atomic_t' is a type guaranteed to be safe in a signal handler.
 static volatile sig_atomic_t g_running = 1;
 
+// Written to whenever g_running is cleared, so the watcher thread wakes
+// up from epoll_wait() and exits instead of having to be cancelled
+static int g_WakeFd = -1;
+
+// The watcher thread's event loop. The main thread adds descriptors of its
+// own to it (pidfds of spawned openers) for the watcher to take care of.
+static int g_EpollFd = -1;
+
+// Program the "open" command starts, with the file as its last argument
+static const char* g_Opener = "xdg-open";
+
+// Number of threads used to scan directories (0 = one per CPU core)
+static int g_ScanThreads = 0;
+
+// Set by --io-uring: scanner threads batch their stat and open calls
+static int g_UseIoUring = 0;
+
+// Set by --stream: pick by walking the directories each time instead of
+// keeping an index, which holds no per-file memory at all
+static int g_StreamMode = 0;
+
+// Set by --sampler tree: the index keeps per-directory file counts instead
+// of one entry per file (see the Tree Sampler section)
+static int g_TreeSampler = 0;
+
+// Set by --follow-symlinks: symbolic links count as what they point to.
+// Each directory is still read only once per scan (see InodeSet).
+static int g_FollowSymlinks = 0;
+
+// Set by --dedupe-hardlinks: a file with several names is indexed once
+static int g_DedupeHardlinks = 0;
+
+// Set by --ignore-dtype: every directory entry is stat()ed, as on
+// filesystems that don't report entry types. Lets benchmarks time that path.
+static int g_IgnoreDType = 0;
+
+// Set by --pick-budget: how long (ms) Enter waits for a first scan that is
+// still running before it picks from the files found so far
+#define PICK_BUDGET_DEFAULT_MS 100
+static int g_PickBudgetMs = PICK_BUDGET_DEFAULT_MS;
+
+// How directory entries are looked at and opened, which depends on
+// whether symbolic links are followed
+#define ENTRY_STAT_FLAGS (g_FollowSymlinks ? 0 : AT_SYMLINK_NOFOLLOW)
+#define ENTRY_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC | (g_FollowSymlinks ? 0 : O_NOFOLLOW))
+
+// Cleared when stdout is not a terminal, so piped output has no escape codes
+static int g_UseColor = 1;
+
+// How much the watcher reports about changes (--verbosity)
+#define VERBOSITY_QUIET 0       // Nothing
+#define VERBOSITY_SUMMARY 1     // A line per file while few change, else totals per root
+#define VERBOSITY_ALL 2         // A line for every event
+static int g_Verbosity = VERBOSITY_SUMMARY;
+
+// How --weight skews picks
+#define WEIGHT_UNIFORM 0
+#define WEIGHT_SIZE 1       // In proportion to the file size
+#define WEIGHT_RECENT 2     // In proportion to 1 / (1 + age in days)
+
+// Which files a pick may return, and how likely each of them is
+typedef struct {
+    int64_t minSize;        // -1 = no lower bound
+    int64_t maxSize;        // -1 = no upper bound
+    int64_t newerAge;       // Greatest age allowed (seconds before the pick), -1 = any
+    int64_t olderAge;       // Least age allowed, -1 = any
+    StringList exts;        // Allowed extensions, empty = any
+    int weight;             // One of the WEIGHT_ values
+} FileFilter;
+
+// Set by --ext, --min-size, --max-size, --newer, --older and --weight
+static FileFilter g_Filter = {-1, -1, -1, -1, {0}, WEIGHT_UNIFORM};
+
 // Stores the full path of the last file shown to the user
 static char g_LastShownFile[PATH_MAX] = {0};
 
+// Names are kept in a bump allocator and referred to by a NameRef: the
+// block number in the high bits, the offset inside the block in the low bits
+typedef uint64_t NameRef;
+
+#define ARENA_BLOCK_BITS 20
+#define ARENA_MAX_BLOCK_SIZE ((size_t)1 << ARENA_BLOCK_BITS)
+#define ARENA_MIN_BLOCK_SIZE ((size_t)4096)
+
+// Bump allocator for NUL-terminated names. Nothing is freed one by one;
+// all blocks go at once when the arena is dropped.
+typedef struct {
+    char** blocks;
+    int count;          // Blocks in use
+    int capacity;
+    size_t used;        // Bytes used in the last block
+    size_t size;        // Size of the last block
+} NameArena;
+
+// A directory: its own name plus the directory it lives in. Shared
+// prefixes are stored once, in the parent chain. The layout is written to
+// disk as-is by index snapshots, so it has no implicit padding.
+typedef struct {
+    NameRef name;       // Leaf name, or the full path for a root
+    int64_t mtime;      // Modification time (ns) when the directory was read
+    uint64_t ino;       // Inode number when the directory was read
+    int parent;         // Parent directory id, or one of the values below
+    uint32_t files;     // Regular files directly inside (tree sampler only, else zero)
+} DirNode;
+
+#define DIR_ROOT (-1)       // A starting directory; 'name' is its full path
+#define DIR_DETACHED (-2)   // Retired; no file refers to it any more
+
+// DirNode.mtime of a directory reached through a link after it had already
+// been read along another path (--follow-symlinks). It stays empty; its
+// 'ino' is that of the directory it leads to.
+#define DIR_MTIME_ALIAS (-1)
+
+// A regular file: the directory it lives in plus its own name. The full
+// path is only put together when the file is actually shown.
+typedef struct {
+    NameRef name;       // Leaf name
+    int dir;            // Id of the directory holding the file
+    uint32_t spare;     // Always zero (keeps the on-disk layout padding-free)
+} FileEntry;
+
+// Compact storage for a set of paths: a directory tree plus the files in
+// it, with every name living in one arena
+typedef struct {
+    DirNode* dirs;
+    int dirCount;
+    int dirCapacity;
+    FileEntry* files;
+    int64_t fileCount;  // 64-bit: aggregated trees can exceed INT_MAX files
+    int64_t fileCapacity;
+    // File attributes, one array per attribute and indexed like 'files',
+    // so a filter over one attribute reads one densely packed array
+    int64_t* sizes;     // Size in bytes
+    int64_t* mtimes;    // Modification time, seconds since the epoch
+    uint32_t* exts;     // Extension id (see FileExtensionId), 0 = none
+    NameArena names;
+} PathStore;
+
+// Open-addressing hash table of slot numbers. The keys themselves live in
+// the arrays the slots point into, so each table is probed by its own helper.
+typedef struct {
+    int64_t* slots;     // Slot numbers, or -1 for an empty bucket
+    int64_t capacity;   // Number of buckets, always a power of two
+} PathTable;
+
+// Per-directory counts used by the tree sampler. Every directory knows how
+// many files lie below it, and keeps a Fenwick tree over its children's
+// counts so one of them can be chosen by weight in O(log children).
+typedef struct {
+    int* kids;          // Child directory ids in the order they were attached, -1 = gone
+    int64_t* fenwick;   // 1-based Fenwick tree over the kids' totals
+    int kidCount;
+    int kidCapacity;
+    int64_t total;      // Regular files at or below this directory
+    int parentSlot;     // 1-based position in the parent's 'kids', 0 = not attached
+} TreeNode;
+
+// A long-lived index of every selectable file under the saved directories.
+// It is built once and reused by every pick; the watcher thread keeps it
+// current by adding and removing single entries.
+typedef struct {
+    StringList roots;   // The directory list the index was built from
+    PathStore store;    // Every regular file found under 'roots'
+    PathTable dirTable; // Finds a directory's id by (parent, name)
+    PathTable table;    // Finds a file's slot by (directory, name) for O(1) updates
+    int built;          // Non-zero once the index has been populated
+    int unverified;     // Loaded from a snapshot and not yet checked against disk
+    uint64_t generation; // Bumped whenever a file is added, removed or changed
+    void* map;          // Snapshot the arrays are borrowed from, if any
+    size_t mapSize;
+    // Tree sampler only: 'store' then holds directories but no files
+    int treeMode;
+    TreeNode* tree;     // Indexed like store.dirs
+    int treeCapacity;
+    TreeNode treeTop;   // Virtual parent of the roots
+    // Per-directory lists of files and subdirectories, so a whole subtree
+    // can be dropped in time proportional to its size. Built the first
+    // time a subtree goes and kept current from then on (flat index only).
+    int64_t* nextFile;  // Indexed like store.files: next file in the same directory, -1 = last
+    int64_t* prevFile;  // Previous file in the same directory, -1 = first
+    int64_t fileLinkCapacity;
+    int64_t* firstFile; // Indexed like store.dirs: first file inside, -1 = none
+    int* firstChild;    // First subdirectory, -1 = none
+    int* nextSibling;   // Next directory with the same parent, -1 = last
+    int* prevSibling;   // Previous one, -1 = first
+    int dirLinkCapacity;
+} FileIndex;
+
+static FileIndex g_Index = {0};
+
+// The index snapshot currently mapped into memory, if any. Arrays that
+// point into it are copied out before they grow and are never freed.
+static void* g_SnapshotMap = NULL;
+static size_t g_SnapshotSize = 0;
+
+// Guards g_Index, which the main thread reads and the watcher updates
+static pthread_mutex_t g_IndexLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Directories the watcher thread actually managed to watch. Only valid
+// (and never modified again) once g_WatcherReady is set.
+static StringList g_WatchedRoots = {0};
+static atomic_int g_WatcherReady = 0;
+
+// Set once the watcher has its watches in place, or has given up on them
+// (see WaitForWatcher)
+static atomic_int g_WatcherSettled = 0;
+static pthread_mutex_t g_WatcherSettledLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_WatcherSettledCond = PTHREAD_COND_INITIALIZER;
+
+// The saved directories as one immutable value: the list in DIRS_FILE
+// and the trees behind it. A new list means a new DirSet, published with
+// one atomic store (see PublishDirs), so scanner and watcher threads read
+// it without a lock and see one version or the other, never half of each.
+typedef struct {
+    StringList dirs;    // As listed in DIRS_FILE
+    StringList roots;   // NormalizeRoots() of 'dirs'
+} DirSet;
+
+static _Atomic(DirSet*) g_DirSet = NULL;
+
 // --- Prototypes ---
 StringList LoadDirs();
 void SaveDirs(const StringList* dirs);
-StringList GetAllFiles(const StringList* dirs);
+int DirsFileChanged(void);
+StringList NormalizeRoots(const StringList* dirs);
+const DirSet* PublishDirs(StringList dirs);
+void FreeDirSets(void);
+void LoadExcludes(void);
+void FreeExcludes(void);
+PathStore GetAllFiles(const StringList* dirs);
 void WriteColor(const char* color, const char* message);
 void HandleOpenCommand();
 void* WatcherThread(void* arg);
 void SignalHandler(int signum);
+void WakeWatcher(void);
+void MarkWatcherSettled(void);
+void InitStringList(StringList* list);
 void FreeStringList(StringList* list);
 void AddStringToList(StringList* list, const char* str);
+StringList CopyStringList(const StringList* list);
+NameRef ArenaAddName(NameArena* arena, const char* name);
+void FreeArena(NameArena* arena);
+void InitPathStore(PathStore* store);
+int StoreAddDir(PathStore* store, int parent, const char* name);
+int64_t StoreAddFile(PathStore* store, int dir, const char* name, int64_t size, int64_t mtime);
+uint32_t FileExtensionId(const char* name);
+uint32_t ExtensionIdOf(const char* ext);
+void FreeExtensions(void);
+int StoreDirPath(const PathStore* store, int dir, char* buffer, size_t size);
+int StorePathOf(const PathStore* store, int64_t slot, char* buffer, size_t size);
+void StoreAppendFiles(PathStore* dst, PathStore* src);
+void FreePathStore(PathStore* store);
+void ScanDirectories(const StringList* roots, PathStore* result);
+void ScanDirectory(const char* basePath, size_t rootLen, PathStore* result);
+void BuildFileIndex(FileIndex* index, const StringList* dirs);
+void IndexAdoptStore(FileIndex* index, const StringList* dirs, PathStore store);
+int IndexIsStale(const FileIndex* index, const StringList* dirs);
+void FreeFileIndex(FileIndex* index);
+void IndexPathOf(const FileIndex* index, int64_t slot, char* buffer, size_t size);
+void IndexAddFile(FileIndex* index, const char* path, const struct stat* st);
+void IndexRemoveFile(FileIndex* index, const char* path);
+void IndexRenameFile(FileIndex* index, const char* oldPath, const char* newPath);
+void IndexSetDirFiles(FileIndex* index, const char* dirPath, int64_t count);
+void IndexRecountDir(FileIndex* index, const char* dirPath);
+int64_t TreeCountFiles(const char* dirPath, size_t rootLen);
+void IndexRemoveTree(FileIndex* index, const char* dirPath);
+void IndexRenameTree(FileIndex* index, const char* oldDir, const char* newDir);
+void IndexAddScan(FileIndex* index, const PathStore* result);
+int StreamPickFiles(const StringList* dirs, int k, char* picks);
+void RandomSeed(uint64_t seed);
+uint64_t RandomBelow(uint64_t n);
+int IndexSaveSnapshot(const FileIndex* index, const char* path);
+int IndexLoadSnapshot(FileIndex* index, const StringList* dirs, const char* path);
+void IndexRevalidate(void);
+int FilterIsActive(const FileFilter* filter);
+int64_t IndexPickSlot(const FileIndex* index);
+int IndexPickPath(const FileIndex* index, char* buffer, size_t size);
+void FreeSelection(void);
+int64_t ParseSize(const char* text);
+int64_t ParseAge(const char* text);
+long long WriteRandomPaths(const FileIndex* index, long long count, int unique, char terminator);
+void PrepareIndexOffline(const StringList* dirs);
+int PreviewPick(char* buffer, size_t size, long long* found);
+int StartBackgroundScan(const StringList* roots, int preview);
+int BackgroundScanRunning(void);
+int BackgroundScanBusy(const StringList* roots, int budgetMs);
+void FinishBackgroundScan(void);
+void RefreshIndex(const StringList* roots);
+int ServerListen(const char* path);
+void RunServer(int listenFd, const char* socketPath, const StringList* roots);
+int64_t MonotonicNs(void);
+void StatPickLatency(int64_t ns);
+void FreeStats(void);
+void PrintStats(void);
+int WriteStatsFile(const char* path);
+int RunClient(const char* socketPath, const char* request, char terminator);
 
 // ====================================================================
 // PROGRAM ENTRY POINT
 // ====================================================================
-int main(void) {
+int main(int argc, char* argv[]) {
     // Use the system's native locale (e.g., UTF-8) for all I/O.
     // This allows printing and reading special characters like Cyrillic.
     setlocale(LC_ALL, "");
 
-    // Seed the random number generator once
-    srand((unsigned int)time(NULL));
-    g_RngSeeded = 1;
+    int sampleCount = 0;        // Set by --sample
+    long long batchCount = 0;   // Set by --count
+    int batchUnique = 0;        // Set by --unique
+    int haveSeed = 0;           // Set by --seed
+    uint64_t seed = 0;
+    char terminator = '\n';     // '\0' with --null
+    int serveMode = 0;          // Set by --serve
+    const char* socketPath = SOCKET_FILE; // Set by --socket
+    char* clientRequest = NULL; // Set by --client
+    const char* statsFile = NULL; // Set by --stats-file
+
+    // Parse command-line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            // Number of directory scanner threads (0 = one per core)
+            g_ScanThreads = atoi(argv[++i]);
+            if (g_ScanThreads < 0) g_ScanThreads = 0;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            // Batch the scanners' stat and open calls (for NFS and FUSE mounts)
+            g_UseIoUring = 1;
+        } else if (strcmp(argv[i], "--follow-symlinks") == 0) {
+            // Descend into linked directories and index linked files
+            g_FollowSymlinks = 1;
+        } else if (strcmp(argv[i], "--dedupe-hardlinks") == 0) {
+            // Index each file once, whatever number of names it has
+            g_DedupeHardlinks = 1;
+        } else if (strcmp(argv[i], "--ignore-dtype") == 0) {
+            // stat() every entry instead of trusting d_type (benchmarks)
+            g_IgnoreDType = 1;
+        } else if (strcmp(argv[i], "--pick-budget") == 0 && i + 1 < argc) {
+            // Longest wait (ms) for the first scan before a partial pick
+            g_PickBudgetMs = atoi(argv[++i]);
+            if (g_PickBudgetMs < 0) g_PickBudgetMs = 0;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            // Don't keep an index; every pick is a fresh single pass
+            g_StreamMode = 1;
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            // One-off run: print K distinct random files and quit
+            sampleCount = atoi(argv[++i]);
+            if (sampleCount < 1) sampleCount = 1;
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            // One-off run: print N random files from the index and quit
+            batchCount = strtoll(argv[++i], NULL, 10);
+            if (batchCount < 1) batchCount = 1;
+        } else if (strcmp(argv[i], "--unique") == 0) {
+            // --count without replacement
+            batchUnique = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            // Repeatable picks
+            seed = strtoull(argv[++i], NULL, 10);
+            haveSeed = 1;
+        } else if (strcmp(argv[i], "--null") == 0) {
+            // End each printed path with NUL instead of a newline (for xargs -0)
+            terminator = '\0';
+        } else if (strcmp(argv[i], "--ext") == 0 && i + 1 < argc) {
+            // Only pick files with one of these extensions ("jpg,png")
+            char* list = argv[++i];
+            for (char* ext = strtok(list, ","); ext != NULL; ext = strtok(NULL, ",")) {
+                AddStringToList(&g_Filter.exts, ext);
+            }
+        } else if ((strcmp(argv[i], "--min-size") == 0 || strcmp(argv[i], "--max-size") == 0) && i + 1 < argc) {
+            // Only pick files within a size range ("64K", "10M")
+            int64_t size = ParseSize(argv[i + 1]);
+            if (size < 0) {
+                fprintf(stderr, "Invalid size: %s\n", argv[i + 1]);
+                return 1;
+            }
+            if (argv[i][2] == 'm' && argv[i][3] == 'i') {
+                g_Filter.minSize = size;
+            } else {
+                g_Filter.maxSize = size;
+            }
+            i++;
+        } else if ((strcmp(argv[i], "--newer") == 0 || strcmp(argv[i], "--older") == 0) && i + 1 < argc) {
+            // Only pick files modified within (or before) an age ("12h", "7d")
+            int64_t age = ParseAge(argv[i + 1]);
+            if (age < 0) {
+                fprintf(stderr, "Invalid age: %s\n", argv[i + 1]);
+                return 1;
+            }
+            if (argv[i][2] == 'n') {
+                g_Filter.newerAge = age;
+            } else {
+                g_Filter.olderAge = age;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--weight") == 0 && i + 1 < argc) {
+            // Favour some files over others
+            const char* weight = argv[++i];
+            if (strcmp(weight, "size") == 0) {
+                g_Filter.weight = WEIGHT_SIZE;
+            } else if (strcmp(weight, "recent") == 0) {
+                g_Filter.weight = WEIGHT_RECENT;
+            } else if (strcmp(weight, "uniform") == 0) {
+                g_Filter.weight = WEIGHT_UNIFORM;
+            } else {
+                fprintf(stderr, "Unknown weight: %s (use size, recent or uniform)\n", weight);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--verbosity") == 0 && i + 1 < argc) {
+            // How much the watcher reports: 0 nothing, 1 summaries, 2 everything
+            g_Verbosity = atoi(argv[++i]);
+            if (g_Verbosity < VERBOSITY_QUIET) g_Verbosity = VERBOSITY_QUIET;
+            if (g_Verbosity > VERBOSITY_ALL) g_Verbosity = VERBOSITY_ALL;
+        } else if (strcmp(argv[i], "--opener") == 0 && i + 1 < argc) {
+            // Program the "open" command starts ("feh -F", "mpv")
+            g_Opener = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            // Keep the index warm and answer clients on a Unix domain socket
+            serveMode = 1;
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            // Where the counters are written at exit (see StatsDump)
+            statsFile = argv[++i];
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            // Where --serve listens and --client connects
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            // Send the rest of the command line as one request ("pick 5 ext=jpg")
+            size_t length = 0;
+            for (int j = i + 1; j < argc; j++) length += strlen(argv[j]) + 1;
+            clientRequest = (char*)calloc(length, 1);
+            if (clientRequest == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory for --client.\n");
+                return 1;
+            }
+            for (int j = i + 1; j < argc; j++) {
+                if (j > i + 1) strcat(clientRequest, " ");
+                strcat(clientRequest, argv[j]);
+            }
+            break;
+        } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            // How the index is kept: one entry per file, or counts per directory
+            const char* sampler = argv[++i];
+            if (strcmp(sampler, "tree") == 0) {
+                g_TreeSampler = 1;
+            } else if (strcmp(sampler, "flat") == 0) {
+                g_TreeSampler = 0;
+            } else {
+                fprintf(stderr, "Unknown sampler: %s (use flat or tree)\n", sampler);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--threads N] [--io-uring] [--follow-symlinks] [--dedupe-hardlinks] [--ignore-dtype]\n"
+                            "          [--stream] [--sample K] [--count N [--unique]] [--seed S] [--null] [--pick-budget MS]\n"
+                            "          [--ext LIST] [--min-size SIZE] [--max-size SIZE] [--newer AGE] [--older AGE]\n"
+                            "          [--weight size|recent|uniform] [--sampler flat|tree] [--opener CMD] [--verbosity 0-2]\n"
+                            "          [--serve] [--socket PATH] [--client REQUEST...] [--stats-file PATH]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // --client: one request to a running server, nothing else
+    if (clientRequest != NULL) {
+        int status = RunClient(socketPath, clientRequest, terminator);
+        free(clientRequest);
+        FreeStringList(&g_Filter.exts);
+        return status;
+    }
+    // The server answers from its index, nothing else
+    if (serveMode && (g_StreamMode || sampleCount > 0 || batchCount > 0)) {
+        fprintf(stderr, "--serve can't be combined with --stream, --sample or --count.\n");
+        return 1;
+    }
+
+    // Filters work on the attributes kept in the index
+    if (FilterIsActive(&g_Filter) && (g_StreamMode || sampleCount > 0)) {
+        fprintf(stderr, "Filters and weights need the file index; they can't be used with --stream or --sample.\n");
+        return 1;
+    }
+    if (batchUnique && g_Filter.weight != WEIGHT_UNIFORM) {
+        fprintf(stderr, "--unique can't be combined with --weight.\n");
+        return 1;
+    }
+    // The tree sampler only counts files, so it knows nothing to filter on
+    if (g_TreeSampler && (FilterIsActive(&g_Filter) || batchUnique)) {
+        fprintf(stderr, "--sampler tree can't be combined with filters, weights or --unique.\n");
+        return 1;
+    }
+    // and a pick re-reads its directory, where every name counts
+    if (g_TreeSampler && g_DedupeHardlinks) {
+        fprintf(stderr, "--sampler tree can't be combined with --dedupe-hardlinks.\n");
+        return 1;
+    }
+
+    // Seed the random number generators once
+    if (!haveSeed) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        seed = ((uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    }
+    RandomSeed(seed);
+    g_SeedFixed = haveSeed;
+
+    // No escape codes unless a terminal is going to interpret them
+    g_UseColor = isatty(STDOUT_FILENO);
+
+    // Patterns that keep subtrees out of every scan
+    LoadExcludes();
 
-    // Set up a handler for Ctrl+C (SIGINT signal)
-    signal(SIGINT, SignalHandler);
+    // --count: print N picks from the index in large writes and quit
+    if (batchCount > 0) {
+        const DirSet* set = PublishDirs(LoadDirs());
+        PrepareIndexOffline(&set->roots);
+        long long written = WriteRandomPaths(&g_Index, batchCount, batchUnique, terminator);
+        if (statsFile != NULL) WriteStatsFile(statsFile);
+        FreeStats();
+        FreeSelection();
+        FreeFileIndex(&g_Index);
+        FreeExtensions();
+        FreeStringList(&g_Filter.exts);
+        FreeDirSets();
+        FreeExcludes();
+        return (written > 0) ? 0 : 1;
+    }
+
+    // --sample: stream through the directories once, print and quit
+    if (sampleCount > 0) {
+        const DirSet* set = PublishDirs(LoadDirs());
+        char* picks = (char*)malloc((size_t)sampleCount * PATH_MAX);
+        if (picks == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory for --sample.\n");
+            return 1;
+        }
+        int count = StreamPickFiles(&set->roots, sampleCount, picks);
+        for (int i = 0; i < count; i++) {
+            printf("%s%c", picks + (size_t)i * PATH_MAX, terminator);
+        }
+        free(picks);
+        if (statsFile != NULL) WriteStatsFile(statsFile);
+        FreeStats();
+        FreeDirSets();
+        FreeExcludes();
+        return (count > 0) ? 0 : 1;
+    }
+
+    // Set up a handler for Ctrl+C (SIGINT signal). No SA_RESTART, so a
+    // blocked fgets() returns right away instead of waiting for Enter.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SignalHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    // A server is usually stopped with SIGTERM; it saves its index first
+    if (serveMode) sigaction(SIGTERM, &action, NULL);
+
+    // Lets the main thread (and the signal handler) wake the watcher
+    g_WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_WakeFd < 0) {
+        perror(COLOR_RED "Failed to create eventfd" COLOR_RESET);
+        return 1;
+    }
+    g_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_EpollFd < 0) {
+        perror(COLOR_RED "Failed to create epoll instance" COLOR_RESET);
+        return 1;
+    }
+    // Claim the socket before any work, so a second server gives up at once
+    int listenFd = serveMode ? ServerListen(socketPath) : -1;
+    if (serveMode && listenFd < 0) return 1;
 
     WriteColor(COLOR_CYAN, "Random Filepath Displayer by Calc++\n");
-    printf("Press Enter to display a random file.\n");
-    printf("Type 'newdir', 'removedir', 'viewdir', 'open', or 'exit' to quit.\n\n");
+    if (!serveMode) {
+        printf("Press Enter to display a random file.\n");
+        printf("Type 'newdir', 'removedir', 'viewdir', 'open', 'stats', or 'exit' to quit.\n\n");
+    }
 
-    StringList dirs = LoadDirs();
+    // The saved directories, shared with the other threads. Only this
+    // thread replaces them, so 'set' stays valid until it does.
+    const DirSet* set = PublishDirs(LoadDirs());
 
-    if (dirs.count == 0) {
+    if (set->dirs.count == 0) {
         WriteColor(COLOR_RED, "[!!!] I have no idea where to look! Be my guest, give me a clue!\n");
+    } else if (!g_StreamMode) {
+        // Pick up where the last run left off; the watcher checks it against the disk
+        pthread_mutex_lock(&g_IndexLock);
+        if (IndexLoadSnapshot(&g_Index, &set->roots, INDEX_FILE)) {
+            printf("Loaded %lld files from the saved index.\n", (long long)g_Index.store.fileCount);
+        }
+        pthread_mutex_unlock(&g_IndexLock);
     }
 
     // Start the background thread that watches for file changes
     pthread_t watcherThreadID;
-    if (pthread_create(&watcherThreadID, NULL, WatcherThread, &dirs) != 0) {
+    if (pthread_create(&watcherThreadID, NULL, WatcherThread, NULL) != 0) {
         perror(COLOR_RED "Failed to create watcher thread" COLOR_RESET);
+        MarkWatcherSettled(); // Nobody else will
+    }
+
+    // --serve: answer clients instead of the prompt, from an index that is
+    // ready before the first one connects
+    if (serveMode) {
+        pthread_mutex_lock(&g_IndexLock);
+        int built = g_Index.built;
+        pthread_mutex_unlock(&g_IndexLock);
+        if (!built && set->roots.count > 0 && StartBackgroundScan(&set->roots, 0)) {
+            FinishBackgroundScan(); // Read once the watches are in place
+        } else if (!built && set->roots.count > 0) {
+            pthread_mutex_lock(&g_IndexLock);
+            BuildFileIndex(&g_Index, &set->roots);
+            IndexSaveSnapshot(&g_Index, INDEX_FILE);
+            pthread_mutex_unlock(&g_IndexLock);
+        }
+        RunServer(listenFd, socketPath, &set->roots);
+        g_running = 0;
+    } else if (!g_StreamMode && set->roots.count > 0) {
+        // No saved index to pick from: start reading the trees right away,
+        // so Enter has something to offer before the scan is done
+        pthread_mutex_lock(&g_IndexLock);
+        int built = g_Index.built;
+        pthread_mutex_unlock(&g_IndexLock);
+        if (!built) {
+            printf("Reading the saved directories in the background...\n");
+            StartBackgroundScan(&set->roots, 1);
+        }
     }
 
     char cmd[PATH_MAX]; // Input buffer
@@ -108,21 +714,50 @@ int main(void) {
 
         // [Enter] key (empty command)
         if (strlen(cmd) == 0) {
-            dirs = LoadDirs(); // Re-load dirs from file
-            StringList files = GetAllFiles(&dirs);
-            if (files.count == 0) {
+            // Re-load dirs from file, if someone edited it
+            if (DirsFileChanged()) set = PublishDirs(LoadDirs());
+            int64_t startNs = MonotonicNs(); // For the pick latency histogram
+            int picked = 0;
+            int filteredOut = 0; // Files exist, but none passes the filters
+            long long partial = -1; // Files found so far, for a partial pick
+            // Only walk the trees again if the index no longer matches them
+            if (!g_StreamMode) RefreshIndex(&set->roots);
+            if (BackgroundScanBusy(&set->roots, g_PickBudgetMs)) {
+                // The scan is still running: pick from what it found
+                int result = PreviewPick(g_LastShownFile, PATH_MAX, &partial);
+                picked = (result == 1);
+                filteredOut = (result == -1);
+            } else if (g_StreamMode) {
+                // One pass over the trees, keeping nothing but the winner
+                picked = (StreamPickFiles(&set->roots, 1, g_LastShownFile) == 1);
+            } else {
+                pthread_mutex_lock(&g_IndexLock);
+                // Pick a random file that passes the filters, if any, and
+                // store its path in the global variable
+                int result = IndexPickPath(&g_Index, g_LastShownFile, PATH_MAX);
+                picked = (result == 1);
+                filteredOut = (result == -1);
+                pthread_mutex_unlock(&g_IndexLock);
+            }
+            StatPickLatency(MonotonicNs() - startNs);
+
+            if (partial >= 0 && !picked) {
+                WriteColor(COLOR_YELLOW, filteredOut ? "No file found so far matches the filters; still scanning.\n"
+                                                     : "No files found yet; still scanning.\n");
+            } else if (filteredOut) {
+                WriteColor(COLOR_YELLOW, "No file matches the filters.\n");
+            } else if (!picked) {
                 WriteColor(COLOR_RED, "[!!!] I have no idea where to look! Be my guest, give me a clue!\n");
             } else {
-                // Pick a random index from the file list
-                int index = rand() % files.count;
-                // Store the chosen file path in the global variable
-                strncpy(g_LastShownFile, files.items[index], PATH_MAX - 1);
-                
                 char buffer[PATH_MAX + 32];
-                snprintf(buffer, sizeof(buffer), "%s%s\n", COLOR_LIGHT_BLUE, g_LastShownFile);
-                WriteColor(buffer, ""); // Print the colored path
+                snprintf(buffer, sizeof(buffer), "%s\n", g_LastShownFile);
+                WriteColor(COLOR_LIGHT_BLUE, buffer); // Print the colored path
+                if (partial >= 0) {
+                    // Only uniform over the part of the trees read so far
+                    snprintf(buffer, sizeof(buffer), "(Partial index: picked among %lld files found so far.)\n", partial);
+                    WriteColor(COLOR_YELLOW, buffer);
+                }
             }
-            FreeStringList(&files);
         }
         // Logic for the "newdir" command
         else if (strcmp(cmd, "newdir") == 0) {
@@ -137,8 +772,8 @@ int main(void) {
             } else {
                 // Check if directory is already in the list
                 int found = 0;
-                for (int i = 0; i < dirs.count; i++) {
-                    if (strcmp(dirs.items[i], cmd) == 0) {
+                for (int i = 0; i < set->dirs.count; i++) {
+                    if (strcmp(set->dirs.items[i], cmd) == 0) {
                         found = 1;
                         break;
                     }
@@ -146,8 +781,12 @@ int main(void) {
                 if (found) {
                     WriteColor(COLOR_RED, "Directory already in list.\n");
                 } else {
+                    // A new version of the list; the old one stays intact
+                    // for whoever is still reading it
+                    StringList dirs = CopyStringList(&set->dirs);
                     AddStringToList(&dirs, cmd);
                     SaveDirs(&dirs);
+                    set = PublishDirs(dirs);
                     char buffer[PATH_MAX + 32];
                     snprintf(buffer, sizeof(buffer), "[+] Added: %s\n", cmd);
                     WriteColor(COLOR_GREEN, buffer);
@@ -156,19 +795,22 @@ int main(void) {
         }
         // Logic for the "removedir" command
         else if (strcmp(cmd, "removedir") == 0) {
-            if (dirs.count == 0) {
+            if (set->dirs.count == 0) {
                 WriteColor(COLOR_RED, "[!!!] No directories to remove.\n");
                 continue;
             }
             // List all directories with 1-based index
             printf("Saved directories:\n");
-            for (int i = 0; i < dirs.count; i++) {
-                printf("%d. %s\n", i + 1, dirs.items[i]);
+            for (int i = 0; i < set->dirs.count; i++) {
+                printf("%d. %s\n", i + 1, set->dirs.items[i]);
             }
             printf("Enter index or path to remove: ");
             if (fgets(cmd, sizeof(cmd), stdin) == NULL) break;
             cmd[strcspn(cmd, "\r\n")] = '\0';
 
+            // Edited as a new version of the list, like in "newdir"
+            StringList dirs = CopyStringList(&set->dirs);
+
             long idx = strtol(cmd, NULL, 10) - 1; // Try parsing as 1-based index
             int removed = 0;
 
@@ -207,22 +849,28 @@ int main(void) {
             
             if (removed) {
                 SaveDirs(&dirs);
+                set = PublishDirs(dirs);
             } else {
                 printf("Invalid index or directory not found in list.\n");
+                FreeStringList(&dirs);
             }
         }
         // Logic for the "viewdir" command
         else if (strcmp(cmd, "viewdir") == 0) {
-            dirs = LoadDirs(); // Re-load
-            if (dirs.count == 0) {
+            if (DirsFileChanged()) set = PublishDirs(LoadDirs()); // Re-load if edited
+            if (set->dirs.count == 0) {
                 WriteColor(COLOR_RED, "[!!!] No directories saved yet.\n");
             } else {
                 WriteColor(COLOR_CYAN, "Saved directories:\n");
-                for (int i = 0; i < dirs.count; i++) {
-                    printf(" - %s\n", dirs.items[i]);
+                for (int i = 0; i < set->dirs.count; i++) {
+                    printf(" - %s\n", set->dirs.items[i]);
                 }
             }
         }
+        // Logic for the "stats" command
+        else if (strcmp(cmd, "stats") == 0) {
+            PrintStats();
+        }
         // Logic for the "open" command
         else if (strcmp(cmd, "open") == 0) {
             HandleOpenCommand();
@@ -240,24 +888,69 @@ int main(void) {
     // --- Cleanup ---
     g_running = 0; // Ensure the global running flag is set to false
 
-    // Force the watcher thread to terminate (it may be blocked on read)
-    pthread_cancel(watcherThreadID);
-    // Wait for the thread to actually finish
+    // Wake the watcher thread and wait for it to finish on its own
+    WakeWatcher();
     pthread_join(watcherThreadID, NULL);
+    FinishBackgroundScan(); // Its workers stop once they see g_running cleared
+    close(g_WakeFd);
+    close(g_EpollFd);
+    // Written once the watcher's counts are in
+    if (statsFile != NULL) WriteStatsFile(statsFile);
+
+    // Save the index for the next start, unless it was never fully checked
+    pthread_mutex_lock(&g_IndexLock);
+    if (g_Index.built && !g_Index.unverified) {
+        IndexSaveSnapshot(&g_Index, INDEX_FILE);
+    }
+    pthread_mutex_unlock(&g_IndexLock);
     
-    FreeStringList(&dirs);
-    printf(COLOR_RESET); // Reset terminal color
+    FreeDirSets();
+    FreeSelection();
+    FreeFileIndex(&g_Index);
+    FreeExtensions();
+    FreeStringList(&g_Filter.exts);
+    FreeStringList(&g_WatchedRoots);
+    FreeExcludes();
+    FreeStats();
+    if (g_UseColor) printf(COLOR_RESET); // Reset terminal color
     return 0;
 }
 
 // Signal handler for Ctrl+C (SIGINT)
 void SignalHandler(int signum) {
-    if (signum == SIGINT) {
+    if (signum == SIGINT || signum == SIGTERM) {
         WriteColor(COLOR_YELLOW, "\nInterrupted by user. Exiting...\n");
         g_running = 0; // Set the global flag to stop all loops
+        WakeWatcher();
     }
 }
 
+// Wakes the watcher thread so it notices g_running. Async-signal-safe.
+void WakeWatcher(void) {
+    uint64_t one = 1;
+    if (g_WakeFd >= 0) {
+        ssize_t ignored = write(g_WakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Tells whoever waits in WaitForWatcher that the watches are in place, or
+// that there will be none
+void MarkWatcherSettled(void) {
+    pthread_mutex_lock(&g_WatcherSettledLock);
+    g_WatcherSettled = 1;
+    pthread_cond_broadcast(&g_WatcherSettledCond);
+    pthread_mutex_unlock(&g_WatcherSettledLock);
+}
+
+// Waits until the watcher has placed its watches (or given up). A tree
+// read after that cannot change unseen.
+static void WaitForWatcher(void) {
+    pthread_mutex_lock(&g_WatcherSettledLock);
+    while (!g_WatcherSettled) pthread_cond_wait(&g_WatcherSettledCond, &g_WatcherSettledLock);
+    pthread_mutex_unlock(&g_WatcherSettledLock);
+}
+
 
 // ====================================================================
 // --- StringList (Dynamic String Array) Helpers ---
@@ -274,8 +967,11 @@ void InitStringList(StringList* list) {
 void AddStringToList(StringList* list, const char* str) {
     // If the list is full, double its capacity
     if (list->count == list->capacity) {
-        int newCapacity = (list->capacity == 0) ? 8 : list->capacity * 2;
-        char** newItems = (char**)realloc(list->items, newCapacity * sizeof(char*));
+        int64_t newCapacity = (list->capacity == 0) ? 8 : list->capacity * 2;
+        char** newItems = NULL;
+        if ((uint64_t)newCapacity <= SIZE_MAX / sizeof(char*)) {
+            newItems = (char**)realloc(list->items, (size_t)newCapacity * sizeof(char*));
+        }
         if (newItems == NULL) {
             WriteColor(COLOR_RED, "Fatal: Out of memory in AddStringToList.\n");
             exit(1);
@@ -292,6 +988,14 @@ void AddStringToList(StringList* list, const char* str) {
     list->count++;
 }
 
+// Returns a list of its own holding the same strings
+StringList CopyStringList(const StringList* list) {
+    StringList copy;
+    InitStringList(&copy);
+    for (int i = 0; i < list->count; i++) AddStringToList(&copy, list->items[i]);
+    return copy;
+}
+
 // Frees all strings inside the list and the list's items array
 void FreeStringList(StringList* list) {
     for (int i = 0; i < list->count; i++) {
@@ -302,247 +1006,6429 @@ void FreeStringList(StringList* list) {
 }
 
 // ====================================================================
-// --- Utility Functions ---
+// --- Instrumentation ---
 // ====================================================================
+// Counters and timers for the hot paths, cheap enough to leave on. Each
+// thread counts into a block of its own with plain (relaxed) loads and
+// stores, never a locked add, and the blocks are only summed when someone
+// asks: the "stats" command, a server's "stats" request or --stats-file.
+// A thread that exits folds its counts into g_StatsRetired first, so the
+// short-lived scanner threads are not lost.
 
-// Reads the list of directories from "dirs.txt"
-StringList LoadDirs() {
-    StringList dirs;
-    InitStringList(&dirs);
-    FILE* fp = fopen(DIRS_FILE, "r"); // Open for reading
+typedef enum {
+    STAT_DIRS_OPENED,       // Directories opened and read by the scanner
+    STAT_DIRS_FAILED,       // Directories that could not be opened
+    STAT_GETDENTS_CALLS,    // getdents64 calls that returned entries
+    STAT_ENTRIES_READ,      // Entries they returned, minus "." and ".."
+    STAT_STAT_FALLBACKS,    // stat() calls made because d_type was unknown
+    STAT_FILES_FOUND,       // Files the scanner added
+    STAT_BYTES_ALLOCATED,   // Name blocks and arrays allocated for file lists
+    STAT_SCANS,             // Scans of whole trees or parts of them
+    STAT_EVENTS_CREATE,     // inotify events by type
+    STAT_EVENTS_DELETE,
+    STAT_EVENTS_MOVED_FROM,
+    STAT_EVENTS_MOVED_TO,
+    STAT_EVENTS_CHANGE,     // IN_CLOSE_WRITE and IN_ATTRIB
+    STAT_EVENTS_GONE,       // IN_DELETE_SELF and IN_IGNORED
+    STAT_QUEUE_OVERFLOWS,   // IN_Q_OVERFLOW: events the kernel dropped
+    STAT_TIMED_PICKS,       // Picks in the latency histogram
+    STAT_PICK_NS,           // Their total time
+    STAT_COUNT
+} StatId;
 
-    if (fp == NULL) {
-        // File doesn't exist, create an empty one.
-        fp = fopen(DIRS_FILE, "w");
-        if (fp) fclose(fp);
-        return dirs; // Return empty list
-    }
+// Names in the machine-readable dump, in StatId order
+static const char* const g_StatNames[STAT_COUNT] = {
+    "dirs_opened", "dirs_failed", "getdents_calls", "entries_read", "stat_fallbacks", "files_found",
+    "bytes_allocated", "scans", "events_create", "events_delete", "events_moved_from", "events_moved_to",
+    "events_change", "events_gone", "queue_overflows", "timed_picks", "pick_ns_total"};
 
-    char buffer[PATH_MAX];
-    while (fgets(buffer, PATH_MAX, fp)) {
-        buffer[strcspn(buffer, "\r\n")] = '\0'; // Trim newline
-        // Add non-empty lines to the list
-        if (strlen(buffer) > 0) {
-            AddStringToList(&dirs, buffer);
-        }
-    }
-    fclose(fp);
-    return dirs;
-}
+// Pick latency histogram: bucket b counts picks that took less than 2^b
+// nanoseconds (and at least half that)
+#define STAT_LATENCY_BUCKETS 40
 
-// Writes the current list of directories back to "dirs.txt"
-void SaveDirs(const StringList* dirs) {
-    FILE* fp = fopen(DIRS_FILE, "w"); // Open for writing
-    if (fp) {
-        for (int i = 0; i < dirs->count; i++) {
-            fprintf(fp, "%s\n", dirs->items[i]);
-        }
-        fclose(fp);
-    }
-}
+typedef struct StatsBlock {
+    atomic_ullong counters[STAT_COUNT];
+    atomic_ullong latency[STAT_LATENCY_BUCKETS];
+    struct StatsBlock* next;    // In g_StatsThreads
+} StatsBlock;
 
-// Recursively scans a directory and adds all files to the list
-void GetAllFilesRecursive(const char* basePath, StringList* fileList) {
-    DIR* dir = opendir(basePath);
-    if (!dir) {
-        // Error (e.g., permissions denied)
-        char buffer[PATH_MAX + 64];
-        snprintf(buffer, sizeof(buffer), "Warning: Access denied to directory %s. Skipping.\n", basePath);
-        WriteColor(COLOR_YELLOW, buffer);
-        return;
-    }
+// Scan times of one saved directory, over every scan that read it or part of it
+typedef struct {
+    char* path;
+    long long scans;
+    double lastSeconds, maxSeconds, totalSeconds;
+    long long dirs, files;      // Found by the last scan of the whole tree
+} RootStats;
 
-    struct dirent* entry;
-    // Read all entries in the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip "." and ".."
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+static pthread_mutex_t g_StatsLock = PTHREAD_MUTEX_INITIALIZER; // Guards everything below
+static StatsBlock* g_StatsThreads = NULL;   // Blocks of the threads still running
+static StatsBlock g_StatsRetired;           // Sum over the threads that exited
+static RootStats* g_RootStats = NULL;
+static int g_RootStatsCount = 0;
+static int g_RootStatsCapacity = 0;
+static pthread_key_t g_StatsKey;            // Runs StatsThreadDone() at thread exit
+static pthread_once_t g_StatsOnce = PTHREAD_ONCE_INIT;
+static _Thread_local StatsBlock* g_ThreadStats = NULL;
 
-        // Construct the full path
-        char fullPath[PATH_MAX];
-        snprintf(fullPath, PATH_MAX, "%s/%s", basePath, entry->d_name);
+// Nanoseconds on a clock that never jumps
+int64_t MonotonicNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-                // Check if the entry is a directory or file
-        #if defined(DT_DIR) && defined(DT_REG) && defined(DT_UNKNOWN)
-                if (entry->d_type == DT_DIR) {
-                    // It's a directory, recurse
-                    GetAllFilesRecursive(fullPath, fileList);
-                } else if (entry->d_type == DT_REG) {
-                    // It's a regular file, add it
-                    AddStringToList(fileList, fullPath);
-                } else if (entry->d_type == DT_UNKNOWN) {
-                    // Filesystem doesn't supply d_type, use stat() as a fallback
-                    struct stat st;
-                    if (stat(fullPath, &st) == 0) {
-                        if (S_ISDIR(st.st_mode)) {
-                            GetAllFilesRecursive(fullPath, fileList);
-                        } else if (S_ISREG(st.st_mode)) {
-                            AddStringToList(fileList, fullPath);
-                        }
-                    }
-                }
-        #else
-                {
-                    // d_type constants not available on this platform; always use stat()
-                    struct stat st;
-                    if (stat(fullPath, &st) == 0) {
-                        if (S_ISDIR(st.st_mode)) {
-                            GetAllFilesRecursive(fullPath, fileList);
-                        } else if (S_ISREG(st.st_mode)) {
-                            AddStringToList(fileList, fullPath);
-                        }
-                    } else {
-                        char buffer[PATH_MAX + 64];
-                        snprintf(buffer, sizeof(buffer), "Warning: stat failed for %s: %s. Skipping.\n", fullPath, strerror(errno));
-                        WriteColor(COLOR_YELLOW, buffer);
-                    }
-                }
-        #endif
-    }
-    closedir(dir);
+// Adds every count in 'src' to 'dst'
+static void StatsAddBlock(StatsBlock* dst, StatsBlock* src) {
+    for (int i = 0; i < STAT_COUNT; i++) atomic_fetch_add(&dst->counters[i], atomic_load(&src->counters[i]));
+    for (int i = 0; i < STAT_LATENCY_BUCKETS; i++) atomic_fetch_add(&dst->latency[i], atomic_load(&src->latency[i]));
 }
 
-// Gets a list of all files from all saved directories
-StringList GetAllFiles(const StringList* dirs) {
-    StringList files;
-    InitStringList(&files);
-    // Iterate over each base directory and start the recursive scan
-    for (int i = 0; i < dirs->count; i++) {
-        struct stat st;
-        if (stat(dirs->items[i], &st) == 0 && S_ISDIR(st.st_mode)) {
-            GetAllFilesRecursive(dirs->items[i], &files);
+// Thread exit: keep the counts, drop the block
+static void StatsThreadDone(void* arg) {
+    StatsBlock* block = (StatsBlock*)arg;
+    pthread_mutex_lock(&g_StatsLock);
+    StatsAddBlock(&g_StatsRetired, block);
+    for (StatsBlock** link = &g_StatsThreads; *link != NULL; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
         }
     }
-    return files;
+    pthread_mutex_unlock(&g_StatsLock);
+    free(block);
 }
 
-// Helper function to print text with a specific ANSI color
-void WriteColor(const char* color, const char* message) {
-    printf("%s%s" COLOR_RESET, color, message);
+static void StatsInit(void) {
+    pthread_key_create(&g_StatsKey, StatsThreadDone);
 }
 
-// Handles the "open" command logic
-void HandleOpenCommand() {
-    if (strlen(g_LastShownFile) == 0) {
-        WriteColor(COLOR_YELLOW, "No file has been displayed yet. Press Enter first.\n");
-        return;
+// The calling thread's block, made on its first count
+static StatsBlock* StatsThreadBlock(void) {
+    pthread_once(&g_StatsOnce, StatsInit);
+    StatsBlock* block = (StatsBlock*)calloc(1, sizeof(StatsBlock));
+    if (block == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in StatsThreadBlock.\n");
+        exit(1);
     }
+    pthread_mutex_lock(&g_StatsLock);
+    block->next = g_StatsThreads;
+    g_StatsThreads = block;
+    pthread_mutex_unlock(&g_StatsLock);
+    pthread_setspecific(g_StatsKey, block);
+    g_ThreadStats = block;
+    return block;
+}
 
-    // Check if the file still exists using access()
-    if (access(g_LastShownFile, F_OK) != 0) {
-        char buffer[PATH_MAX + 64];
-        snprintf(buffer, sizeof(buffer), "File not found. It may have been moved or deleted: %s\n", g_LastShownFile);
-        WriteColor(COLOR_RED, buffer);
-        return;
+// Bumps one of this thread's counters. Only this thread writes it, so
+// a plain load and store will do; readers may see it a moment late.
+static inline void StatAdd(StatId id, unsigned long long amount) {
+    StatsBlock* block = g_ThreadStats ? g_ThreadStats : StatsThreadBlock();
+    atomic_ullong* counter = &block->counters[id];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+// Records how long a pick took
+void StatPickLatency(int64_t ns) {
+    if (ns < 0) ns = 0;
+    int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll((unsigned long long)ns);
+    if (bucket >= STAT_LATENCY_BUCKETS) bucket = STAT_LATENCY_BUCKETS - 1;
+    StatAdd(STAT_TIMED_PICKS, 1);
+    StatAdd(STAT_PICK_NS, (unsigned long long)ns);
+    atomic_ullong* counter = &g_ThreadStats->latency[bucket];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+// Counts an inotify event by its type
+static void StatCountEvent(uint32_t mask) {
+    if (mask & IN_Q_OVERFLOW) {
+        StatAdd(STAT_QUEUE_OVERFLOWS, 1);
+    } else if (mask & (IN_DELETE_SELF | IN_IGNORED)) {
+        StatAdd(STAT_EVENTS_GONE, 1);
+    } else if (mask & IN_CREATE) {
+        StatAdd(STAT_EVENTS_CREATE, 1);
+    } else if (mask & IN_DELETE) {
+        StatAdd(STAT_EVENTS_DELETE, 1);
+    } else if (mask & IN_MOVED_FROM) {
+        StatAdd(STAT_EVENTS_MOVED_FROM, 1);
+    } else if (mask & IN_MOVED_TO) {
+        StatAdd(STAT_EVENTS_MOVED_TO, 1);
+    } else if (mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+        StatAdd(STAT_EVENTS_CHANGE, 1);
     }
+}
 
-    // --- Use 'xdg-open' to open the file with the default app ---
-    
-    // 1. We must escape the filename for the shell to prevent injection attacks.
-    // 2. Allocate a buffer large enough for the escaped path.
-    //    (Worst case: every char is ' + \, so 4*len + 3 for quotes and null)
-    char* escapedPath = (char*)malloc(strlen(g_LastShownFile) * 4 + 3);
-    if (!escapedPath) {
-        WriteColor(COLOR_RED, "Failed to allocate memory for 'open' command.\n");
-        return;
+// Records a scan of (part of) the saved directory made of the first
+// 'length' characters of 'path'. 'whole' is set if it covered all of it.
+static void StatsRecordScan(const char* path, size_t length, double seconds, int whole, long long dirs,
+                            long long files) {
+    pthread_mutex_lock(&g_StatsLock);
+    RootStats* root = NULL;
+    for (int i = 0; i < g_RootStatsCount; i++) {
+        if (strlen(g_RootStats[i].path) == length && strncmp(g_RootStats[i].path, path, length) == 0) {
+            root = &g_RootStats[i];
+            break;
+        }
     }
-    
-    // 3. Simple shell escape: wrap in ' and replace any internal ' with '\''.
-    const char* p_in = g_LastShownFile;
-    char* p_out = escapedPath;
-    *p_out++ = '\''; // Start with a quote
-    while (*p_in) {
-        if (*p_in == '\'') {
-            *p_out++ = '\''; // ' -> '
-            *p_out++ = '\\'; // \
-            *p_out++ = '\''; // '
-            *p_out++ = '\''; // '
-        } else {
-            *p_out++ = *p_in;
+    if (root == NULL) {
+        if (g_RootStatsCount == g_RootStatsCapacity) {
+            int newCapacity = g_RootStatsCapacity ? g_RootStatsCapacity * 2 : 8;
+            RootStats* newRoots = (RootStats*)realloc(g_RootStats, newCapacity * sizeof(RootStats));
+            if (newRoots == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory in StatsRecordScan.\n");
+                exit(1);
+            }
+            g_RootStats = newRoots;
+            g_RootStatsCapacity = newCapacity;
+        }
+        root = &g_RootStats[g_RootStatsCount++];
+        memset(root, 0, sizeof(*root));
+        root->path = strndup(path, length);
+        if (root->path == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in strndup.\n");
+            exit(1);
         }
-        p_in++;
     }
-    *p_out++ = '\''; // End with a quote
-    *p_out = '\0';
-    
-    // 4. Build the full command (e.g., "xdg-open '/path/to/file'")
-    //    xdg-open is the Linux standard for opening a file with its default app.
-    char cmd[PATH_MAX * 4 + 16]; // Extra space for "xdg-open "
-    snprintf(cmd, sizeof(cmd), "xdg-open %s", escapedPath);
-    free(escapedPath);
-    
-    // 5. Run the command using system()
-    int ret = system(cmd);
-    if (ret == 0) {
-        char buffer[PATH_MAX + 32];
-        snprintf(buffer, sizeof(buffer), "Opening: %s\n", g_LastShownFile);
-        WriteColor(COLOR_GREEN, buffer);
-    } else {
-        char buffer[PATH_MAX + 64];
-        snprintf(buffer, sizeof(buffer), "Failed to open file. Is 'xdg-open' installed? (code %d)\n", ret);
-        WriteColor(COLOR_RED, buffer);
+    root->scans++;
+    root->lastSeconds = seconds;
+    root->totalSeconds += seconds;
+    if (seconds > root->maxSeconds) root->maxSeconds = seconds;
+    if (whole) {
+        root->dirs = dirs;
+        root->files = files;
     }
+    pthread_mutex_unlock(&g_StatsLock);
+}
+
+// Sums the counters of every thread, running or not
+static void StatsCollect(StatsBlock* total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&g_StatsLock);
+    StatsAddBlock(total, &g_StatsRetired);
+    for (StatsBlock* block = g_StatsThreads; block != NULL; block = block->next) StatsAddBlock(total, block);
+    pthread_mutex_unlock(&g_StatsLock);
 }
 
+// Frees what the statistics hold, at exit. Blocks of threads that are
+// still running stay theirs.
+void FreeStats(void) {
+    pthread_mutex_lock(&g_StatsLock);
+    for (int i = 0; i < g_RootStatsCount; i++) free(g_RootStats[i].path);
+    free(g_RootStats);
+    g_RootStats = NULL;
+    g_RootStatsCount = g_RootStatsCapacity = 0;
+    pthread_mutex_unlock(&g_StatsLock);
+}
 
 // ====================================================================
-// --- File Watcher Thread ---
+// --- NameArena / PathStore Helpers ---
 // ====================================================================
 
-// This function runs in a separate thread to watch for file changes
-void* WatcherThread(void* arg) {
-    StringList* dirs = (StringList*)arg;
-    int fd; // File descriptor for the inotify instance
+// Returns non-zero if 'ptr' points into the mapped index snapshot
+static int IsSnapshotMemory(const void* ptr) {
+    return g_SnapshotMap != NULL && (const char*)ptr >= (const char*)g_SnapshotMap &&
+           (const char*)ptr < (const char*)g_SnapshotMap + g_SnapshotSize;
+}
 
-    // We need to map inotify's "watch descriptors" (wd) back to directory names
-    #define MAX_WATCHES 1024
-    char* wd_map[MAX_WATCHES] = {NULL};
-    
-    // Initialize the inotify system. IN_NONBLOCK means 'read' won't block.
-    fd = inotify_init1(IN_NONBLOCK);
-    if (fd < 0) {
-        perror(COLOR_RED "[Watcher] inotify_init1 failed" COLOR_RESET);
-        return NULL;
+// realloc() that also copes with arrays borrowed from the snapshot
+static void* GrowArray(void* ptr, size_t oldBytes, size_t newBytes) {
+    StatAdd(STAT_BYTES_ALLOCATED, newBytes);
+    if (!IsSnapshotMemory(ptr)) return realloc(ptr, newBytes);
+    void* copy = malloc(newBytes);
+    if (copy != NULL) memcpy(copy, ptr, oldBytes < newBytes ? oldBytes : newBytes);
+    return copy;
+}
+
+// free() that leaves memory borrowed from the snapshot alone
+static void ReleaseMemory(void* ptr) {
+    if (!IsSnapshotMemory(ptr)) free(ptr);
+}
+
+// Copies a NUL-terminated name into the arena and returns its reference
+NameRef ArenaAddName(NameArena* arena, const char* name) {
+    size_t len = strlen(name) + 1;
+    if (arena->count == 0 || arena->used + len > arena->size) {
+        // Start a new block, each one twice the size of the last (up to a cap)
+        size_t size = (arena->count == 0) ? ARENA_MIN_BLOCK_SIZE : arena->size * 2;
+        if (size < ARENA_MIN_BLOCK_SIZE) size = ARENA_MIN_BLOCK_SIZE;
+        if (size > ARENA_MAX_BLOCK_SIZE) size = ARENA_MAX_BLOCK_SIZE;
+        if (len > size) {
+            WriteColor(COLOR_RED, "Fatal: Name too long in ArenaAddName.\n");
+            exit(1);
+        }
+        if (arena->count == arena->capacity) {
+            int newCapacity = (arena->capacity == 0) ? 8 : arena->capacity * 2;
+            char** newBlocks = (char**)realloc(arena->blocks, newCapacity * sizeof(char*));
+            if (newBlocks == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory in ArenaAddName.\n");
+                exit(1);
+            }
+            arena->blocks = newBlocks;
+            arena->capacity = newCapacity;
+        }
+        arena->blocks[arena->count] = (char*)malloc(size);
+        if (arena->blocks[arena->count] == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ArenaAddName.\n");
+            exit(1);
+        }
+        StatAdd(STAT_BYTES_ALLOCATED, size);
+        arena->count++;
+        arena->size = size;
+        arena->used = 0;
     }
+    NameRef ref = ((NameRef)(arena->count - 1) << ARENA_BLOCK_BITS) | arena->used;
+    memcpy(arena->blocks[arena->count - 1] + arena->used, name, len);
+    arena->used += len;
+    return ref;
+}
 
-    // Add a "watch" for each directory in our list
-    int watch_count = 0;
-    for (int i = 0; i < dirs->count && watch_count < MAX_WATCHES; i++) {
-        // We watch for create, delete, and move events
-        int wd = inotify_add_watch(fd, dirs->items[i], 
-                                  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
-        if (wd < 0) {
-            fprintf(stderr, COLOR_RED "[Watcher] Could not watch %s: %s\n" COLOR_RESET, dirs->items[i], strerror(errno));
-        } else {
-            wd_map[wd] = dirs->items[i]; // Map the wd (int) to the path (char*)
-            watch_count++;
+// Resolves a reference back to the name it points at
+static inline const char* ArenaName(const NameArena* arena, NameRef ref) {
+    return arena->blocks[ref >> ARENA_BLOCK_BITS] + (ref & (ARENA_MAX_BLOCK_SIZE - 1));
+}
+
+// Moves all of 'src's blocks to the end of 'dst' and leaves 'src' empty.
+// Returns the amount to add to a reference from 'src' so it stays valid.
+static NameRef ArenaAdopt(NameArena* dst, NameArena* src) {
+    NameRef shift = (NameRef)dst->count << ARENA_BLOCK_BITS;
+    if (src->count == 0) return shift;
+    if (dst->count + src->count > dst->capacity) {
+        int newCapacity = dst->count + src->count;
+        char** newBlocks = (char**)realloc(dst->blocks, newCapacity * sizeof(char*));
+        if (newBlocks == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ArenaAdopt.\n");
+            exit(1);
         }
+        dst->blocks = newBlocks;
+        dst->capacity = newCapacity;
     }
-    
-    if (watch_count == 0) {
-        WriteColor(COLOR_RED, "[Watcher] No valid directories to watch. Thread exiting.\n");
-        close(fd);
-        return NULL;
+    memcpy(dst->blocks + dst->count, src->blocks, src->count * sizeof(char*));
+    dst->count += src->count;
+    // Keep filling the adopted last block
+    dst->used = src->used;
+    dst->size = src->size;
+    free(src->blocks);
+    memset(src, 0, sizeof(*src));
+    return shift;
+}
+
+// Frees every block at once
+void FreeArena(NameArena* arena) {
+    for (int i = 0; i < arena->count; i++) {
+        ReleaseMemory(arena->blocks[i]);
     }
+    free(arena->blocks);
+    memset(arena, 0, sizeof(*arena));
+}
 
-    // Buffer to read events into
-    #define EVENT_BUF_LEN (1024 * (sizeof(struct inotify_event) + 16))
-    char buffer[EVENT_BUF_LEN];
+// --- File Extensions ---
+// Every extension seen so far, lowercased. A file's extension id is the
+// extension's position in the list plus one; 0 means "no extension". Ids
+// never change once handed out, so they can be stored per file and saved.
 
-    // Loop until the main thread sets g_running to 0
-    while (g_running) {
-        // Read events from the inotify file descriptor
-        int length = read(fd, buffer, EVENT_BUF_LEN);
+// Anything longer after the last dot is not treated as an extension
+#define EXT_MAX_LEN 15
 
-        if (length < 0 && errno == EAGAIN) {
-            // No events right now. Wait a bit and check g_running again.
-            usleep(250000); // 250ms
-            continue;
-        } else if (length < 0) {
-            // A real error occurred
+static StringList g_Extensions = {0};
+static int* g_ExtensionSlots = NULL;    // List positions by hash, -1 = empty bucket
+static int g_ExtensionCapacity = 0;     // Power of two
+static pthread_mutex_t g_ExtensionLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Small per-thread cache of recent lookups, so the scanner threads
+// hardly ever take g_ExtensionLock
+#define EXT_CACHE_SIZE 64
+typedef struct {
+    char ext[EXT_MAX_LEN + 1];
+    uint32_t id;
+} ExtensionCacheEntry;
+static _Thread_local ExtensionCacheEntry g_ExtensionCache[EXT_CACHE_SIZE];
+
+static uint64_t HashString(const char* str);
+
+// Copies the lowercased extension of 'name' into 'ext'. Returns 0 if the
+// name has none: no dot, only a leading dot, or too long to be one.
+static int FileExtension(const char* name, char* ext) {
+    const char* dot = strrchr(name, '.');
+    if (dot == NULL || dot == name || dot[1] == '\0') return 0;
+    size_t len = strlen(dot + 1);
+    if (len > EXT_MAX_LEN) return 0;
+    for (size_t i = 0; i <= len; i++) {
+        char c = dot[1 + i];
+        ext[i] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+    }
+    return 1;
+}
+
+// Finds the id of 'ext', adding it if 'add' is set. Returns 0 for an
+// unknown extension that was not added. Caller holds g_ExtensionLock.
+static uint32_t ExtensionLookup(const char* ext, int add) {
+    uint64_t hash = HashString(ext);
+    if (g_ExtensionCapacity > 0) {
+        int mask = g_ExtensionCapacity - 1;
+        for (int b = (int)(hash & (uint64_t)mask); g_ExtensionSlots[b] != -1; b = (b + 1) & mask) {
+            if (strcmp(g_Extensions.items[g_ExtensionSlots[b]], ext) == 0) return (uint32_t)g_ExtensionSlots[b] + 1;
+        }
+    }
+    if (!add) return 0;
+
+    // Grow the table before it gets more than half full
+    if ((g_Extensions.count + 1) * 2 > g_ExtensionCapacity) {
+        int capacity = (g_ExtensionCapacity == 0) ? 64 : g_ExtensionCapacity * 2;
+        int* slots = (int*)malloc(capacity * sizeof(int));
+        if (slots == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ExtensionLookup.\n");
+            exit(1);
+        }
+        memset(slots, -1, capacity * sizeof(int));
+        for (int i = 0; i < g_Extensions.count; i++) {
+            int b = (int)(HashString(g_Extensions.items[i]) & (uint64_t)(capacity - 1));
+            while (slots[b] != -1) b = (b + 1) & (capacity - 1);
+            slots[b] = i;
+        }
+        free(g_ExtensionSlots);
+        g_ExtensionSlots = slots;
+        g_ExtensionCapacity = capacity;
+    }
+    AddStringToList(&g_Extensions, ext);
+    int b = (int)(hash & (uint64_t)(g_ExtensionCapacity - 1));
+    while (g_ExtensionSlots[b] != -1) b = (b + 1) & (g_ExtensionCapacity - 1);
+    g_ExtensionSlots[b] = (int)g_Extensions.count - 1;
+    return (uint32_t)g_Extensions.count;
+}
+
+// Returns the extension id of the file 'name', assigning a new id to an
+// extension never seen before
+uint32_t FileExtensionId(const char* name) {
+    char ext[EXT_MAX_LEN + 1];
+    if (!FileExtension(name, ext)) return 0;
+    ExtensionCacheEntry* cached = &g_ExtensionCache[HashString(ext) & (EXT_CACHE_SIZE - 1)];
+    if (cached->id != 0 && strcmp(cached->ext, ext) == 0) return cached->id;
+
+    pthread_mutex_lock(&g_ExtensionLock);
+    uint32_t id = ExtensionLookup(ext, 1);
+    pthread_mutex_unlock(&g_ExtensionLock);
+    memcpy(cached->ext, ext, sizeof(ext));
+    cached->id = id;
+    return id;
+}
+
+// Returns the id of an extension given on its own (e.g. "JPG" or ".jpg"),
+// or 0 if no file with it has been seen
+uint32_t ExtensionIdOf(const char* ext) {
+    char name[EXT_MAX_LEN + 3] = "x.";
+    if (ext[0] == '.') ext++;
+    if (strlen(ext) > EXT_MAX_LEN) return 0;
+    strcat(name, ext);
+    char lowered[EXT_MAX_LEN + 1];
+    if (!FileExtension(name, lowered)) return 0;
+    pthread_mutex_lock(&g_ExtensionLock);
+    uint32_t id = ExtensionLookup(lowered, 0);
+    pthread_mutex_unlock(&g_ExtensionLock);
+    return id;
+}
+
+// Frees the extension list (only at exit: ids must stay valid until then)
+void FreeExtensions(void) {
+    pthread_mutex_lock(&g_ExtensionLock);
+    FreeStringList(&g_Extensions);
+    free(g_ExtensionSlots);
+    g_ExtensionSlots = NULL;
+    g_ExtensionCapacity = 0;
+    pthread_mutex_unlock(&g_ExtensionLock);
+}
+
+// Initializes an empty PathStore
+void InitPathStore(PathStore* store) {
+    memset(store, 0, sizeof(*store));
+}
+
+// Adds a directory below 'parent' (or a root, with DIR_ROOT and its full
+// path as the name) and returns its id
+int StoreAddDir(PathStore* store, int parent, const char* name) {
+    if (store->dirCount == store->dirCapacity) {
+        int newCapacity = (store->dirCapacity == 0) ? 8 : store->dirCapacity * 2;
+        DirNode* newDirs = (DirNode*)GrowArray(store->dirs, store->dirCount * sizeof(DirNode), newCapacity * sizeof(DirNode));
+        if (newDirs == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in StoreAddDir.\n");
+            exit(1);
+        }
+        store->dirs = newDirs;
+        store->dirCapacity = newCapacity;
+    }
+    DirNode* node = &store->dirs[store->dirCount];
+    node->name = ArenaAddName(&store->names, name);
+    node->mtime = 0;
+    node->ino = 0;
+    node->parent = parent;
+    node->files = 0;
+    return store->dirCount++;
+}
+
+// Grows the file array and its attribute columns to 'capacity' entries
+static void StoreReserveFiles(PathStore* store, int64_t capacity) {
+    int64_t count = store->fileCount;
+    FileEntry* newFiles = (FileEntry*)GrowArray(store->files, count * sizeof(FileEntry), capacity * sizeof(FileEntry));
+    int64_t* newSizes = (int64_t*)GrowArray(store->sizes, count * sizeof(int64_t), capacity * sizeof(int64_t));
+    int64_t* newMtimes = (int64_t*)GrowArray(store->mtimes, count * sizeof(int64_t), capacity * sizeof(int64_t));
+    uint32_t* newExts = (uint32_t*)GrowArray(store->exts, count * sizeof(uint32_t), capacity * sizeof(uint32_t));
+    if (newFiles == NULL || newSizes == NULL || newMtimes == NULL || newExts == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in StoreReserveFiles.\n");
+        exit(1);
+    }
+    store->files = newFiles;
+    store->sizes = newSizes;
+    store->mtimes = newMtimes;
+    store->exts = newExts;
+    store->fileCapacity = capacity;
+}
+
+// Adds a file to directory 'dir' and returns its slot
+int64_t StoreAddFile(PathStore* store, int dir, const char* name, int64_t size, int64_t mtime) {
+    if (store->fileCount == store->fileCapacity) {
+        StoreReserveFiles(store, (store->fileCapacity == 0) ? 8 : store->fileCapacity * 2);
+    }
+    int64_t slot = store->fileCount++;
+    store->files[slot].name = ArenaAddName(&store->names, name);
+    store->files[slot].dir = dir;
+    store->files[slot].spare = 0;
+    store->sizes[slot] = size;
+    store->mtimes[slot] = mtime;
+    store->exts[slot] = FileExtensionId(name);
+    return slot;
+}
+
+// Returns a directory's own name (or full path, for a root)
+static inline const char* StoreDirName(const PathStore* store, int dir) {
+    return ArenaName(&store->names, store->dirs[dir].name);
+}
+
+// Returns a file's leaf name
+static inline const char* StoreFileName(const PathStore* store, int64_t slot) {
+    return ArenaName(&store->names, store->files[slot].name);
+}
+
+// Rebuilds the full path of directory 'dir' into 'buffer' by walking up
+// to its root. Returns the path length, or -1 if it does not fit.
+int StoreDirPath(const PathStore* store, int dir, char* buffer, size_t size) {
+    // Collect the chain from 'dir' up to its root
+    int chain[PATH_MAX / 2];
+    int depth = 0;
+    while (dir >= 0 && depth < PATH_MAX / 2) {
+        chain[depth++] = dir;
+        if (store->dirs[dir].parent == DIR_ROOT) break;
+        dir = store->dirs[dir].parent;
+    }
+    if (dir < 0 || store->dirs[dir].parent != DIR_ROOT) return -1; // Detached
+
+    // Then write it out top-down
+    size_t len = 0;
+    for (int i = depth - 1; i >= 0; i--) {
+        const char* name = StoreDirName(store, chain[i]);
+        size_t nameLen = strlen(name);
+        size_t extra = (i == depth - 1) ? 0 : 1;
+        if (len + extra + nameLen >= size) return -1;
+        if (extra) buffer[len++] = '/';
+        memcpy(buffer + len, name, nameLen);
+        len += nameLen;
+    }
+    buffer[len] = '\0';
+    return (int)len;
+}
+
+// Rebuilds the full path of the file in 'slot' into 'buffer'.
+// Returns the path length, or -1 if it does not fit.
+int StorePathOf(const PathStore* store, int64_t slot, char* buffer, size_t size) {
+    int len = StoreDirPath(store, store->files[slot].dir, buffer, size);
+    if (len < 0) return -1;
+    const char* name = StoreFileName(store, slot);
+    size_t nameLen = strlen(name);
+    if ((size_t)len + 1 + nameLen >= size) return -1;
+    buffer[len] = '/';
+    memcpy(buffer + len + 1, name, nameLen + 1);
+    return len + 1 + (int)nameLen;
+}
+
+// Moves every file of 'src' (and the names they use) to the end of 'dst',
+// leaving 'src' empty. Directory ids are kept as they are.
+void StoreAppendFiles(PathStore* dst, PathStore* src) {
+    if (src->fileCount == 0) {
+        FreePathStore(src);
+        return;
+    }
+    int64_t total = dst->fileCount + src->fileCount;
+    if (total > dst->fileCapacity) StoreReserveFiles(dst, total);
+    NameRef shift = ArenaAdopt(&dst->names, &src->names);
+    memcpy(dst->sizes + dst->fileCount, src->sizes, src->fileCount * sizeof(int64_t));
+    memcpy(dst->mtimes + dst->fileCount, src->mtimes, src->fileCount * sizeof(int64_t));
+    memcpy(dst->exts + dst->fileCount, src->exts, src->fileCount * sizeof(uint32_t));
+    for (int64_t i = 0; i < src->fileCount; i++) {
+        dst->files[dst->fileCount].name = src->files[i].name + shift;
+        dst->files[dst->fileCount].dir = src->files[i].dir;
+        dst->files[dst->fileCount].spare = 0;
+        dst->fileCount++;
+    }
+    FreePathStore(src);
+}
+
+// Frees the whole store in one go: a few arrays and the arena's blocks,
+// however many files it held
+void FreePathStore(PathStore* store) {
+    ReleaseMemory(store->dirs);
+    ReleaseMemory(store->files);
+    ReleaseMemory(store->sizes);
+    ReleaseMemory(store->mtimes);
+    ReleaseMemory(store->exts);
+    FreeArena(&store->names);
+    InitPathStore(store);
+}
+
+// ====================================================================
+// --- Epoch-Based Reclamation ---
+// ====================================================================
+
+// Values shared between threads (see DirSet) are never changed in place.
+// A writer publishes a new version with one atomic store and retires the
+// old one, which is freed once no reader can still be looking at it.
+// Readers announce the epoch they started in; a version retired in epoch
+// E is freed when every announced epoch is later than E. Readers take no
+// lock and never wait for a writer.
+#define EPOCH_SLOTS 256     // Readers that can be inside at the same time
+
+typedef struct {
+    atomic_uint_fast64_t epoch; // Epoch its reader started in, 0 = free
+    char pad[64 - sizeof(atomic_uint_fast64_t)]; // One cache line each
+} EpochSlot;
+
+// A retired version waiting to be freed
+typedef struct Retired {
+    void* ptr;
+    void (*release)(void*);
+    uint64_t epoch;         // Epoch it was retired in
+    struct Retired* next;
+} Retired;
+
+static EpochSlot g_EpochSlots[EPOCH_SLOTS];
+static atomic_uint_fast64_t g_Epoch = 1;
+static Retired* g_Retired = NULL;   // Writers only, under g_RetiredLock
+static pthread_mutex_t g_RetiredLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Starts reading shared versions. Anything loaded from now until
+// EpochExit() with the returned slot stays allocated.
+static int EpochEnter(void) {
+    while (1) {
+        uint64_t epoch = atomic_load(&g_Epoch);
+        for (int i = 0; i < EPOCH_SLOTS; i++) {
+            uint_fast64_t expected = 0;
+            if (!atomic_compare_exchange_strong(&g_EpochSlots[i].epoch, &expected, epoch)) continue;
+            // Announced; make sure no version was retired meanwhile
+            // without the announcement being seen
+            uint64_t now;
+            while ((now = atomic_load(&g_Epoch)) != epoch) {
+                epoch = now;
+                atomic_store(&g_EpochSlots[i].epoch, epoch);
+            }
+            return i;
+        }
+        sched_yield(); // Every slot taken: wait for a reader to leave
+    }
+}
+
+static void EpochExit(int slot) {
+    atomic_store(&g_EpochSlots[slot].epoch, 0);
+}
+
+// Frees every retired version no reader can still see
+static void EpochCollect(void) {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < EPOCH_SLOTS; i++) {
+        uint64_t epoch = atomic_load(&g_EpochSlots[i].epoch);
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    pthread_mutex_lock(&g_RetiredLock);
+    Retired** link = &g_Retired;
+    while (*link != NULL) {
+        Retired* node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            node->release(node->ptr);
+            free(node);
+        } else {
+            link = &node->next;
+        }
+    }
+    pthread_mutex_unlock(&g_RetiredLock);
+}
+
+// Hands over 'ptr', already replaced by a newer version, to be freed with
+// 'release' once the readers that might hold it are gone
+static void EpochRetire(void* ptr, void (*release)(void*)) {
+    Retired* node = (Retired*)malloc(sizeof(Retired));
+    if (node == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in EpochRetire.\n");
+        exit(1);
+    }
+    node->ptr = ptr;
+    node->release = release;
+    pthread_mutex_lock(&g_RetiredLock);
+    node->epoch = atomic_fetch_add(&g_Epoch, 1);
+    node->next = g_Retired;
+    g_Retired = node;
+    pthread_mutex_unlock(&g_RetiredLock);
+    EpochCollect();
+}
+
+// ====================================================================
+// --- Utility Functions ---
+// ====================================================================
+
+// What "dirs.txt" looked like when it was last read or written, so it is
+// only read again (and a new DirSet published) once someone changed it
+static struct stat g_DirsFileStat;
+static int g_DirsFileKnown = 0;
+
+// Returns non-zero if "dirs.txt" may have changed since it was last read
+// or written here
+int DirsFileChanged(void) {
+    struct stat st;
+    if (!g_DirsFileKnown || stat(DIRS_FILE, &st) != 0) return 1;
+    return st.st_dev != g_DirsFileStat.st_dev || st.st_ino != g_DirsFileStat.st_ino ||
+           st.st_size != g_DirsFileStat.st_size || st.st_mtim.tv_sec != g_DirsFileStat.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != g_DirsFileStat.st_mtim.tv_nsec;
+}
+
+// Reads the list of directories from "dirs.txt"
+StringList LoadDirs() {
+    StringList dirs;
+    InitStringList(&dirs);
+    FILE* fp = fopen(DIRS_FILE, "r"); // Open for reading
+
+    if (fp == NULL) {
+        // File doesn't exist, create an empty one.
+        fp = fopen(DIRS_FILE, "w");
+        if (fp) fclose(fp);
+        g_DirsFileKnown = 0;
+        return dirs; // Return empty list
+    }
+    // Taken before reading, so a change made meanwhile is seen next time
+    g_DirsFileKnown = (fstat(fileno(fp), &g_DirsFileStat) == 0);
+
+    char buffer[PATH_MAX];
+    while (fgets(buffer, PATH_MAX, fp)) {
+        buffer[strcspn(buffer, "\r\n")] = '\0'; // Trim newline
+        // Add non-empty lines to the list
+        if (strlen(buffer) > 0) {
+            AddStringToList(&dirs, buffer);
+        }
+    }
+    fclose(fp);
+    return dirs;
+}
+
+static int IsPathAtOrUnder(const char* path, const char* dir);
+
+// Turns the saved directories into the trees to scan: each one resolved
+// with realpath(), missing ones and duplicates dropped, and any that lies
+// inside another one left out. Otherwise the files of a nested directory
+// would be indexed twice and picked twice as often.
+StringList NormalizeRoots(const StringList* dirs) {
+    StringList resolved;
+    InitStringList(&resolved);
+    for (int i = 0; i < dirs->count; i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (realpath(dirs->items[i], path) == NULL || stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        AddStringToList(&resolved, path);
+    }
+
+    StringList roots;
+    InitStringList(&roots);
+    for (int i = 0; i < resolved.count; i++) {
+        int nested = 0;
+        for (int j = 0; j < resolved.count && !nested; j++) {
+            if (i == j || !IsPathAtOrUnder(resolved.items[i], resolved.items[j])) continue;
+            // Of two equal paths the first one stays
+            nested = (strcmp(resolved.items[i], resolved.items[j]) != 0 || j < i);
+        }
+        if (!nested) AddStringToList(&roots, resolved.items[i]);
+    }
+    FreeStringList(&resolved);
+    return roots;
+}
+
+static void FreeDirSet(void* ptr) {
+    DirSet* set = (DirSet*)ptr;
+    FreeStringList(&set->dirs);
+    FreeStringList(&set->roots);
+    free(set);
+}
+
+// Makes 'dirs' (which it takes over) the current directory list for every
+// thread, and retires the one it replaces. Only the main thread publishes,
+// so it may keep using the returned set until it publishes the next one.
+const DirSet* PublishDirs(StringList dirs) {
+    DirSet* set = (DirSet*)malloc(sizeof(DirSet));
+    if (set == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in PublishDirs.\n");
+        exit(1);
+    }
+    set->dirs = dirs;
+    set->roots = NormalizeRoots(&dirs);
+    DirSet* old = atomic_exchange(&g_DirSet, set);
+    if (old != NULL) EpochRetire(old, FreeDirSet);
+    return set;
+}
+
+// Retires the current directory list and frees every retired version.
+// Called at exit, once no other thread is running.
+void FreeDirSets(void) {
+    DirSet* old = atomic_exchange(&g_DirSet, NULL);
+    if (old != NULL) EpochRetire(old, FreeDirSet);
+    EpochCollect();
+}
+
+// With --follow-symlinks, returns non-zero if the link 'path' is not to be
+// followed because it leads into one of the saved trees: what it points
+// to is read under its real path anyway. Deciding this from the path
+// alone keeps the scanner and the watcher in agreement, whatever order
+// they come across things in.
+static int LinkLeadsIntoRoots(const char* path) {
+    char target[PATH_MAX];
+    if (realpath(path, target) == NULL) return 1;
+    int inside = 0;
+    int slot = EpochEnter();
+    const DirSet* set = atomic_load(&g_DirSet);
+    for (int i = 0; set != NULL && i < set->roots.count && !inside; i++) {
+        inside = IsPathAtOrUnder(target, set->roots.items[i]);
+    }
+    EpochExit(slot);
+    return inside;
+}
+
+// LinkLeadsIntoRoots() for entry 'name' of the directory 'dirPath'
+static int LinkEntryLeadsIntoRoots(const char* dirPath, const char* name) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dirPath, name) >= (int)sizeof(path)) return 1;
+    return LinkLeadsIntoRoots(path);
+}
+
+// stat() or lstat(), depending on whether symbolic links are followed
+static int StatEntry(const char* path, struct stat* st) {
+    return g_FollowSymlinks ? stat(path, st) : lstat(path, st);
+}
+
+// Writes the current list of directories back to "dirs.txt"
+void SaveDirs(const StringList* dirs) {
+    FILE* fp = fopen(DIRS_FILE, "w"); // Open for writing
+    if (fp) {
+        for (int i = 0; i < dirs->count; i++) {
+            fprintf(fp, "%s\n", dirs->items[i]);
+        }
+        fclose(fp);
+    }
+    // The list just written is the one in use: nothing to read back
+    g_DirsFileKnown = (stat(DIRS_FILE, &g_DirsFileStat) == 0);
+}
+
+// ====================================================================
+// --- Exclude Rules ---
+// ====================================================================
+// Patterns in EXCLUDE_FILE keep whole subtrees (.git, node_modules, build
+// output) out of the index. The syntax follows .gitignore:
+//   name        a file or directory called 'name' at any depth
+//   /name, a/b  matched against the path below the saved directory
+//   name/       directories only
+//   !name       include again what an earlier pattern excluded
+//   *, ?, [...] globs; "**/" and "/**" span any number of directories
+// The last matching pattern wins. An excluded directory is never opened,
+// so nothing below it can be included again.
+
+#define EXCLUDE_FILE "excludes.txt"
+
+// How a pattern is matched, cheapest first. Plain names go into a hash
+// table; most other patterns are a plain prefix or suffix, so fnmatch()
+// is only needed for the rest.
+#define RULE_LITERAL 0      // "node_modules"
+#define RULE_SUFFIX 1       // "*.o": '*' followed by plain text
+#define RULE_PREFIX 2       // "build-*": plain text followed by '*'
+#define RULE_GLOB 3         // Anything else
+
+typedef struct {
+    char* pattern;          // Without the '!', the leading '/' and the trailing '/'
+    size_t length;
+    int kind;               // RULE_*
+    int negate;             // "!pattern"
+    int dirOnly;            // "pattern/"
+    int anchored;           // Matched against the path below the root, not the name
+} ExcludeRule;
+
+// Entry of the table of unanchored plain names: the last rule for that
+// name, and the last one that applies to directories only
+typedef struct {
+    const char* name;       // NULL = empty bucket
+    int anyRule;
+    int dirRule;
+} ExcludeName;
+
+typedef struct {
+    ExcludeRule* rules;
+    int count;
+    int capacity;
+    ExcludeName* names;
+    int nameCapacity;       // Power of two, or 0
+    int* others;            // Rules not in 'names', in file order
+    int otherCount;
+    uint64_t hash;          // Of the rules, so an index built with others is not reused
+} ExcludeRules;
+
+static ExcludeRules g_Excludes = {0};
+
+// Returns non-zero if 'text' holds glob characters
+static int HasGlob(const char* text) {
+    return strpbrk(text, "*?[\\") != NULL;
+}
+
+// Finds the bucket of 'name' in the table of plain names
+static int ExcludeNameProbe(const char* name) {
+    int mask = g_Excludes.nameCapacity - 1;
+    int b = (int)(HashString(name) & (uint64_t)mask);
+    while (g_Excludes.names[b].name != NULL && strcmp(g_Excludes.names[b].name, name) != 0) b = (b + 1) & mask;
+    return b;
+}
+
+// Parses one line of EXCLUDE_FILE into 'rule'. Returns 0 for blank lines,
+// comments and patterns that match nothing.
+static int ParseExcludeRule(char* line, ExcludeRule* rule) {
+    memset(rule, 0, sizeof(*rule));
+    // Trailing spaces are dropped unless escaped, as in .gitignore
+    size_t len = strlen(line);
+    while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')) line[--len] = '\0';
+    if (len == 0 || line[0] == '#') return 0;
+
+    char* text = line;
+    if (text[0] == '!') {
+        rule->negate = 1;
+        text++;
+    } else if (text[0] == '\\' && (text[1] == '!' || text[1] == '#')) {
+        text++; // A literal leading '!' or '#'
+    }
+    len = strlen(text);
+    if (len > 0 && text[len - 1] == '/') {
+        rule->dirOnly = 1;
+        text[--len] = '\0';
+    }
+    // "a/**" holds everything inside 'a', which is the same as leaving 'a' out
+    if (len >= 3 && strcmp(text + len - 3, "/**") == 0) {
+        rule->dirOnly = 1;
+        len -= 3;
+        text[len] = '\0';
+    }
+    if (text[0] == '/') {
+        rule->anchored = 1;
+        text++;
+    } else if (strncmp(text, "**/", 3) == 0) {
+        text += 3; // Any depth, which unanchored patterns are anyway
+    }
+    if (text[0] == '\0') return 0;
+    if (strchr(text, '/') != NULL) rule->anchored = 1;
+
+    rule->pattern = strdup(text);
+    if (rule->pattern == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in strdup.\n");
+        exit(1);
+    }
+    rule->length = strlen(text);
+    if (!HasGlob(text)) {
+        rule->kind = RULE_LITERAL;
+    } else if (text[0] == '*' && !HasGlob(text + 1) && !rule->anchored) {
+        rule->kind = RULE_SUFFIX;
+    } else if (text[rule->length - 1] == '*' && rule->length >= 2 && text[rule->length - 2] != '\\' &&
+               !rule->anchored) {
+        text[rule->length - 1] = '\0';
+        rule->kind = HasGlob(text) ? RULE_GLOB : RULE_PREFIX;
+        text[rule->length - 1] = '*';
+    } else {
+        rule->kind = RULE_GLOB;
+    }
+    return 1;
+}
+
+// Reads EXCLUDE_FILE, if there is one, and compiles its patterns
+void LoadExcludes(void) {
+    FILE* fp = fopen(EXCLUDE_FILE, "r");
+    if (fp == NULL) return;
+
+    ExcludeRules* ex = &g_Excludes;
+    char buffer[PATH_MAX];
+    while (fgets(buffer, PATH_MAX, fp)) {
+        buffer[strcspn(buffer, "\r\n")] = '\0'; // Trim newline
+        ExcludeRule rule;
+        if (!ParseExcludeRule(buffer, &rule)) continue;
+        if (ex->count == ex->capacity) {
+            ex->capacity = (ex->capacity == 0) ? 16 : ex->capacity * 2;
+            ExcludeRule* rules = (ExcludeRule*)realloc(ex->rules, ex->capacity * sizeof(ExcludeRule));
+            if (rules == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory in LoadExcludes.\n");
+                exit(1);
+            }
+            ex->rules = rules;
+        }
+        ex->rules[ex->count++] = rule;
+        // Every detail that changes what matches goes into the hash
+        ex->hash = (ex->hash ^ HashString(rule.pattern)) * 0x100000001b3ull;
+        ex->hash ^= (uint64_t)(rule.negate | rule.dirOnly << 1 | rule.anchored << 2);
+    }
+    fclose(fp);
+    if (ex->count == 0) return;
+
+    // Plain names go into the table, everything else is tried in turn
+    ex->others = (int*)malloc(ex->count * sizeof(int));
+    ex->nameCapacity = 16;
+    while (ex->nameCapacity < ex->count * 2) ex->nameCapacity *= 2;
+    ex->names = (ExcludeName*)calloc(ex->nameCapacity, sizeof(ExcludeName));
+    if (ex->others == NULL || ex->names == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in LoadExcludes.\n");
+        exit(1);
+    }
+    for (int i = 0; i < ex->count; i++) {
+        const ExcludeRule* rule = &ex->rules[i];
+        if (rule->kind != RULE_LITERAL || rule->anchored) {
+            ex->others[ex->otherCount++] = i;
+            continue;
+        }
+        ExcludeName* entry = &ex->names[ExcludeNameProbe(rule->pattern)];
+        if (entry->name == NULL) {
+            entry->name = rule->pattern;
+            entry->anyRule = -1;
+            entry->dirRule = -1;
+        }
+        if (rule->dirOnly) {
+            entry->dirRule = i;
+        } else {
+            entry->anyRule = i;
+        }
+    }
+}
+
+void FreeExcludes(void) {
+    for (int i = 0; i < g_Excludes.count; i++) free(g_Excludes.rules[i].pattern);
+    free(g_Excludes.rules);
+    free(g_Excludes.names);
+    free(g_Excludes.others);
+    memset(&g_Excludes, 0, sizeof(g_Excludes));
+}
+
+// Returns non-zero if 'rule' matches 'subject' (a name, or a path below
+// the root for anchored rules)
+static int ExcludeRuleMatches(const ExcludeRule* rule, const char* subject) {
+    size_t len;
+    switch (rule->kind) {
+    case RULE_LITERAL:
+        return strcmp(rule->pattern, subject) == 0;
+    case RULE_SUFFIX:
+        len = strlen(subject);
+        return len >= rule->length - 1 && memcmp(subject + len - (rule->length - 1), rule->pattern + 1, rule->length - 1) == 0;
+    case RULE_PREFIX:
+        return strncmp(subject, rule->pattern, rule->length - 1) == 0;
+    default:
+        // "**" has to cross directory boundaries, a single '*' must not
+        return fnmatch(rule->pattern, subject, strstr(rule->pattern, "**") ? 0 : FNM_PATHNAME) == 0;
+    }
+}
+
+// Returns non-zero if the entry 'name' of the directory 'dirRel' (its
+// path below the saved directory, "" for the saved directory itself) is
+// excluded. Meant for the scanner's inner loop: with no rules it costs a
+// single test.
+static inline int IsExcluded(const char* dirRel, const char* name, int isDir) {
+    const ExcludeRules* ex = &g_Excludes;
+    if (ex->count == 0) return 0;
+
+    int best = -1;
+    const ExcludeName* entry = &ex->names[ExcludeNameProbe(name)];
+    if (entry->name != NULL) {
+        best = entry->anyRule;
+        if (isDir && entry->dirRule > best) best = entry->dirRule;
+    }
+    // Only rules after the best one so far can still change the outcome
+    char relPath[PATH_MAX];
+    int haveRel = 0;
+    for (int i = ex->otherCount - 1; i >= 0 && ex->others[i] > best; i--) {
+        const ExcludeRule* rule = &ex->rules[ex->others[i]];
+        if (rule->dirOnly && !isDir) continue;
+        const char* subject = name;
+        if (rule->anchored) {
+            if (!haveRel) {
+                if (dirRel[0] == '\0') {
+                    snprintf(relPath, sizeof(relPath), "%s", name);
+                } else if (snprintf(relPath, sizeof(relPath), "%s/%s", dirRel, name) >= (int)sizeof(relPath)) {
+                    continue;
+                }
+                haveRel = 1;
+            }
+            subject = relPath;
+        }
+        if (ExcludeRuleMatches(rule, subject)) {
+            best = ex->others[i];
+            break;
+        }
+    }
+    return best >= 0 && !ex->rules[best].negate;
+}
+
+// Skips the saved directory's part of 'path', whose length is 'rootLen'
+static inline const char* PathBelowRoot(const char* path, size_t rootLen) {
+    path += rootLen;
+    return (*path == '/') ? path + 1 : path;
+}
+
+// IsExcluded() for a full path below the saved directory of length 'rootLen'
+static int IsPathExcluded(const char* path, size_t rootLen, int isDir) {
+    if (g_Excludes.count == 0 || strlen(path) <= rootLen) return 0;
+    const char* rel = PathBelowRoot(path, rootLen);
+    const char* slash = strrchr(rel, '/');
+    if (slash == NULL) return IsExcluded("", rel, isDir);
+    char dirRel[PATH_MAX];
+    memcpy(dirRel, rel, slash - rel);
+    dirRel[slash - rel] = '\0';
+    return IsExcluded(dirRel, slash + 1, isDir);
+}
+
+// ====================================================================
+// --- Scan Preview ---
+// ====================================================================
+// A uniform sample of the files a scan has found so far, so picks can be
+// answered before it finishes (see "Background Scan"). Scanner
+// threads feed it with reservoir sampling: after n matching files each of
+// them is in the sample with the same chance. A thread does not take the
+// lock for every directory it reads; its files wait in its own store
+// until the lock is free or PREVIEW_BATCH_DIRS directories' worth piled
+// up. Only files passing g_Filter go in; weights are not applied to
+// partial picks.
+
+#define PREVIEW_SIZE 4096       // Paths kept in the sample
+#define PREVIEW_BATCH_DIRS 64   // Directories a scanner thread may hold back
+
+static pthread_mutex_t g_PreviewLock = PTHREAD_MUTEX_INITIALIZER; // Guards everything below
+static pthread_cond_t g_PreviewDone;    // Signalled when the scan feeding it ends
+static int g_PreviewActive = 0;         // A scan is feeding the sample
+static char (*g_PreviewPaths)[PATH_MAX] = NULL; // The sample, PREVIEW_SIZE fixed slots
+static int g_PreviewCount = 0;
+static long long g_PreviewFound = 0;    // Files found so far
+static long long g_PreviewMatched = 0;  // ... of which pass g_Filter
+static long long g_PreviewPicks = 0;    // Partial picks made from the sample
+static uint32_t* g_PreviewExts = NULL;  // Extension ids g_Filter allows
+static int g_PreviewExtCount = 0;
+
+// The sample draws from a generator of its own (see Random Numbers), so
+// scanner threads never take a stream from the ones --seed fixes
+static uint64_t PreviewRandomBelow(uint64_t n);
+
+// Opens an empty sample for a scan about to start
+static void PreviewStart(void) {
+    pthread_mutex_lock(&g_PreviewLock);
+    g_PreviewPaths = (char (*)[PATH_MAX])malloc((size_t)PREVIEW_SIZE * PATH_MAX);
+    g_PreviewExts = (uint32_t*)malloc((g_Filter.exts.count + 1) * sizeof(uint32_t));
+    if (g_PreviewPaths == NULL || g_PreviewExts == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in PreviewStart.\n");
+        exit(1);
+    }
+    // Ids of the allowed extensions, registered now if no file had one yet
+    g_PreviewExtCount = 0;
+    for (int i = 0; i < g_Filter.exts.count; i++) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "x.%s", g_Filter.exts.items[i] + (g_Filter.exts.items[i][0] == '.'));
+        uint32_t id = FileExtensionId(name);
+        if (id != 0) g_PreviewExts[g_PreviewExtCount++] = id;
+    }
+    g_PreviewCount = 0;
+    g_PreviewFound = g_PreviewMatched = g_PreviewPicks = 0;
+    g_PreviewActive = 1;
+    pthread_mutex_unlock(&g_PreviewLock);
+}
+
+// Returns non-zero if file 'slot' of 'store' passes g_Filter (weights
+// aside) at time 'now'
+static int PreviewMatches(const PathStore* store, int64_t slot, int64_t now) {
+    if (g_Filter.minSize >= 0 && store->sizes[slot] < g_Filter.minSize) return 0;
+    if (g_Filter.maxSize >= 0 && store->sizes[slot] > g_Filter.maxSize) return 0;
+    if (g_Filter.newerAge >= 0 && store->mtimes[slot] < now - g_Filter.newerAge) return 0;
+    if (g_Filter.olderAge >= 0 && store->mtimes[slot] > now - g_Filter.olderAge) return 0;
+    if (g_Filter.exts.count == 0) return 1;
+    for (int i = 0; i < g_PreviewExtCount; i++) {
+        if (store->exts[slot] == g_PreviewExts[i]) return 1;
+    }
+    return 0;
+}
+
+// Offers the files 'store' gained from slot 'from' on to the sample. Their
+// directories are in 'dirs', which other threads grow under 'dirLock'.
+// Unless 'wait' is set nothing happens while another thread holds the
+// sample; returns 0 then.
+static int PreviewAdd(const PathStore* store, int64_t from, const PathStore* dirs, pthread_mutex_t* dirLock,
+                      int wait) {
+    if (wait) {
+        pthread_mutex_lock(&g_PreviewLock);
+    } else if (pthread_mutex_trylock(&g_PreviewLock) != 0) {
+        return 0;
+    }
+    g_PreviewFound += store->fileCount - from;
+    int64_t now = (int64_t)time(NULL);
+    char dirPath[PATH_MAX];
+    int dirLen = -1;
+    int lastDir = -1;
+    for (int64_t i = from; i < store->fileCount; i++) {
+        if (!PreviewMatches(store, i, now)) continue;
+        g_PreviewMatched++;
+        int at = g_PreviewCount;
+        if (g_PreviewCount == PREVIEW_SIZE) {
+            // Full: the n-th file replaces a random one with chance K/n
+            uint64_t j = PreviewRandomBelow((uint64_t)g_PreviewMatched);
+            if (j >= PREVIEW_SIZE) continue;
+            at = (int)j;
+        }
+        // Paths are only put together for the files that go in
+        if (store->files[i].dir != lastDir) {
+            lastDir = store->files[i].dir;
+            pthread_mutex_lock(dirLock);
+            dirLen = StoreDirPath(dirs, lastDir, dirPath, sizeof(dirPath));
+            pthread_mutex_unlock(dirLock);
+        }
+        if (dirLen < 0) continue;
+        int len = snprintf(g_PreviewPaths[at], PATH_MAX, "%s/%s", dirPath, StoreFileName(store, i));
+        if (len < 0 || len >= PATH_MAX) continue;
+        if (at == g_PreviewCount) g_PreviewCount++;
+    }
+    pthread_mutex_unlock(&g_PreviewLock);
+    return 1;
+}
+
+// Picks a random file from the sample into 'buffer'. Returns 1 on success,
+// 0 if no file has been found yet and -1 if none found passes g_Filter.
+// '*found' is set to the number of files found so far.
+int PreviewPick(char* buffer, size_t size, long long* found) {
+    pthread_mutex_lock(&g_PreviewLock);
+    *found = g_PreviewFound;
+    int result = (g_PreviewCount > 0) ? 1 : (g_PreviewFound > 0) ? -1 : 0;
+    if (result == 1) {
+        snprintf(buffer, size, "%s", g_PreviewPaths[RandomBelow((uint64_t)g_PreviewCount)]);
+        g_PreviewPicks++;
+    }
+    pthread_mutex_unlock(&g_PreviewLock);
+    return result;
+}
+
+// Closes the sample once its scan is over and wakes whoever waits for that.
+// Returns the number of partial picks made from it.
+static long long PreviewFinish(void) {
+    pthread_mutex_lock(&g_PreviewLock);
+    long long picks = g_PreviewPicks;
+    free(g_PreviewPaths);
+    free(g_PreviewExts);
+    g_PreviewPaths = NULL;
+    g_PreviewExts = NULL;
+    g_PreviewCount = 0;
+    g_PreviewActive = 0;
+    pthread_cond_broadcast(&g_PreviewDone);
+    pthread_mutex_unlock(&g_PreviewLock);
+    return picks;
+}
+
+// ====================================================================
+// --- Parallel Directory Scanner ---
+// ====================================================================
+
+// Layout of the records returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Works out what entry 'name' of the open directory 'dirFd' is, from its
+// d_type 'type' where that is enough: DT_DIR, DT_REG, or DT_UNKNOWN for
+// anything else. With --follow-symlinks a link counts as what it points
+// to and '*isLink' is set. 'st' is filled in if '*haveStat' is set.
+static int EntryType(int dirFd, const char* name, int type, struct stat* st, int* haveStat, int* isLink) {
+    *haveStat = 0;
+    *isLink = 0;
+    if (g_IgnoreDType) type = DT_UNKNOWN;
+    if (type == DT_UNKNOWN) {
+        // Filesystem doesn't supply d_type, ask relative to the open
+        // directory so only the last component is looked up
+        StatAdd(STAT_STAT_FALLBACKS, 1);
+        if (fstatat(dirFd, name, st, AT_SYMLINK_NOFOLLOW) != 0) return DT_UNKNOWN;
+        *haveStat = 1;
+        if (!S_ISLNK(st->st_mode)) return S_ISDIR(st->st_mode) ? DT_DIR : (S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN);
+        type = DT_LNK;
+    }
+    if (type != DT_LNK || !g_FollowSymlinks) return (type == DT_DIR || type == DT_REG) ? type : DT_UNKNOWN;
+    *haveStat = (fstatat(dirFd, name, st, 0) == 0);
+    if (!*haveStat) return DT_UNKNOWN; // Dangling
+    *isLink = 1;
+    return S_ISDIR(st->st_mode) ? DT_DIR : (S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN);
+}
+
+// Size of the buffer each scanner thread reads directory entries into.
+// One system call then returns hundreds of entries at once.
+#define GETDENTS_BUF_SIZE (64 * 1024)
+
+// --- Inode set (--follow-symlinks, --dedupe-hardlinks) ---
+// (device, inode) pairs already seen during one scan. With --follow-symlinks
+// every directory read goes in, so a link back up the tree (a cycle) or
+// into a tree that is read anyway is skipped. With --dedupe-hardlinks the
+// files that have more than one name go in. The set is split into shards
+// with a lock each, so scanner threads hardly ever meet.
+#define INODE_SHARDS 64
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;           // 0 = empty bucket (no file has inode 0)
+} InodeKey;
+
+typedef struct {
+    InodeKey* buckets;
+    int64_t count;
+    int64_t capacity;       // Power of two, or 0
+    pthread_mutex_t lock;
+} InodeShard;
+
+typedef struct {
+    InodeShard shards[INODE_SHARDS];
+} InodeSet;
+
+// Device number as statx() splits it, so stat() and statx() results
+// give the same key
+static inline uint64_t DeviceKey(unsigned int devMajor, unsigned int devMinor) {
+    return (uint64_t)devMajor << 32 | devMinor;
+}
+
+static inline uint64_t StatDeviceKey(const struct stat* st) {
+    return DeviceKey(major(st->st_dev), minor(st->st_dev));
+}
+
+// Returns a new empty set, or NULL if neither option needs one
+static InodeSet* NewInodeSet(void) {
+    if (!g_FollowSymlinks && !g_DedupeHardlinks) return NULL;
+    InodeSet* set = (InodeSet*)calloc(1, sizeof(InodeSet));
+    if (set == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in NewInodeSet.\n");
+        exit(1);
+    }
+    for (int i = 0; i < INODE_SHARDS; i++) pthread_mutex_init(&set->shards[i].lock, NULL);
+    return set;
+}
+
+static void FreeInodeSet(InodeSet* set) {
+    if (set == NULL) return;
+    for (int i = 0; i < INODE_SHARDS; i++) {
+        free(set->shards[i].buckets);
+        pthread_mutex_destroy(&set->shards[i].lock);
+    }
+    free(set);
+}
+
+// Adds (dev, ino) to the set. Returns 1 if it was not there yet, which
+// means the caller is the first to reach that file or directory.
+static int InodeSetAdd(InodeSet* set, uint64_t dev, uint64_t ino) {
+    uint64_t hash = (ino ^ dev * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 31;
+    InodeShard* shard = &set->shards[hash & (INODE_SHARDS - 1)];
+    hash >>= 6;
+
+    pthread_mutex_lock(&shard->lock);
+    // Grow the shard before it gets more than half full
+    if ((shard->count + 1) * 2 > shard->capacity) {
+        int64_t capacity = (shard->capacity == 0) ? 64 : shard->capacity * 2;
+        InodeKey* buckets = (InodeKey*)calloc(capacity, sizeof(InodeKey));
+        if (buckets == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in InodeSetAdd.\n");
+            exit(1);
+        }
+        for (int64_t i = 0; i < shard->capacity; i++) {
+            InodeKey key = shard->buckets[i];
+            if (key.ino == 0) continue;
+            uint64_t h = (key.ino ^ key.dev * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+            h = (h ^ (h >> 31)) >> 6;
+            int64_t b = (int64_t)(h & (uint64_t)(capacity - 1));
+            while (buckets[b].ino != 0) b = (b + 1) & (capacity - 1);
+            buckets[b] = key;
+        }
+        free(shard->buckets);
+        shard->buckets = buckets;
+        shard->capacity = capacity;
+    }
+    int64_t mask = shard->capacity - 1;
+    int64_t b = (int64_t)(hash & (uint64_t)mask);
+    while (shard->buckets[b].ino != 0) {
+        if (shard->buckets[b].ino == ino && shard->buckets[b].dev == dev) {
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+        b = (b + 1) & mask;
+    }
+    shard->buckets[b].dev = dev;
+    shard->buckets[b].ino = ino;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+// Returns non-zero if a file with this stat() result was already indexed
+// under another name in this scan (--dedupe-hardlinks). Linked files are
+// checked too, since their target may also be found directly.
+static int SeenFileBefore(InodeSet* set, uint64_t dev, uint64_t ino, uint64_t nlink) {
+    if (set == NULL || !g_DedupeHardlinks) return 0;
+    if (nlink <= 1 && !g_FollowSymlinks) return 0;
+    return !InodeSetAdd(set, dev, ino);
+}
+
+// A directory waiting to be read
+typedef struct {
+    int fd;             // Opened relative to its parent at discovery, or -1
+    int dir;            // Id in the result's directory tree
+    char* path;         // Full path, for messages and when 'fd' is -1
+    size_t rootLen;     // Length of the saved directory's part of 'path'
+    int root;           // Which of the scan's starting directories it lies in
+} ScanJob;
+
+// Each worker owns a deque of directories still to be read. The owner
+// pushes and pops at the tail (depth-first, good cache locality) while
+// idle workers steal from the head, where the biggest subtrees sit.
+typedef struct {
+    ScanJob* items;             // Ring buffer
+    int head;                   // Index of the oldest entry
+    int count;
+    int capacity;
+    pthread_mutex_t lock;       // Only contended while someone steals
+} ScanDeque;
+
+// --- io_uring batching (--io-uring) ---
+// On network and FUSE mounts every stat() or open() is a round trip to
+// the server. With --io-uring each scanner thread instead queues those
+// calls for a whole getdents64 buffer in its own ring and waits for them
+// together, so the round trips overlap instead of adding up. Raw system
+// calls keep this free of any library; if the kernel has no io_uring, or
+// no statx/openat in it, the scanner keeps making plain calls.
+
+#define URING_DEPTH 256         // Requests queued per ring before they are sent
+
+// Marks a request the ring never ran; it is done with a plain call instead
+#define URING_NOT_RUN INT_MIN
+
+typedef struct {
+    int fd;                     // Ring descriptor, -1 if unavailable
+    void* map;                  // Submission and completion rings (one mapping)
+    size_t mapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+} Uring;
+
+// A stat (or, for a subdirectory, an open) waiting in a scanner's batch
+typedef struct {
+    const char* name;           // Entry name, inside the getdents64 buffer
+    int type;                   // d_type from the directory entry
+    int open;                   // Non-zero: openat the subdirectory; zero: statx
+    int result;                 // Descriptor or 0 on success, -errno, or URING_NOT_RUN
+    struct statx stx;
+} ScanRequest;
+
+// Returns non-zero if the ring behind 'fd' can run statx and openat
+static int UringSupportsOps(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    if (probe == NULL) return 0;
+    int ok = 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_STATX && probe->last_op >= IORING_OP_OPENAT) {
+        ok = (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Sets up a ring. Returns 0 (leaving ring->fd at -1) if io_uring can't be used.
+static int UringInit(Uring* ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (fd < 0) return 0;
+    // Both rings in one mapping is what every kernel with statx support does
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !UringSupportsOps(fd)) {
+        close(fd);
+        return 0;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->mapSize = (sqSize > cqSize) ? sqSize : cqSize;
+    ring->map = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd, IORING_OFF_SQES);
+    if (ring->map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->map != MAP_FAILED) munmap(ring->map, ring->mapSize);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+        close(fd);
+        return 0;
+    }
+
+    char* base = (char*)ring->map;
+    ring->sqTail = (unsigned*)(base + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(base + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(base + params.sq_off.array);
+    ring->cqHead = (unsigned*)(base + params.cq_off.head);
+    ring->cqTail = (unsigned*)(base + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    ring->fd = fd;
+    return 1;
+}
+
+// Tears a ring down
+static void UringClose(Uring* ring) {
+    if (ring->fd < 0) return;
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->map, ring->mapSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Runs 'count' requests relative to 'dirFd' and waits for all of them.
+// If the ring fails before anything was sent, it is closed and every
+// request is left at URING_NOT_RUN for the caller to do by hand.
+static void UringRun(Uring* ring, int dirFd, ScanRequest* requests, int count) {
+    if (ring->fd < 0 || count == 0) return;
+
+    // Only this thread writes the submission tail
+    unsigned tail = *ring->sqTail;
+    for (int i = 0; i < count; i++) {
+        unsigned slot = tail & *ring->sqMask;
+        struct io_uring_sqe* sqe = &ring->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = dirFd;
+        sqe->addr = (uint64_t)(uintptr_t)requests[i].name;
+        sqe->user_data = (uint64_t)i;
+        if (requests[i].open) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->open_flags = ENTRY_OPEN_FLAGS;
+        } else {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO | STATX_NLINK;
+            sqe->off = (uint64_t)(uintptr_t)&requests[i].stx;
+        }
+        ring->sqArray[slot] = slot;
+        tail++;
+    }
+    atomic_store_explicit((_Atomic unsigned*)ring->sqTail, tail, memory_order_release);
+
+    int toSubmit = count;
+    int completed = 0;
+    while (completed < count) {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                sched_yield();
+                continue;
+            }
+            if (completed == 0 && toSubmit == count) {
+                UringClose(ring);
+                return;
+            }
+            // Requests in flight still point into our buffers; we can't walk away
+            WriteColor(COLOR_RED, "Fatal: io_uring failed in UringRun.\n");
+            exit(1);
+        }
+        toSubmit -= (int)ret;
+
+        unsigned head = *ring->cqHead;
+        unsigned cqTail = atomic_load_explicit((_Atomic unsigned*)ring->cqTail, memory_order_acquire);
+        for (; head != cqTail; head++) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            requests[cqe->user_data].result = cqe->res;
+            completed++;
+        }
+        atomic_store_explicit((_Atomic unsigned*)ring->cqHead, head, memory_order_release);
+    }
+}
+
+typedef struct ScanPool ScanPool;
+
+// Progress of one starting directory, for timing each of them apart.
+// Touched once per directory read, not per entry.
+typedef struct {
+    atomic_long pending;        // Its directories queued or being read
+    atomic_long dirs;           // Read so far
+    atomic_long files;          // Found so far
+    _Atomic int64_t finishedNs; // When 'pending' hit zero (MonotonicNs)
+} ScanRootProgress;
+
+typedef struct {
+    ScanPool* pool;
+    int id;
+    pthread_t thread;
+    ScanDeque deque;
+    PathStore files;            // This worker's share of the files (no dirs)
+    char* buffer;               // getdents64 buffer
+    Uring ring;                 // With --io-uring; ring.fd is -1 otherwise
+    ScanRequest* requests;      // Batch for the ring, URING_DEPTH entries
+    int requestCount;
+    int64_t previewFrom;        // First file not offered to the scan preview yet
+    int previewDirs;            // Directories whose files wait for it
+} ScanWorker;
+
+struct ScanPool {
+    ScanWorker* workers;
+    int count;
+    // Directories queued or being read. The scan is over once it hits zero.
+    atomic_long pending;
+    // Store the scan fills in. Workers add directories to it under
+    // 'dirLock' and keep files in their own stores until the merge.
+    PathStore* result;
+    pthread_mutex_t dirLock;
+    // Descriptors held open by queued jobs, kept below 'fdBudget' so wide
+    // trees cannot run us out of file descriptors
+    atomic_int openFds;
+    int fdBudget;
+    // Directories and files already reached, or NULL (see InodeSet)
+    InodeSet* inodes;
+    // One per starting directory, indexed by ScanJob.root
+    ScanRootProgress* roots;
+    // Set for the first scan: files found go to the preview, and the
+    // scan is abandoned if the program exits before it is done
+    int preview;
+    // Workers with nothing to steal sleep on 'idleCond' until a directory
+    // is queued or the scan is over. 'idle' counts them, so a push only
+    // takes the lock when someone is asleep.
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    atomic_int idle;
+};
+
+// Appends a job to the tail of a deque, growing it if needed
+static void ScanDequePush(ScanDeque* deque, ScanJob job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int newCapacity = (deque->capacity == 0) ? 64 : deque->capacity * 2;
+        ScanJob* newItems = (ScanJob*)malloc(newCapacity * sizeof(ScanJob));
+        if (newItems == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ScanDequePush.\n");
+            exit(1);
+        }
+        // Unwrap the ring so the entries start at index 0 again
+        for (int i = 0; i < deque->count; i++) {
+            newItems[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = newItems;
+        deque->head = 0;
+        deque->capacity = newCapacity;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes the newest job (owner side) or the oldest one (thief side).
+// Returns 0 if the deque is empty.
+static int ScanDequeTake(ScanDeque* deque, int steal, ScanJob* job) {
+    int taken = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        if (steal) {
+            *job = deque->items[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        } else {
+            *job = deque->items[(deque->head + deque->count - 1) % deque->capacity];
+        }
+        deque->count--;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+// Records a directory in the shared tree and returns its job. The path
+// is built once per directory; files below it only store their own name.
+static ScanJob ScanRegisterDir(ScanPool* pool, int parent, const char* name, const char* path) {
+    ScanJob job;
+    job.fd = -1;
+    job.path = strdup(path);
+    if (job.path == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in strdup.\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&pool->dirLock);
+    job.dir = StoreAddDir(pool->result, parent, name);
+    pthread_mutex_unlock(&pool->dirLock);
+    return job;
+}
+
+// Puts subdirectory 'name' of 'parent' on the worker's own deque. 'fd' is
+// the subdirectory already opened (and counted in 'openFds'), or -1.
+static void ScanPushDir(ScanWorker* worker, const ScanJob* parent, const char* name, int fd) {
+    ScanPool* pool = worker->pool;
+    char path[PATH_MAX];
+    size_t parentLen = strlen(parent->path);
+    size_t nameLen = strlen(name);
+    if (parentLen + 1 + nameLen >= sizeof(path)) {
+        // Too deep to ever display
+        if (fd >= 0) {
+            close(fd);
+            atomic_fetch_sub(&pool->openFds, 1);
+        }
+        return;
+    }
+    memcpy(path, parent->path, parentLen);
+    path[parentLen] = '/';
+    memcpy(path + parentLen + 1, name, nameLen + 1);
+
+    ScanJob job = ScanRegisterDir(pool, parent->dir, name, path);
+    job.fd = fd;
+    job.rootLen = parent->rootLen;
+    job.root = parent->root;
+
+    // Count it before it becomes visible so nobody sees 'pending' hit zero early
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->roots[job.root].pending, 1);
+    ScanDequePush(&worker->deque, job);
+    if (atomic_load(&pool->idle) > 0) {
+        // Someone ran out of work: wake one to steal it
+        pthread_mutex_lock(&pool->idleLock);
+        pthread_cond_signal(&pool->idleCond);
+        pthread_mutex_unlock(&pool->idleLock);
+    }
+}
+
+// Queues a subdirectory of 'parent' on the worker's own deque. While the
+// budget allows it, the directory is opened right away relative to the
+// parent's descriptor, so the kernel never walks the full path again.
+static void ScanQueueDir(ScanWorker* worker, int parentFd, const ScanJob* parent, const char* name) {
+    ScanPool* pool = worker->pool;
+    int fd = -1;
+    if (atomic_fetch_add(&pool->openFds, 1) < pool->fdBudget) {
+        fd = openat(parentFd, name, ENTRY_OPEN_FLAGS);
+    }
+    if (fd < 0) atomic_fetch_sub(&pool->openFds, 1);
+    ScanPushDir(worker, parent, name, fd);
+}
+
+// Returns non-zero if entry 'name' of the job's directory is excluded
+static inline int ScanExcluded(const ScanJob* job, const char* name, int isDir) {
+    return g_Excludes.count > 0 && IsExcluded(PathBelowRoot(job->path, job->rootLen), name, isDir);
+}
+
+// Copies the fields the scanner uses from a stat() result
+static void StatToStatx(const struct stat* st, struct statx* stx) {
+    stx->stx_mode = (uint16_t)st->st_mode;
+    stx->stx_size = (uint64_t)st->st_size;
+    stx->stx_mtime.tv_sec = (int64_t)st->st_mtime;
+    stx->stx_ino = (uint64_t)st->st_ino;
+    stx->stx_nlink = (uint32_t)st->st_nlink;
+    stx->stx_dev_major = major(st->st_dev);
+    stx->stx_dev_minor = minor(st->st_dev);
+}
+
+// Runs the worker's batched requests for directory 'dirFd' and files the
+// results. Anything the ring could not run is done with a plain call.
+static void ScanFlushRequests(ScanWorker* worker, int dirFd, const ScanJob* job, uint32_t* fileCount) {
+    UringRun(&worker->ring, dirFd, worker->requests, worker->requestCount);
+    for (int i = 0; i < worker->requestCount; i++) {
+        ScanRequest* req = &worker->requests[i];
+        if (req->open) {
+            int fd = req->result;
+            if (fd == URING_NOT_RUN) fd = openat(dirFd, req->name, ENTRY_OPEN_FLAGS);
+            if (fd < 0) {
+                atomic_fetch_sub(&worker->pool->openFds, 1);
+                fd = -1;
+            }
+            ScanPushDir(worker, job, req->name, fd);
+            continue;
+        }
+
+        if (req->result == URING_NOT_RUN) {
+            struct stat st;
+            req->result = (fstatat(dirFd, req->name, &st, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+            if (req->result == 0) StatToStatx(&st, &req->stx);
+        }
+        if (req->type == DT_UNKNOWN || req->type == DT_LNK) {
+            // Only now do we know what it is
+            if (req->result < 0) continue;
+            if (S_ISLNK(req->stx.stx_mode) && g_FollowSymlinks) {
+                // Follow it with a plain call; links are few
+                struct stat st;
+                int haveStat, isLink;
+                int type = EntryType(dirFd, req->name, DT_LNK, &st, &haveStat, &isLink);
+                if (type == DT_UNKNOWN) continue;
+                if (type == DT_DIR) {
+                    if (!ScanExcluded(job, req->name, 1) && !LinkEntryLeadsIntoRoots(job->path, req->name)) {
+                        ScanQueueDir(worker, dirFd, job, req->name);
+                    }
+                    continue;
+                }
+                StatToStatx(&st, &req->stx);
+            }
+            int isDir = S_ISDIR(req->stx.stx_mode);
+            if (!isDir && !S_ISREG(req->stx.stx_mode)) continue;
+            if (ScanExcluded(job, req->name, isDir)) continue;
+            if (isDir) {
+                ScanQueueDir(worker, dirFd, job, req->name);
+                continue;
+            }
+            if (g_TreeSampler) {
+                (*fileCount)++;
+                continue;
+            }
+        }
+        int ok = (req->result == 0);
+        if (ok && SeenFileBefore(worker->pool->inodes, DeviceKey(req->stx.stx_dev_major, req->stx.stx_dev_minor),
+                                 req->stx.stx_ino, req->stx.stx_nlink)) {
+            continue;
+        }
+        StoreAddFile(&worker->files, job->dir, req->name, ok ? (int64_t)req->stx.stx_size : 0,
+                     ok ? (int64_t)req->stx.stx_mtime.tv_sec : 0);
+    }
+    worker->requestCount = 0;
+}
+
+// Adds an entry of the directory being read to the worker's batch, or
+// handles it right away if it needs no system call
+static void ScanAddRequest(ScanWorker* worker, int dirFd, const ScanJob* job, const char* name, int type,
+                           uint32_t* fileCount) {
+    ScanPool* pool = worker->pool;
+    int open = 0;
+    if ((type == DT_DIR || type == DT_REG) && ScanExcluded(job, name, type == DT_DIR)) return;
+    if (type == DT_DIR) {
+        if (atomic_fetch_add(&pool->openFds, 1) >= pool->fdBudget) {
+            // Out of descriptors: it gets opened by path when its turn comes
+            atomic_fetch_sub(&pool->openFds, 1);
+            ScanPushDir(worker, job, name, -1);
+            return;
+        }
+        open = 1;
+    } else if (type == DT_REG && g_TreeSampler) {
+        (*fileCount)++;
+        return;
+    } else if (type != DT_REG && type != DT_UNKNOWN && !(type == DT_LNK && g_FollowSymlinks)) {
+        return;
+    }
+    if (type == DT_UNKNOWN) StatAdd(STAT_STAT_FALLBACKS, 1);
+
+    if (worker->requestCount == URING_DEPTH) ScanFlushRequests(worker, dirFd, job, fileCount);
+    ScanRequest* req = &worker->requests[worker->requestCount++];
+    req->name = name;
+    req->type = type;
+    req->open = open;
+    req->result = URING_NOT_RUN;
+}
+
+// Queues starting directory number 'root'. 'rootLen' is the length of
+// the saved directory it lies in, for matching exclude rules.
+static void ScanQueueRoot(ScanWorker* worker, const char* path, size_t rootLen, int root) {
+    ScanJob job = ScanRegisterDir(worker->pool, DIR_ROOT, path, path);
+    job.rootLen = rootLen;
+    job.root = root;
+    atomic_fetch_add(&worker->pool->pending, 1);
+    atomic_fetch_add(&worker->pool->roots[root].pending, 1);
+    ScanDequePush(&worker->deque, job);
+}
+
+// Offers the files this worker found since it last did to the scan
+// preview: when the sample is free, once PREVIEW_BATCH_DIRS directories'
+// files are waiting, or always if 'force' is set
+static void ScanOfferPreview(ScanWorker* worker, int force) {
+    if (worker->previewFrom == worker->files.fileCount) return;
+    int wait = force || ++worker->previewDirs >= PREVIEW_BATCH_DIRS;
+    ScanPool* pool = worker->pool;
+    if (!PreviewAdd(&worker->files, worker->previewFrom, pool->result, &pool->dirLock, wait)) return;
+    worker->previewFrom = worker->files.fileCount;
+    worker->previewDirs = 0;
+}
+
+// Reads one directory in large getdents64 batches: files go to the
+// worker's results (or are only counted, for the tree sampler),
+// subdirectories go to its deque instead of being recursed into
+static void ScanOneDirectory(ScanWorker* worker, const ScanJob* job) {
+    int fd = job->fd;
+    if (fd >= 0) {
+        atomic_fetch_sub(&worker->pool->openFds, 1);
+    } else {
+        fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        // Error (e.g., permissions denied)
+        StatAdd(STAT_DIRS_FAILED, 1);
+        char buffer[PATH_MAX + 64];
+        snprintf(buffer, sizeof(buffer), "Warning: Access denied to directory %s. Skipping.\n", job->path);
+        WriteColor(COLOR_YELLOW, buffer);
+        return;
+    }
+
+    // Remember what the directory looked like before we read it, so a
+    // snapshot can later tell whether it needs to be read again
+    struct stat dirSt;
+    int haveDirSt = (fstat(fd, &dirSt) == 0);
+    // Following links, a directory can be reached along several paths
+    // (or in a circle); only the first one to get here reads it
+    if (haveDirSt && g_FollowSymlinks && !InodeSetAdd(worker->pool->inodes, StatDeviceKey(&dirSt), (uint64_t)dirSt.st_ino)) {
+        pthread_mutex_lock(&worker->pool->dirLock);
+        worker->pool->result->dirs[job->dir].mtime = DIR_MTIME_ALIAS;
+        worker->pool->result->dirs[job->dir].ino = (uint64_t)dirSt.st_ino;
+        pthread_mutex_unlock(&worker->pool->dirLock);
+        close(fd);
+        return;
+    }
+    if (haveDirSt) {
+        pthread_mutex_lock(&worker->pool->dirLock);
+        DirNode* node = &worker->pool->result->dirs[job->dir];
+        node->mtime = (int64_t)dirSt.st_mtim.tv_sec * 1000000000 + dirSt.st_mtim.tv_nsec;
+        node->ino = (uint64_t)dirSt.st_ino;
+        pthread_mutex_unlock(&worker->pool->dirLock);
+    }
+
+    PathStore* fileList = &worker->files;
+    int64_t filesBefore = fileList->fileCount;
+    uint32_t fileCount = 0; // Tree sampler: regular files seen here
+    unsigned long long entries = 0, reads = 0;
+    long length;
+    // Read all entries in the directory, one buffer at a time
+    while ((length = syscall(SYS_getdents64, fd, worker->buffer, GETDENTS_BUF_SIZE)) > 0) {
+        reads++;
+        for (long offset = 0; offset < length; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(worker->buffer + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+
+            // Skip "." and ".."
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            entries++;
+
+            // With a ring, system calls wait in a batch until the buffer is done
+            if (worker->ring.fd >= 0) {
+                ScanAddRequest(worker, fd, job, name, g_IgnoreDType ? DT_UNKNOWN : entry->d_type, &fileCount);
+                continue;
+            }
+
+            // Check if the entry is a directory or file
+        #if defined(DT_DIR) && defined(DT_REG) && defined(DT_UNKNOWN)
+            struct stat st;
+            int haveStat, isLink;
+            int type = EntryType(fd, name, entry->d_type, &st, &haveStat, &isLink);
+            // Excluded directories are never opened, let alone read
+            if ((type == DT_DIR || type == DT_REG) && ScanExcluded(job, name, type == DT_DIR)) continue;
+            if (type == DT_DIR && isLink && LinkEntryLeadsIntoRoots(job->path, name)) continue;
+            if (type == DT_DIR) {
+                // It's a directory, queue it for later
+                ScanQueueDir(worker, fd, job, name);
+            } else if (type == DT_REG && g_TreeSampler) {
+                // The tree sampler only needs to know how many there are
+                fileCount++;
+            } else if (type == DT_REG) {
+                // It's a regular file: add it with its size and age
+                if (!haveStat) haveStat = (fstatat(fd, name, &st, ENTRY_STAT_FLAGS) == 0);
+                if (haveStat && SeenFileBefore(worker->pool->inodes, StatDeviceKey(&st), (uint64_t)st.st_ino,
+                                               (uint64_t)st.st_nlink)) {
+                    continue;
+                }
+                StoreAddFile(fileList, job->dir, name, haveStat ? (int64_t)st.st_size : 0,
+                             haveStat ? (int64_t)st.st_mtime : 0);
+            }
+        #else
+            {
+                // d_type constants not available on this platform; always use fstatat()
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    if (ScanExcluded(job, name, S_ISDIR(st.st_mode))) {
+                        // Left out by the exclude rules
+                    } else if (S_ISDIR(st.st_mode)) {
+                        ScanQueueDir(worker, fd, job, name);
+                    } else if (S_ISREG(st.st_mode) && g_TreeSampler) {
+                        fileCount++;
+                    } else if (S_ISREG(st.st_mode)) {
+                        StoreAddFile(fileList, job->dir, name, (int64_t)st.st_size, (int64_t)st.st_mtime);
+                    }
+                } else {
+                    char buffer[PATH_MAX + 64];
+                    snprintf(buffer, sizeof(buffer), "Warning: stat failed for %s/%s: %s. Skipping.\n", job->path, name, strerror(errno));
+                    WriteColor(COLOR_YELLOW, buffer);
+                }
+            }
+        #endif
+        }
+        // The batch points at names in the buffer: finish it before the next read
+        if (worker->requestCount > 0) ScanFlushRequests(worker, fd, job, &fileCount);
+    }
+    close(fd);
+
+    // Counted once per directory, not per entry
+    long long found = g_TreeSampler ? (long long)fileCount : (long long)(fileList->fileCount - filesBefore);
+    StatAdd(STAT_DIRS_OPENED, 1);
+    StatAdd(STAT_GETDENTS_CALLS, reads);
+    StatAdd(STAT_ENTRIES_READ, entries);
+    StatAdd(STAT_FILES_FOUND, (unsigned long long)found);
+    atomic_fetch_add(&worker->pool->roots[job->root].dirs, 1);
+    atomic_fetch_add(&worker->pool->roots[job->root].files, found);
+    if (worker->pool->preview && !g_TreeSampler && found > 0) ScanOfferPreview(worker, 0);
+
+    if (fileCount > 0) {
+        pthread_mutex_lock(&worker->pool->dirLock);
+        worker->pool->result->dirs[job->dir].files = fileCount;
+        pthread_mutex_unlock(&worker->pool->dirLock);
+    }
+}
+
+// Returns non-zero if any worker's deque holds a job
+static int ScanPoolHasWork(ScanPool* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        pthread_mutex_lock(&pool->workers[i].deque.lock);
+        int count = pool->workers[i].deque.count;
+        pthread_mutex_unlock(&pool->workers[i].deque.lock);
+        if (count > 0) return 1;
+    }
+    return 0;
+}
+
+// Sleeps until a directory is queued somewhere or the scan is over. Being
+// counted in 'idle' before looking means a push made meanwhile either is
+// seen here or signals us.
+static void ScanWaitForWork(ScanPool* pool) {
+    pthread_mutex_lock(&pool->idleLock);
+    atomic_fetch_add(&pool->idle, 1);
+    if (atomic_load(&pool->pending) > 0 && !ScanPoolHasWork(pool)) {
+        pthread_cond_wait(&pool->idleCond, &pool->idleLock);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_unlock(&pool->idleLock);
+}
+
+// Worker loop: drain our own deque, then steal from the others until no
+// directory is queued or being read anywhere
+static void* ScanWorkerThread(void* arg) {
+    ScanWorker* worker = (ScanWorker*)arg;
+    ScanPool* pool = worker->pool;
+
+    while (1) {
+        ScanJob job;
+        int found = ScanDequeTake(&worker->deque, 0, &job);
+        // Nothing local: try every other worker, starting with our neighbour
+        for (int i = 1; !found && i < pool->count; i++) {
+            found = ScanDequeTake(&pool->workers[(worker->id + i) % pool->count].deque, 1, &job);
+        }
+
+        if (!found) {
+            if (atomic_load(&pool->pending) == 0) break;
+            // Someone is still reading a directory that may yield more work
+            ScanWaitForWork(pool);
+            continue;
+        }
+
+        if (pool->preview && !g_running) {
+            // Exiting before the first scan is done: drop what is left unread
+            if (job.fd >= 0) {
+                close(job.fd);
+                atomic_fetch_sub(&pool->openFds, 1);
+            }
+        } else {
+            ScanOneDirectory(worker, &job);
+        }
+        free(job.path);
+        // The last directory of a starting directory stops its clock
+        if (atomic_fetch_sub(&pool->roots[job.root].pending, 1) == 1) {
+            atomic_store(&pool->roots[job.root].finishedNs, MonotonicNs());
+        }
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            // That was the last one: let the sleepers go home
+            pthread_mutex_lock(&pool->idleLock);
+            pthread_cond_broadcast(&pool->idleCond);
+            pthread_mutex_unlock(&pool->idleLock);
+        }
+    }
+    if (pool->preview && !g_TreeSampler) ScanOfferPreview(worker, 1); // What was held back
+    return NULL;
+}
+
+// A directory or file of a scanned store, for sorting it by name
+typedef struct {
+    int parent;         // Parent directory (directories) or directory (files)
+    const char* name;
+    int64_t id;         // Directory id or file slot
+} StoreSortKey;
+
+static int CompareStoreSortKeys(const void* a, const void* b) {
+    const StoreSortKey* x = (const StoreSortKey*)a;
+    const StoreSortKey* y = (const StoreSortKey*)b;
+    if (x->parent != y->parent) return (x->parent < y->parent) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Puts a freshly scanned store into an order that only depends on what is
+// on disk: directories depth-first with siblings by name, and files by
+// directory and name. The workers steal directories from each other, so
+// the order they record things in changes from run to run.
+static void StoreCanonicalize(PathStore* store) {
+    int dirCount = store->dirCount;
+    int64_t fileCount = store->fileCount;
+    size_t keyCount = (size_t)(dirCount > fileCount ? dirCount : fileCount) + 1;
+    StoreSortKey* keys = (StoreSortKey*)malloc(keyCount * sizeof(StoreSortKey));
+    int* runStart = (int*)malloc((dirCount + 1) * sizeof(int));     // First child of each directory in 'keys'
+    int* newId = (int*)malloc((dirCount + 1) * sizeof(int));
+    int* stack = (int*)malloc((dirCount + 1) * sizeof(int));
+    DirNode* dirs = (DirNode*)malloc((dirCount + 1) * sizeof(DirNode));
+    if (keys == NULL || runStart == NULL || newId == NULL || stack == NULL || dirs == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in StoreCanonicalize.\n");
+        exit(1);
+    }
+
+    // Group the directories by parent, each group sorted by name; the
+    // roots (negative parents) come first
+    for (int d = 0; d < dirCount; d++) {
+        keys[d].parent = store->dirs[d].parent < 0 ? -1 : store->dirs[d].parent;
+        keys[d].name = StoreDirName(store, d);
+        keys[d].id = d;
+    }
+    qsort(keys, dirCount, sizeof(StoreSortKey), CompareStoreSortKeys);
+    for (int d = 0; d <= dirCount; d++) runStart[d] = dirCount;
+    int tops = 0;
+    for (int i = dirCount - 1; i >= 0; i--) {
+        if (keys[i].parent >= 0) runStart[keys[i].parent] = i;
+        else tops = i + 1;
+    }
+
+    // Number them depth-first, so parents still come before children
+    int depth = 0, next = 0;
+    for (int i = tops - 1; i >= 0; i--) stack[depth++] = i;
+    while (depth > 0) {
+        int old = (int)keys[stack[--depth]].id;
+        newId[old] = next;
+        dirs[next] = store->dirs[old];
+        if (dirs[next].parent >= 0) dirs[next].parent = newId[dirs[next].parent];
+        next++;
+        int end = runStart[old];
+        while (end < dirCount && keys[end].parent == old) end++;
+        for (int i = end - 1; i >= runStart[old]; i--) stack[depth++] = i;
+    }
+    memcpy(store->dirs, dirs, (size_t)dirCount * sizeof(DirNode));
+
+    // Then the files, by their directory's new id and their name
+    for (int64_t i = 0; i < fileCount; i++) {
+        keys[i].parent = newId[store->files[i].dir];
+        keys[i].name = StoreFileName(store, i);
+        keys[i].id = i;
+    }
+    qsort(keys, (size_t)fileCount, sizeof(StoreSortKey), CompareStoreSortKeys);
+    PathStore sorted;
+    InitPathStore(&sorted);
+    StoreReserveFiles(&sorted, fileCount > 0 ? fileCount : 1);
+    for (int64_t i = 0; i < fileCount; i++) {
+        int64_t old = keys[i].id;
+        sorted.files[i] = store->files[old];
+        sorted.files[i].dir = keys[i].parent;
+        sorted.sizes[i] = store->sizes[old];
+        sorted.mtimes[i] = store->mtimes[old];
+        sorted.exts[i] = store->exts[old];
+    }
+    free(store->files);
+    free(store->sizes);
+    free(store->mtimes);
+    free(store->exts);
+    store->files = sorted.files;
+    store->sizes = sorted.sizes;
+    store->mtimes = sorted.mtimes;
+    store->exts = sorted.exts;
+    store->fileCapacity = sorted.fileCapacity;
+
+    free(keys);
+    free(runStart);
+    free(newId);
+    free(stack);
+    free(dirs);
+}
+
+// Number of scanner threads to use: the --threads option, or one per core
+static int ScanThreadCount(void) {
+    if (g_ScanThreads > 0) return g_ScanThreads;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cores > 0) ? (int)cores : 1;
+}
+
+// Scans every directory in 'roots' in parallel and adds the directories
+// read and the regular files found below them to 'result'. 'rootLen' is
+// the length of the saved directory they all lie in, or 0 if each of them
+// is a saved directory itself. 'preview' feeds the files found to the
+// scan preview as they come (see ScanPool).
+static void ScanTrees(const StringList* roots, size_t rootLen, PathStore* result, int preview) {
+    if (roots->count == 0) return;
+
+    int64_t startNs = MonotonicNs();
+    ScanPool pool;
+    pool.count = ScanThreadCount();
+    pool.result = result;
+    pool.inodes = NewInodeSet();
+    pool.preview = preview;
+    pool.roots = (ScanRootProgress*)calloc(roots->count, sizeof(ScanRootProgress));
+    if (pool.roots == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in ScanDirectories.\n");
+        exit(1);
+    }
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.openFds, 0);
+    atomic_init(&pool.idle, 0);
+    pthread_mutex_init(&pool.dirLock, NULL);
+    pthread_mutex_init(&pool.idleLock, NULL);
+    pthread_cond_init(&pool.idleCond, NULL);
+
+    // Leave plenty of descriptors for the rest of the program
+    struct rlimit limit;
+    pool.fdBudget = 256;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        pool.fdBudget = (int)(limit.rlim_cur / 2);
+        if (pool.fdBudget > 4096) pool.fdBudget = 4096;
+    }
+
+    pool.workers = (ScanWorker*)calloc(pool.count, sizeof(ScanWorker));
+    if (pool.workers == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in ScanDirectories.\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool.count; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+        InitPathStore(&pool.workers[i].files);
+        pool.workers[i].buffer = (char*)malloc(GETDENTS_BUF_SIZE);
+        if (pool.workers[i].buffer == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ScanDirectories.\n");
+            exit(1);
+        }
+        // Without a ring the worker simply makes its calls one at a time
+        pool.workers[i].ring.fd = -1;
+        if (g_UseIoUring && UringInit(&pool.workers[i].ring)) {
+            pool.workers[i].requests = (ScanRequest*)malloc(URING_DEPTH * sizeof(ScanRequest));
+            if (pool.workers[i].requests == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory in ScanDirectories.\n");
+                exit(1);
+            }
+        }
+    }
+
+    // Deal the roots out round-robin so every worker starts with something
+    for (int i = 0; i < roots->count; i++) {
+        ScanQueueRoot(&pool.workers[i % pool.count], roots->items[i],
+                      (rootLen > 0) ? rootLen : strlen(roots->items[i]), i);
+    }
+
+    // The calling thread doubles as worker 0
+    int started = 1;
+    for (int i = 1; i < pool.count; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, ScanWorkerThread, &pool.workers[i]) != 0) {
+            break; // Fewer threads just means less parallelism
+        }
+        started++;
+    }
+    ScanWorkerThread(&pool.workers[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    // Merge the per-worker results. The names stay where they are; the
+    // result just adopts the arena blocks holding them.
+    for (int i = 0; i < pool.count; i++) {
+        StoreAppendFiles(result, &pool.workers[i].files);
+        UringClose(&pool.workers[i].ring);
+        free(pool.workers[i].requests);
+        free(pool.workers[i].buffer);
+        free(pool.workers[i].deque.items);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+    free(pool.workers);
+    FreeInodeSet(pool.inodes);
+    pthread_mutex_destroy(&pool.dirLock);
+    pthread_mutex_destroy(&pool.idleLock);
+    pthread_cond_destroy(&pool.idleCond);
+    if (g_SeedFixed) StoreCanonicalize(result);
+
+    // Time each starting directory took, filed under its saved directory
+    StatAdd(STAT_SCANS, 1);
+    for (int i = 0; i < roots->count; i++) {
+        size_t length = strlen(roots->items[i]);
+        size_t saved = (rootLen > 0) ? rootLen : length;
+        StatsRecordScan(roots->items[i], saved, (double)(pool.roots[i].finishedNs - startNs) / 1e9, saved == length,
+                        pool.roots[i].dirs, pool.roots[i].files);
+    }
+    free(pool.roots);
+}
+
+// Scans every saved directory in 'roots' in parallel
+void ScanDirectories(const StringList* roots, PathStore* result) {
+    ScanTrees(roots, 0, result, 0);
+}
+
+// Scans a single directory tree, which lies in the saved directory of
+// length 'rootLen', and adds what it finds to 'result'
+void ScanDirectory(const char* basePath, size_t rootLen, PathStore* result) {
+    StringList roots;
+    InitStringList(&roots);
+    AddStringToList(&roots, basePath);
+    ScanTrees(&roots, rootLen, result, 0);
+    FreeStringList(&roots);
+}
+
+// Scans all saved directories that exist, feeding the scan preview if
+// 'preview' is set
+static PathStore ScanSavedDirs(const StringList* dirs, int preview) {
+    PathStore result;
+    InitPathStore(&result);
+    // Only directories that still exist take part in the scan
+    StringList roots;
+    InitStringList(&roots);
+    for (int i = 0; i < dirs->count; i++) {
+        struct stat st;
+        if (stat(dirs->items[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            AddStringToList(&roots, dirs->items[i]);
+        }
+    }
+    ScanTrees(&roots, 0, &result, preview);
+    FreeStringList(&roots);
+    return result;
+}
+
+// Scans all saved directories
+PathStore GetAllFiles(const StringList* dirs) {
+    return ScanSavedDirs(dirs, 0);
+}
+
+// ====================================================================
+// --- Random Numbers ---
+// ====================================================================
+
+// xoshiro256** generator. Each thread has its own state, so picks never
+// contend on a lock the way rand() does, and the output is 64 bits wide
+// so any file count can be drawn from without bias.
+typedef struct {
+    uint64_t s[4];
+} RandomState;
+
+static _Thread_local RandomState g_ThreadRandom;
+static _Thread_local int g_ThreadRandomReady = 0;
+
+// Hands out a distinct stream number to every thread that draws numbers
+static atomic_uint_fast64_t g_RandomStreams = 0;
+
+// SplitMix64 step, used to expand a seed into a full generator state
+static uint64_t SplitMix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t RotateLeft(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// Seeds the calling thread's generator from g_RngSeed and its stream number
+static void RandomInitThread(void) {
+    uint64_t x = g_RngSeed ^ (atomic_fetch_add(&g_RandomStreams, 1) * 0xD1B54A32D192ED03ull);
+    for (int i = 0; i < 4; i++) g_ThreadRandom.s[i] = SplitMix64(&x);
+    g_ThreadRandomReady = 1;
+}
+
+// Sets the base seed. The calling thread becomes stream 0, so a fixed
+// seed gives the same picks on every run.
+void RandomSeed(uint64_t seed) {
+    g_RngSeed = seed;
+    atomic_store(&g_RandomStreams, 0);
+    RandomInitThread();
+}
+
+// Next 64 random bits from generator 'state'
+static inline uint64_t RandomNextFrom(RandomState* state) {
+    uint64_t* s = state->s;
+    uint64_t result = RotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RotateLeft(s[3], 45);
+    return result;
+}
+
+// Next 64 random bits from the calling thread's generator
+static inline uint64_t RandomNext(void) {
+    if (!g_ThreadRandomReady) RandomInitThread();
+    return RandomNextFrom(&g_ThreadRandom);
+}
+
+// Uniform random integer in [0, n), n > 0, from generator 'state', without
+// modulo bias (Lemire's multiply-and-reject: a division only happens on
+// the rare near-miss)
+static uint64_t RandomBelowFrom(RandomState* state, uint64_t n) {
+    unsigned __int128 m = (unsigned __int128)RandomNextFrom(state) * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+        uint64_t threshold = -n % n;
+        while (low < threshold) {
+            m = (unsigned __int128)RandomNextFrom(state) * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+}
+
+// Uniform random integer in [0, n), n > 0, from the calling thread's generator
+uint64_t RandomBelow(uint64_t n) {
+    if (!g_ThreadRandomReady) RandomInitThread();
+    return RandomBelowFrom(&g_ThreadRandom, n);
+}
+
+// Generator of the scan preview's reservoir, used under g_PreviewLock
+static RandomState g_PreviewRandom;
+static int g_PreviewRandomReady = 0;
+
+// Uniform random integer in [0, n), n > 0, for the scan preview. The
+// caller must hold g_PreviewLock.
+static uint64_t PreviewRandomBelow(uint64_t n) {
+    if (!g_PreviewRandomReady) {
+        uint64_t x = g_RngSeed ^ 0x5A17E5A17E5A17E5ull;
+        for (int i = 0; i < 4; i++) g_PreviewRandom.s[i] = SplitMix64(&x);
+        g_PreviewRandomReady = 1;
+    }
+    return RandomBelowFrom(&g_PreviewRandom, n);
+}
+
+// Uniform random double in (0, 1)
+static double RandomUnit(void) {
+    return ((double)(RandomNext() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+// ====================================================================
+// --- Streaming Selection (no index) ---
+// ====================================================================
+
+// Size of the single buffer the streaming walk reads entries into
+#define STREAM_BUF_SIZE (8 * 1024)
+
+// One open directory on the streaming walk's stack
+typedef struct {
+    int fd;
+    size_t pathLen;     // Length of the directory's path in the path buffer
+    int64_t resume;     // Where to continue reading after a subdirectory
+} StreamLevel;
+
+// Reservoir state for picking 'k' files out of a stream of unknown length
+// (Li's "Algorithm L": instead of a random number per file, it draws how
+// many files to skip before the next replacement)
+typedef struct {
+    char* picks;        // 'k' paths of PATH_MAX bytes each, filled in place
+    int k;
+    long long seen;     // Files streamed past so far
+    long long next;     // Index of the next file that enters a full reservoir
+    double w;
+} Reservoir;
+
+// Draws the index of the next file to enter a full reservoir
+static void ReservoirSkip(Reservoir* res) {
+    res->next += (long long)floor(log(RandomUnit()) / log(1.0 - res->w)) + 1;
+    res->w *= exp(log(RandomUnit()) / res->k);
+}
+
+// Offers the file 'name' in the directory held in 'path' (of length
+// 'pathLen') to the reservoir. The full path is only built if it is kept.
+static void ReservoirOffer(Reservoir* res, const char* path, size_t pathLen, const char* name) {
+    // A path too long to show is not part of the stream at all
+    size_t nameLen = strlen(name);
+    if (pathLen + 1 + nameLen >= PATH_MAX) return;
+
+    long long i = res->seen++;
+    int slot;
+    if (i < res->k) {
+        slot = (int)i;
+    } else if (i == res->next) {
+        slot = (int)RandomBelow((uint64_t)res->k);
+    } else {
+        return;
+    }
+
+    char* pick = res->picks + (size_t)slot * PATH_MAX;
+    memcpy(pick, path, pathLen);
+    pick[pathLen] = '/';
+    memcpy(pick + pathLen + 1, name, nameLen + 1);
+
+    // Once the reservoir is full, start skipping
+    if (i == res->k - 1) {
+        res->w = exp(log(RandomUnit()) / res->k);
+        res->next = i;
+        ReservoirSkip(res);
+    } else if (i >= res->k) {
+        ReservoirSkip(res);
+    }
+}
+
+// Streams every file below 'root' into the reservoir. Only one entry
+// buffer exists: when the walk descends into a subdirectory it remembers
+// the parent's position and seeks back to it afterwards. 'inodes' is
+// shared by all roots of one pass (see InodeSet); it may be NULL.
+static void StreamDirectory(const char* root, Reservoir* res, InodeSet* inodes, char* buffer) {
+    char path[PATH_MAX];
+    size_t rootLen = strlen(root);
+    if (rootLen >= sizeof(path)) return;
+    memcpy(path, root, rootLen + 1);
+
+    int depth = 0;
+    int capacity = 16;
+    StreamLevel* stack = (StreamLevel*)malloc(capacity * sizeof(StreamLevel));
+    if (stack == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in StreamDirectory.\n");
+        exit(1);
+    }
+    stack[0].fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stack[0].pathLen = rootLen;
+    struct stat rootSt;
+    if (stack[0].fd >= 0 && g_FollowSymlinks && fstat(stack[0].fd, &rootSt) == 0) {
+        InodeSetAdd(inodes, StatDeviceKey(&rootSt), (uint64_t)rootSt.st_ino);
+    }
+    if (stack[0].fd < 0) {
+        char msg[PATH_MAX + 64];
+        snprintf(msg, sizeof(msg), "Warning: Access denied to directory %s. Skipping.\n", root);
+        WriteColor(COLOR_YELLOW, msg);
+        free(stack);
+        return;
+    }
+    depth = 1;
+
+    while (depth > 0) {
+        StreamLevel* level = &stack[depth - 1];
+        long length = syscall(SYS_getdents64, level->fd, buffer, STREAM_BUF_SIZE);
+        if (length <= 0) {
+            // Done with this directory: go back to where the parent left off
+            close(level->fd);
+            depth--;
+            if (depth > 0) {
+                path[stack[depth - 1].pathLen] = '\0';
+                lseek(stack[depth - 1].fd, stack[depth - 1].resume, SEEK_SET);
+            }
+            continue;
+        }
+
+        for (long offset = 0; offset < length; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            struct stat st;
+            int haveStat, isLink;
+            int type = EntryType(level->fd, name, entry->d_type, &st, &haveStat, &isLink);
+            if (type != DT_REG && type != DT_DIR) continue;
+            if (IsExcluded(PathBelowRoot(path, rootLen), name, type == DT_DIR)) continue;
+            if (type == DT_DIR && isLink && LinkEntryLeadsIntoRoots(path, name)) continue;
+            if (type == DT_REG) {
+                // Telling names of one file apart takes a stat()
+                if (g_DedupeHardlinks && !haveStat) haveStat = (fstatat(level->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0);
+                if (g_DedupeHardlinks && haveStat &&
+                    SeenFileBefore(inodes, StatDeviceKey(&st), (uint64_t)st.st_ino, (uint64_t)st.st_nlink)) {
+                    continue;
+                }
+                ReservoirOffer(res, path, level->pathLen, name);
+                continue;
+            }
+
+            // Descend right away; the rest of this buffer is re-read later
+            size_t nameLen = strlen(name);
+            if (level->pathLen + 1 + nameLen >= sizeof(path)) continue;
+            int fd = openat(level->fd, name, ENTRY_OPEN_FLAGS);
+            if (fd < 0) continue;
+            // Following links, skip directories already walked (or being walked: a cycle)
+            struct stat dirSt;
+            if (g_FollowSymlinks && fstat(fd, &dirSt) == 0 &&
+                !InodeSetAdd(inodes, StatDeviceKey(&dirSt), (uint64_t)dirSt.st_ino)) {
+                close(fd);
+                continue;
+            }
+            if (depth == capacity) {
+                capacity *= 2;
+                StreamLevel* newStack = (StreamLevel*)realloc(stack, capacity * sizeof(StreamLevel));
+                if (newStack == NULL) {
+                    WriteColor(COLOR_RED, "Fatal: Out of memory in StreamDirectory.\n");
+                    exit(1);
+                }
+                stack = newStack;
+                level = &stack[depth - 1];
+            }
+            level->resume = entry->d_off;
+            path[level->pathLen] = '/';
+            memcpy(path + level->pathLen + 1, name, nameLen + 1);
+            stack[depth].fd = fd;
+            stack[depth].pathLen = level->pathLen + 1 + nameLen;
+            depth++;
+            break;
+        }
+    }
+    free(stack);
+}
+
+// Picks up to 'k' distinct random files from below the saved directories
+// in a single pass, without building any list. The chosen paths are
+// written in random order to 'picks', which holds 'k' paths of PATH_MAX
+// bytes each, so replacing one never allocates. Returns how many were
+// picked, which is less than 'k' only if there are fewer files.
+int StreamPickFiles(const StringList* dirs, int k, char* picks) {
+    if (k <= 0) return 0;
+    Reservoir res;
+    res.picks = picks;
+    res.k = k;
+    res.seen = 0;
+    res.next = LLONG_MAX; // No skipping until the reservoir is full
+    res.w = 0.0;
+
+    char* buffer = (char*)malloc(STREAM_BUF_SIZE);
+    if (buffer == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in StreamPickFiles.\n");
+        exit(1);
+    }
+    InodeSet* inodes = NewInodeSet();
+    for (int i = 0; i < dirs->count; i++) {
+        struct stat st;
+        if (stat(dirs->items[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            StreamDirectory(dirs->items[i], &res, inodes, buffer);
+        }
+    }
+    FreeInodeSet(inodes);
+    free(buffer);
+
+    int count = (res.seen < k) ? (int)res.seen : k;
+    // The reservoir keeps a uniform set, not a uniform order: shuffle it
+    char tmp[PATH_MAX];
+    for (int i = count - 1; i > 0; i--) {
+        int j = (int)RandomBelow((uint64_t)i + 1);
+        if (j == i) continue;
+        char* a = picks + (size_t)i * PATH_MAX;
+        char* b = picks + (size_t)j * PATH_MAX;
+        memcpy(tmp, a, strlen(a) + 1);
+        memcpy(a, b, strlen(b) + 1);
+        memcpy(b, tmp, strlen(tmp) + 1);
+    }
+    return count;
+}
+
+// ====================================================================
+// --- Tree Sampler ---
+// ====================================================================
+// With --sampler tree the index holds directories only. Each directory
+// knows how many regular files sit directly inside it (DirNode.files) and
+// how many lie anywhere below it, so a uniform pick can walk down from the
+// top choosing children by weight, and only the one directory it lands in
+// is read to find the file. Memory grows with the number of directories,
+// not files, and a create or delete only touches the counts on one path.
+
+// How often a pick is redrawn when the chosen directory turned out to hold
+// fewer files than counted (e.g. a rename replaced an existing file)
+#define TREE_PICK_ATTEMPTS 8
+
+static inline TreeNode* TreeNodeOf(FileIndex* index, int dir) {
+    return (dir == DIR_ROOT) ? &index->treeTop : &index->tree[dir];
+}
+
+// Makes room for a node per directory in the store
+static void TreeReserve(FileIndex* index) {
+    if (index->store.dirCount <= index->treeCapacity) return;
+    int newCapacity = (index->treeCapacity == 0) ? 64 : index->treeCapacity;
+    while (newCapacity < index->store.dirCount) newCapacity *= 2;
+    TreeNode* newTree = (TreeNode*)realloc(index->tree, newCapacity * sizeof(TreeNode));
+    if (newTree == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in TreeReserve.\n");
+        exit(1);
+    }
+    memset(newTree + index->treeCapacity, 0, (newCapacity - index->treeCapacity) * sizeof(TreeNode));
+    index->tree = newTree;
+    index->treeCapacity = newCapacity;
+}
+
+// Makes room for one more child in 'node'
+static void TreeGrowKids(TreeNode* node) {
+    if (node->kidCount < node->kidCapacity) return;
+    int newCapacity = (node->kidCapacity == 0) ? 4 : node->kidCapacity * 2;
+    int* newKids = (int*)realloc(node->kids, newCapacity * sizeof(int));
+    int64_t* newFenwick = (int64_t*)realloc(node->fenwick, (newCapacity + 1) * sizeof(int64_t));
+    if (newKids == NULL || newFenwick == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in TreeGrowKids.\n");
+        exit(1);
+    }
+    if (node->kidCapacity == 0) newFenwick[0] = 0; // Unused; Fenwick positions start at 1
+    node->kids = newKids;
+    node->fenwick = newFenwick;
+    node->kidCapacity = newCapacity;
+}
+
+// Adds 'delta' to the count of the child at 1-based position 'pos'
+static void FenwickAdd(TreeNode* node, int pos, int64_t delta) {
+    for (; pos <= node->kidCount; pos += pos & -pos) node->fenwick[pos] += delta;
+}
+
+// Sum of the counts of the first 'pos' children
+static int64_t FenwickPrefix(const TreeNode* node, int pos) {
+    int64_t sum = 0;
+    for (; pos > 0; pos -= pos & -pos) sum += node->fenwick[pos];
+    return sum;
+}
+
+// Adds 'delta' to the total of 'dir' and of every directory above it
+static void TreeAddTotal(FileIndex* index, int dir, int64_t delta) {
+    while (1) {
+        TreeNode* node = TreeNodeOf(index, dir);
+        node->total += delta;
+        if (dir == DIR_ROOT || node->parentSlot == 0) return;
+        int parent = index->store.dirs[dir].parent;
+        FenwickAdd(TreeNodeOf(index, parent), node->parentSlot, delta);
+        dir = parent;
+    }
+}
+
+// Appends 'dir' to its parent's children, bringing its total along
+static void TreeAttach(FileIndex* index, int dir) {
+    int parent = index->store.dirs[dir].parent;
+    TreeNode* up = TreeNodeOf(index, parent);
+    TreeNode* node = &index->tree[dir];
+    TreeGrowKids(up);
+    int pos = ++up->kidCount;
+    up->kids[pos - 1] = dir;
+    // The new last position covers (pos - lowbit, pos]: its own count plus
+    // the children before it in that range
+    up->fenwick[pos] = node->total + FenwickPrefix(up, pos - 1) - FenwickPrefix(up, pos - (pos & -pos));
+    node->parentSlot = pos;
+    if (node->total != 0) TreeAddTotal(index, parent, node->total);
+}
+
+// Takes 'dir' out of its parent's children. Its own counts stay, so it
+// can be attached again somewhere else (a directory rename).
+static void TreeDetach(FileIndex* index, int dir) {
+    TreeNode* node = &index->tree[dir];
+    if (node->parentSlot == 0) return;
+    int parent = index->store.dirs[dir].parent;
+    TreeNode* up = TreeNodeOf(index, parent);
+    FenwickAdd(up, node->parentSlot, -node->total);
+    up->kids[node->parentSlot - 1] = -1;
+    node->parentSlot = 0;
+    if (node->total != 0) TreeAddTotal(index, parent, -node->total);
+}
+
+// Changes the number of files directly inside 'dir' by 'delta'
+static void TreeAddFiles(FileIndex* index, int dir, int64_t delta) {
+    index->store.dirs[dir].files = (uint32_t)((int64_t)index->store.dirs[dir].files + delta);
+    TreeAddTotal(index, dir, delta);
+    index->generation++;
+}
+
+// Forgets every file at or below 'target'
+static void TreeClear(FileIndex* index, int target) {
+    TreeAddTotal(index, target, -index->tree[target].total);
+    // The subtree no longer counts towards anything above it; zero it so
+    // later creates start from nothing
+    int* stack = (int*)malloc((index->store.dirCount + 1) * sizeof(int));
+    if (stack == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in TreeClear.\n");
+        exit(1);
+    }
+    int depth = 0;
+    stack[depth++] = target;
+    while (depth > 0) {
+        int dir = stack[--depth];
+        TreeNode* node = &index->tree[dir];
+        index->store.dirs[dir].files = 0;
+        node->total = 0;
+        for (int i = 0; i < node->kidCount; i++) {
+            node->fenwick[i + 1] = 0;
+            if (node->kids[i] >= 0) stack[depth++] = node->kids[i];
+        }
+    }
+    free(stack);
+    index->generation++;
+}
+
+// Sets up the counts for a freshly scanned store in O(directories)
+static void TreeBuild(FileIndex* index) {
+    const PathStore* store = &index->store;
+    TreeReserve(index);
+    // Parents are always recorded before their children, so walking
+    // backwards finishes every total before it is added to its parent
+    for (int d = store->dirCount - 1; d >= 0; d--) {
+        TreeNode* node = &index->tree[d];
+        node->total += store->dirs[d].files;
+        TreeNode* up = TreeNodeOf(index, store->dirs[d].parent);
+        up->total += node->total;
+        TreeGrowKids(up);
+        up->kids[up->kidCount++] = d;
+        up->fenwick[up->kidCount] = node->total;
+        node->parentSlot = up->kidCount;
+    }
+    // Turn each list of plain counts into a Fenwick tree in place
+    for (int d = -1; d < store->dirCount; d++) {
+        TreeNode* node = TreeNodeOf(index, d);
+        for (int i = 1; i <= node->kidCount; i++) {
+            int j = i + (i & -i);
+            if (j <= node->kidCount) node->fenwick[j] += node->fenwick[i];
+        }
+    }
+}
+
+// Chooses a directory with probability proportional to the files directly
+// inside it, and which of those files to take. Returns -1 if there are none.
+static int TreeChooseDir(const FileIndex* index, uint64_t* nth) {
+    const TreeNode* node = &index->treeTop;
+    if (node->total <= 0) return -1;
+    uint64_t r = RandomBelow((uint64_t)node->total);
+    int dir = DIR_ROOT;
+    while (1) {
+        if (dir != DIR_ROOT) {
+            uint64_t own = index->store.dirs[dir].files;
+            if (r < own) {
+                *nth = r;
+                return dir;
+            }
+            r -= own;
+        }
+        // Descend the Fenwick tree to the child whose range holds 'r'
+        int pos = 0;
+        int step = 1;
+        while (step * 2 <= node->kidCount) step *= 2;
+        for (; step > 0; step >>= 1) {
+            if (pos + step <= node->kidCount && (uint64_t)node->fenwick[pos + step] <= r) {
+                pos += step;
+                r -= (uint64_t)node->fenwick[pos];
+            }
+        }
+        if (pos >= node->kidCount || node->kids[pos] < 0) return -1; // Counts out of step
+        dir = node->kids[pos];
+        node = &index->tree[dir];
+    }
+}
+
+static const char* IndexRootOf(const FileIndex* index, const char* path);
+
+// Reads directory 'dir' and writes the path of its 'nth' regular file into
+// 'buffer'. Returns 0 if the directory now holds fewer files than that.
+static int TreeNthFile(const FileIndex* index, int dir, uint64_t nth, char* buffer, size_t size) {
+    char dirPath[PATH_MAX];
+    if (StoreDirPath(&index->store, dir, dirPath, sizeof(dirPath)) < 0) return 0;
+    // Files left out by the exclude rules were not counted either
+    const char* root = IndexRootOf(index, dirPath);
+    const char* dirRel = PathBelowRoot(dirPath, (root != NULL) ? strlen(root) : strlen(dirPath));
+    int fd = open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char* entries = (char*)malloc(GETDENTS_BUF_SIZE);
+    if (entries == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in TreeNthFile.\n");
+        exit(1);
+    }
+
+    int found = 0;
+    long length;
+    while (!found && (length = syscall(SYS_getdents64, fd, entries, GETDENTS_BUF_SIZE)) > 0) {
+        for (long offset = 0; offset < length && !found; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(entries + offset);
+            offset += entry->d_reclen;
+            struct stat st;
+            int haveStat, isLink;
+            int type = EntryType(fd, entry->d_name, entry->d_type, &st, &haveStat, &isLink);
+            if (type != DT_REG || IsExcluded(dirRel, entry->d_name, 0)) continue;
+            if (nth-- == 0) {
+                int len = snprintf(buffer, size, "%s/%s", dirPath, entry->d_name);
+                found = (len >= 0 && (size_t)len < size);
+            }
+        }
+    }
+    free(entries);
+    close(fd);
+    return found;
+}
+
+// Counts what the scanner counts directly inside 'dirPath', whose saved
+// directory is 'rootLen' bytes long: the regular files no exclude rule
+// leaves out. Returns -1 if the directory can't be read.
+int64_t TreeCountFiles(const char* dirPath, size_t rootLen) {
+    const char* dirRel = PathBelowRoot(dirPath, rootLen);
+    int fd = open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char* entries = (char*)malloc(GETDENTS_BUF_SIZE);
+    if (entries == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in TreeCountFiles.\n");
+        exit(1);
+    }
+
+    int64_t count = 0;
+    long length;
+    while ((length = syscall(SYS_getdents64, fd, entries, GETDENTS_BUF_SIZE)) > 0) {
+        for (long offset = 0; offset < length; ) {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(entries + offset);
+            offset += entry->d_reclen;
+            struct stat st;
+            int haveStat, isLink;
+            int type = EntryType(fd, entry->d_name, entry->d_type, &st, &haveStat, &isLink);
+            if (type == DT_REG && !IsExcluded(dirRel, entry->d_name, 0)) count++;
+        }
+    }
+    free(entries);
+    close(fd);
+    return count;
+}
+
+// ====================================================================
+// --- File Index ---
+// ====================================================================
+
+// Returns non-zero if both lists hold the same strings in the same order
+static int SameStringList(const StringList* a, const StringList* b) {
+    if (a->count != b->count) return 0;
+    for (int i = 0; i < a->count; i++) {
+        if (strcmp(a->items[i], b->items[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+// Returns non-zero if the list contains the given string
+static int StringListContains(const StringList* list, const char* str) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->items[i], str) == 0) return 1;
+    }
+    return 0;
+}
+
+// Returns non-zero if the watcher thread is watching the given directory
+static int IsWatchedRoot(const char* dir) {
+    if (!atomic_load(&g_WatcherReady)) return 0;
+    return StringListContains(&g_WatchedRoots, dir);
+}
+
+// Returns non-zero if 'path' is the directory 'dir' or lies below it
+static int IsPathAtOrUnder(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    if (len == 1 && dir[0] == '/') return path[0] == '/'; // Everything is under "/"
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Splits "/a/b/name" into the directory "/a/b" (copied into 'dirPath')
+// and the leaf name, which is returned. Returns NULL for paths without a '/'.
+static const char* SplitPath(const char* path, char* dirPath, size_t size) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL || (size_t)(slash - path) >= size) return NULL;
+    memcpy(dirPath, path, slash - path);
+    dirPath[slash - path] = '\0';
+    return slash + 1;
+}
+
+// 64-bit FNV-1a hash of a string, so tables beyond 2^32 buckets still spread
+static uint64_t HashString(const char* str) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hash of a (directory, name) key: the id mixed into the name's hash
+static uint64_t HashNameKey(int dir, const char* name) {
+    return HashString(name) ^ ((uint64_t)(uint32_t)dir * 0x9E3779B97F4A7C15ull);
+}
+
+// Hash of whatever key sits in a given slot of one of the store's arrays
+typedef uint64_t (*SlotHashFn)(const FileIndex* index, int64_t slot);
+
+static uint64_t DirSlotHash(const FileIndex* index, int64_t slot) {
+    return HashNameKey(index->store.dirs[slot].parent, StoreDirName(&index->store, (int)slot));
+}
+
+static uint64_t FileSlotHash(const FileIndex* index, int64_t slot) {
+    return HashNameKey(index->store.files[slot].dir, StoreFileName(&index->store, slot));
+}
+
+// Allocates an empty table with room for at least 'minCount' entries
+static void PathTableReset(PathTable* table, int64_t minCount) {
+    int64_t capacity = 16;
+    // Keep the load factor below 3/4 so probe runs stay short
+    while (capacity / 4 * 3 < minCount) capacity *= 2;
+
+    ReleaseMemory(table->slots);
+    table->slots = (int64_t*)malloc(capacity * sizeof(int64_t));
+    if (table->slots == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in PathTableReset.\n");
+        exit(1);
+    }
+    table->capacity = capacity;
+    for (int64_t b = 0; b < capacity; b++) table->slots[b] = -1;
+}
+
+// Puts a slot into the first free bucket of its probe run. The key must
+// not be in the table yet.
+static void PathTableInsert(PathTable* table, uint64_t hash, int64_t slot) {
+    int64_t mask = table->capacity - 1;
+    int64_t b = (int64_t)(hash & (uint64_t)mask);
+    while (table->slots[b] != -1) b = (b + 1) & mask;
+    table->slots[b] = slot;
+}
+
+// Rebuilds a table for 'count' slots if one more entry would overload it
+static void PathTableReserve(PathTable* table, int64_t count, const FileIndex* index, SlotHashFn hashOf) {
+    if (table->capacity > 0 && table->capacity / 4 * 3 > count) return;
+    PathTableReset(table, count + 1);
+    for (int64_t i = 0; i < count; i++) {
+        PathTableInsert(table, hashOf(index, i), i);
+    }
+}
+
+// Empties a bucket, shifting later entries of the same probe run back
+// so lookups never need tombstones
+static void PathTableErase(PathTable* table, int64_t b, const FileIndex* index, SlotHashFn hashOf) {
+    int64_t mask = table->capacity - 1;
+    int64_t* slots = table->slots;
+    slots[b] = -1;
+    int64_t next = (b + 1) & mask;
+    while (slots[next] != -1) {
+        int64_t home = (int64_t)(hashOf(index, slots[next]) & (uint64_t)mask);
+        // Move the entry into the hole if the hole lies on its probe path
+        if (((next - home) & mask) >= ((next - b) & mask)) {
+            slots[b] = slots[next];
+            slots[next] = -1;
+            b = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+// Finds the bucket holding directory (parent, name), or the empty bucket where it would go
+static int64_t DirTableProbe(const FileIndex* index, int parent, const char* name) {
+    int64_t mask = index->dirTable.capacity - 1;
+    int64_t b = (int64_t)(HashNameKey(parent, name) & (uint64_t)mask);
+    while (index->dirTable.slots[b] != -1) {
+        int dir = (int)index->dirTable.slots[b];
+        if (index->store.dirs[dir].parent == parent && strcmp(StoreDirName(&index->store, dir), name) == 0) break;
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+// Finds the bucket holding file (dir, name), or the empty bucket where it would go
+static int64_t FileTableProbe(const FileIndex* index, int dir, const char* name) {
+    int64_t mask = index->table.capacity - 1;
+    int64_t b = (int64_t)(HashNameKey(dir, name) & (uint64_t)mask);
+    while (index->table.slots[b] != -1) {
+        int64_t slot = index->table.slots[b];
+        if (index->store.files[slot].dir == dir && strcmp(StoreFileName(&index->store, slot), name) == 0) break;
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+// Makes room in the per-directory lists for every file and directory the
+// store can hold. New entries start out unlinked.
+static void IndexReserveLinks(FileIndex* index) {
+    const PathStore* store = &index->store;
+    if (store->fileCapacity > index->fileLinkCapacity) {
+        int64_t capacity = store->fileCapacity;
+        int64_t* next = (int64_t*)realloc(index->nextFile, capacity * sizeof(int64_t));
+        int64_t* prev = next ? (int64_t*)realloc(index->prevFile, capacity * sizeof(int64_t)) : NULL;
+        if (next == NULL || prev == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in IndexReserveLinks.\n");
+            exit(1);
+        }
+        index->nextFile = next;
+        index->prevFile = prev;
+        index->fileLinkCapacity = capacity;
+    }
+    if (store->dirCapacity > index->dirLinkCapacity) {
+        int capacity = store->dirCapacity;
+        int64_t* first = (int64_t*)realloc(index->firstFile, capacity * sizeof(int64_t));
+        int* child = first ? (int*)realloc(index->firstChild, capacity * sizeof(int)) : NULL;
+        int* next = child ? (int*)realloc(index->nextSibling, capacity * sizeof(int)) : NULL;
+        int* prev = next ? (int*)realloc(index->prevSibling, capacity * sizeof(int)) : NULL;
+        if (first == NULL || child == NULL || next == NULL || prev == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in IndexReserveLinks.\n");
+            exit(1);
+        }
+        for (int d = index->dirLinkCapacity; d < capacity; d++) {
+            first[d] = -1;
+            child[d] = next[d] = prev[d] = -1;
+        }
+        index->firstFile = first;
+        index->firstChild = child;
+        index->nextSibling = next;
+        index->prevSibling = prev;
+        index->dirLinkCapacity = capacity;
+    }
+}
+
+// Puts the file in 'slot' at the head of its directory's list
+static void IndexLinkFile(FileIndex* index, int64_t slot) {
+    if (index->firstFile == NULL) return;
+    IndexReserveLinks(index);
+    int dir = index->store.files[slot].dir;
+    index->prevFile[slot] = -1;
+    index->nextFile[slot] = index->firstFile[dir];
+    if (index->firstFile[dir] != -1) index->prevFile[index->firstFile[dir]] = slot;
+    index->firstFile[dir] = slot;
+}
+
+// Takes the file in 'slot' out of its directory's list
+static void IndexUnlinkFile(FileIndex* index, int64_t slot) {
+    if (index->firstFile == NULL) return;
+    int64_t prev = index->prevFile[slot], next = index->nextFile[slot];
+    if (prev != -1) index->nextFile[prev] = next;
+    else index->firstFile[index->store.files[slot].dir] = next;
+    if (next != -1) index->prevFile[next] = prev;
+}
+
+// Puts directory 'dir' at the head of its parent's list of subdirectories
+static void IndexLinkDir(FileIndex* index, int dir) {
+    if (index->firstFile == NULL) return;
+    IndexReserveLinks(index);
+    int parent = index->store.dirs[dir].parent;
+    index->prevSibling[dir] = index->nextSibling[dir] = -1;
+    if (parent < 0) return;
+    index->nextSibling[dir] = index->firstChild[parent];
+    if (index->firstChild[parent] != -1) index->prevSibling[index->firstChild[parent]] = dir;
+    index->firstChild[parent] = dir;
+}
+
+// Takes directory 'dir' out of its parent's list of subdirectories
+static void IndexUnlinkDir(FileIndex* index, int dir) {
+    if (index->firstFile == NULL) return;
+    int parent = index->store.dirs[dir].parent;
+    if (parent < 0) return;
+    int prev = index->prevSibling[dir], next = index->nextSibling[dir];
+    if (prev != -1) index->nextSibling[prev] = next;
+    else index->firstChild[parent] = next;
+    if (next != -1) index->prevSibling[next] = prev;
+    index->prevSibling[dir] = index->nextSibling[dir] = -1;
+}
+
+// Builds the per-directory lists from scratch, in O(directories + files)
+static void IndexBuildLinks(FileIndex* index) {
+    const PathStore* store = &index->store;
+    index->firstFile = (int64_t*)malloc(sizeof(int64_t)); // Marks the lists as kept from here on
+    if (index->firstFile == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in IndexBuildLinks.\n");
+        exit(1);
+    }
+    IndexReserveLinks(index);
+    // Backwards, so every list ends up in store order
+    for (int d = store->dirCount - 1; d >= 0; d--) {
+        if (store->dirs[d].parent != DIR_DETACHED) IndexLinkDir(index, d);
+    }
+    for (int64_t i = store->fileCount - 1; i >= 0; i--) {
+        IndexLinkFile(index, i);
+    }
+}
+
+// Releases the per-directory lists
+static void IndexFreeLinks(FileIndex* index) {
+    free(index->nextFile);
+    free(index->prevFile);
+    free(index->firstFile);
+    free(index->firstChild);
+    free(index->nextSibling);
+    free(index->prevSibling);
+    index->nextFile = index->prevFile = index->firstFile = NULL;
+    index->firstChild = index->nextSibling = index->prevSibling = NULL;
+    index->fileLinkCapacity = 0;
+    index->dirLinkCapacity = 0;
+}
+
+// Returns the id of directory (parent, name), or -1 if the index has none
+static int IndexFindChildDir(const FileIndex* index, int parent, const char* name) {
+    if (index->dirTable.capacity == 0) return -1;
+    return (int)index->dirTable.slots[DirTableProbe(index, parent, name)];
+}
+
+// Returns the id of directory (parent, name), adding it if necessary
+static int IndexAddChildDir(FileIndex* index, int parent, const char* name) {
+    int dir = IndexFindChildDir(index, parent, name);
+    if (dir != -1) return dir;
+    PathTableReserve(&index->dirTable, index->store.dirCount, index, DirSlotHash);
+    dir = StoreAddDir(&index->store, parent, name);
+    PathTableInsert(&index->dirTable, DirSlotHash(index, dir), dir);
+    IndexLinkDir(index, dir);
+    if (index->treeMode) {
+        TreeReserve(index);
+        TreeAttach(index, dir);
+    }
+    return dir;
+}
+
+// Returns the saved directory 'path' belongs to (the longest one that
+// contains it), or NULL if it lies outside all of them
+static const char* IndexRootOf(const FileIndex* index, const char* path) {
+    const char* best = NULL;
+    for (int i = 0; i < index->roots.count; i++) {
+        const char* root = index->roots.items[i];
+        if (IsPathAtOrUnder(path, root) && (best == NULL || strlen(root) > strlen(best))) {
+            best = root;
+        }
+    }
+    return best;
+}
+
+// Walks 'path' down from its root one component at a time. Missing
+// directories are created if 'create' is set; otherwise -1 is returned.
+static int IndexWalkDirPath(FileIndex* index, const char* path, int create) {
+    const char* root = IndexRootOf(index, path);
+    if (root == NULL) return -1;
+    int dir = create ? IndexAddChildDir(index, DIR_ROOT, root) : IndexFindChildDir(index, DIR_ROOT, root);
+
+    const char* rest = path + strlen(root);
+    while (dir != -1 && *rest != '\0') {
+        while (*rest == '/') rest++;
+        if (*rest == '\0') break;
+        const char* end = strchr(rest, '/');
+        size_t len = end ? (size_t)(end - rest) : strlen(rest);
+        char name[NAME_MAX + 1];
+        if (len > NAME_MAX) return -1;
+        memcpy(name, rest, len);
+        name[len] = '\0';
+        dir = create ? IndexAddChildDir(index, dir, name) : IndexFindChildDir(index, dir, name);
+        rest += len;
+    }
+    return dir;
+}
+
+// Returns the id of the directory at 'path', or -1 if the index has none
+static int IndexLookupDir(const FileIndex* index, const char* path) {
+    return IndexWalkDirPath((FileIndex*)index, path, 0);
+}
+
+// Adds the file (dir, name) in O(1). If it is already indexed, only its
+// size and modification time are updated.
+static void IndexAddEntry(FileIndex* index, int dir, const char* name, int64_t size, int64_t mtime) {
+    index->generation++;
+    if (index->table.capacity > 0) {
+        int64_t existing = index->table.slots[FileTableProbe(index, dir, name)];
+        if (existing != -1) {
+            index->store.sizes[existing] = size;
+            index->store.mtimes[existing] = mtime;
+            return;
+        }
+    }
+    PathTableReserve(&index->table, index->store.fileCount, index, FileSlotHash);
+    int64_t slot = StoreAddFile(&index->store, dir, name, size, mtime);
+    PathTableInsert(&index->table, FileSlotHash(index, slot), slot);
+    IndexLinkFile(index, slot);
+}
+
+// Removes the file in 'slot' in O(1) by moving the last entry into it.
+// Its name stays in the arena until the next rebuild.
+static void IndexRemoveSlot(FileIndex* index, int64_t slot) {
+    PathStore* store = &index->store;
+    PathTableErase(&index->table, FileTableProbe(index, store->files[slot].dir, StoreFileName(store, slot)),
+                   index, FileSlotHash);
+
+    IndexUnlinkFile(index, slot);
+
+    int64_t last = store->fileCount - 1;
+    if (slot != last) {
+        // Point the moved entry's bucket and its list neighbours at its new slot
+        index->table.slots[FileTableProbe(index, store->files[last].dir, StoreFileName(store, last))] = slot;
+        if (index->firstFile != NULL) {
+            int64_t prev = index->prevFile[last], next = index->nextFile[last];
+            if (prev != -1) index->nextFile[prev] = slot;
+            else index->firstFile[store->files[last].dir] = slot;
+            if (next != -1) index->prevFile[next] = slot;
+            index->prevFile[slot] = prev;
+            index->nextFile[slot] = next;
+        }
+        store->files[slot] = store->files[last];
+        store->sizes[slot] = store->sizes[last];
+        store->mtimes[slot] = store->mtimes[last];
+        store->exts[slot] = store->exts[last];
+    }
+    store->fileCount--;
+    index->generation++;
+}
+
+// Returns the slot of the file at 'path', or -1 if it is not indexed
+static int64_t IndexFindFile(const FileIndex* index, const char* path) {
+    char dirPath[PATH_MAX];
+    const char* name = SplitPath(path, dirPath, sizeof(dirPath));
+    if (name == NULL || index->table.capacity == 0) return -1;
+    int dir = IndexLookupDir(index, dirPath);
+    if (dir == -1) return -1;
+    return index->table.slots[FileTableProbe(index, dir, name)];
+}
+
+// Takes a directory out of the lookup table so its name can be reused
+static void IndexDetachDir(FileIndex* index, int dir) {
+    if (index->treeMode) TreeDetach(index, dir);
+    IndexUnlinkDir(index, dir);
+    PathTableErase(&index->dirTable, DirTableProbe(index, index->store.dirs[dir].parent, StoreDirName(&index->store, dir)),
+                   index, DirSlotHash);
+    index->store.dirs[dir].parent = DIR_DETACHED;
+}
+
+// Writes the full path of the file in 'slot' into 'buffer'
+void IndexPathOf(const FileIndex* index, int64_t slot, char* buffer, size_t size) {
+    if (StorePathOf(&index->store, slot, buffer, size) < 0 && size > 0) buffer[0] = '\0';
+}
+
+// Decides whether the index has to be rebuilt for the next pick.
+// Watched roots are kept current by the watcher thread; roots nobody
+// watches are rescanned on every pick, as before (in the background, see
+// "Background Scan").
+int IndexIsStale(const FileIndex* index, const StringList* dirs) {
+    if (!index->built) return 1;
+    if (!SameStringList(&index->roots, dirs)) return 1;
+    // A watcher still placing its watches catches up with a snapshot once
+    // they are in place (IndexRevalidate); no need to read it all again
+    if (!atomic_load(&g_WatcherSettled)) return 0;
+    for (int i = 0; i < dirs->count; i++) {
+        if (!IsWatchedRoot(dirs->items[i])) return 1;
+    }
+    return 0;
+}
+
+// (Re)builds the index by scanning every directory in 'dirs'.
+// The caller must hold g_IndexLock.
+void BuildFileIndex(FileIndex* index, const StringList* dirs) {
+    FreeFileIndex(index); // Before the scan, so old and new never coexist
+    IndexAdoptStore(index, dirs, GetAllFiles(dirs));
+}
+
+// Makes 'store', the result of scanning 'dirs', the content of the index.
+// The caller must hold g_IndexLock.
+void IndexAdoptStore(FileIndex* index, const StringList* dirs, PathStore store) {
+    FreeFileIndex(index);
+    for (int i = 0; i < dirs->count; i++) {
+        AddStringToList(&index->roots, dirs->items[i]);
+    }
+    // Adopt the scanned store as it is; only the hash tables are new
+    index->treeMode = g_TreeSampler;
+    index->store = store;
+    PathTableReserve(&index->dirTable, index->store.dirCount, index, DirSlotHash);
+    PathTableReserve(&index->table, index->store.fileCount, index, FileSlotHash);
+    if (index->treeMode) TreeBuild(index);
+    index->built = 1;
+}
+
+// Adds a single file to the index in O(1), or refreshes its attributes
+// if it is already there. 'st' may be NULL if the file could not be stat()ed.
+void IndexAddFile(FileIndex* index, const char* path, const struct stat* st) {
+    char dirPath[PATH_MAX];
+    const char* name = SplitPath(path, dirPath, sizeof(dirPath));
+    if (name == NULL) return;
+    if (index->treeMode) {
+        IndexRecountDir(index, dirPath); // The name may have been counted already
+        return;
+    }
+    int dir = IndexWalkDirPath(index, dirPath, 1);
+    if (dir != -1) {
+        IndexAddEntry(index, dir, name, st ? (int64_t)st->st_size : 0, st ? (int64_t)st->st_mtime : 0);
+    }
+}
+
+// Removes a single file from the index in O(1). Does nothing if the file
+// is not indexed.
+void IndexRemoveFile(FileIndex* index, const char* path) {
+    if (index->treeMode) {
+        // Whatever went may not have been a regular file
+        char dirPath[PATH_MAX];
+        if (SplitPath(path, dirPath, sizeof(dirPath)) != NULL) IndexRecountDir(index, dirPath);
+        return;
+    }
+    int64_t slot = IndexFindFile(index, path);
+    if (slot != -1) IndexRemoveSlot(index, slot);
+}
+
+// Renames a single file, keeping its attributes
+void IndexRenameFile(FileIndex* index, const char* oldPath, const char* newPath) {
+    if (index->treeMode) {
+        // Both directories are counted again: the move may have replaced a file
+        IndexRemoveFile(index, oldPath);
+        IndexAddFile(index, newPath, NULL);
+        return;
+    }
+    int64_t slot = IndexFindFile(index, oldPath);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (slot != -1) {
+        st.st_size = (off_t)index->store.sizes[slot];
+        st.st_mtime = (time_t)index->store.mtimes[slot];
+        IndexRemoveSlot(index, slot);
+    }
+    IndexAddFile(index, newPath, &st);
+}
+
+// Tree sampler: makes 'count' the number of files directly inside
+// 'dirPath'. The counts keep no names, so an event alone can't say whether
+// the file it names was counted: a move may replace one, a deleted entry
+// may have been a FIFO or a symlink, a held event may repeat what the
+// scan saw. Taking the directory's count from the disk is always right.
+void IndexSetDirFiles(FileIndex* index, const char* dirPath, int64_t count) {
+    int dir = IndexWalkDirPath(index, dirPath, count > 0);
+    if (dir != -1) TreeAddFiles(index, dir, count - (int64_t)index->store.dirs[dir].files);
+}
+
+// Tree sampler: counts the files in 'dirPath' again (see IndexSetDirFiles).
+// Reads the directory, as a pick does.
+void IndexRecountDir(FileIndex* index, const char* dirPath) {
+    const char* root = IndexRootOf(index, dirPath);
+    int64_t count = TreeCountFiles(dirPath, (root != NULL) ? strlen(root) : strlen(dirPath));
+    IndexSetDirFiles(index, dirPath, (count > 0) ? count : 0);
+}
+
+// Removes every file at or below the directory with id 'target'
+static void IndexRemoveTreeAt(FileIndex* index, int target) {
+    if (index->treeMode) {
+        TreeClear(index, target);
+        return;
+    }
+    if (index->firstFile == NULL) IndexBuildLinks(index);
+    // Visit the subtree in preorder along the child lists, climbing back
+    // up through the parents, and empty each directory's file list
+    int dir = target;
+    while (dir != -1) {
+        while (index->firstFile[dir] != -1) IndexRemoveSlot(index, index->firstFile[dir]);
+        if (index->firstChild[dir] != -1) {
+            dir = index->firstChild[dir];
+            continue;
+        }
+        while (dir != target && index->nextSibling[dir] == -1) dir = index->store.dirs[dir].parent;
+        dir = (dir == target) ? -1 : index->nextSibling[dir];
+    }
+}
+
+// Removes every file at or below the directory 'dirPath'
+void IndexRemoveTree(FileIndex* index, const char* dirPath) {
+    int target = IndexLookupDir(index, dirPath);
+    if (target != -1) IndexRemoveTreeAt(index, target);
+}
+
+// Moves the directory 'oldDir' to 'newDir'. Only its own node changes:
+// everything below it refers to it by id and follows along.
+void IndexRenameTree(FileIndex* index, const char* oldDir, const char* newDir) {
+    // Whatever the move replaced is gone now
+    IndexRemoveTree(index, newDir);
+    int clash = IndexLookupDir(index, newDir);
+    if (clash != -1) IndexDetachDir(index, clash);
+
+    int dir = IndexLookupDir(index, oldDir);
+    char parentPath[PATH_MAX];
+    const char* name = SplitPath(newDir, parentPath, sizeof(parentPath));
+    int parent = (name != NULL) ? IndexWalkDirPath(index, parentPath, 1) : -1;
+    if (dir == -1 || parent == -1) {
+        // We never knew it, or it left the saved directories
+        if (dir != -1) IndexRemoveTree(index, oldDir);
+        return;
+    }
+
+    IndexDetachDir(index, dir);
+    index->store.dirs[dir].parent = parent;
+    index->store.dirs[dir].name = ArenaAddName(&index->store.names, name);
+    PathTableReserve(&index->dirTable, index->store.dirCount, index, DirSlotHash);
+    PathTableInsert(&index->dirTable, DirSlotHash(index, dir), dir);
+    IndexLinkDir(index, dir);
+    if (index->treeMode) TreeAttach(index, dir);
+}
+
+// Merges the result of scanning a subtree into the index
+void IndexAddScan(FileIndex* index, const PathStore* result) {
+    int* ids = (int*)malloc((result->dirCount + 1) * sizeof(int));
+    if (ids == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in IndexAddScan.\n");
+        exit(1);
+    }
+    // Parents are always recorded before their children
+    for (int d = 0; d < result->dirCount; d++) {
+        const char* name = StoreDirName(result, d);
+        int parent = result->dirs[d].parent;
+        ids[d] = (parent == DIR_ROOT) ? IndexWalkDirPath(index, name, 1)
+               : (ids[parent] == -1) ? -1 : IndexAddChildDir(index, ids[parent], name);
+        if (ids[d] != -1) {
+            index->store.dirs[ids[d]].mtime = result->dirs[d].mtime;
+            index->store.dirs[ids[d]].ino = result->dirs[d].ino;
+        }
+        // The tree sampler takes the scanned count as the new one
+        if (ids[d] != -1 && index->treeMode) {
+            TreeAddFiles(index, ids[d], (int64_t)result->dirs[d].files - index->store.dirs[ids[d]].files);
+        }
+    }
+    for (int64_t i = 0; i < result->fileCount; i++) {
+        int dir = ids[result->files[i].dir];
+        if (dir != -1) IndexAddEntry(index, dir, StoreFileName(result, i), result->sizes[i], result->mtimes[i]);
+    }
+    free(ids);
+}
+
+// Releases everything held by the index
+void FreeFileIndex(FileIndex* index) {
+    index->generation++;
+    FreeStringList(&index->roots);
+    FreePathStore(&index->store);
+    ReleaseMemory(index->dirTable.slots);
+    index->dirTable.slots = NULL;
+    index->dirTable.capacity = 0;
+    ReleaseMemory(index->table.slots);
+    index->table.slots = NULL;
+    index->table.capacity = 0;
+    index->built = 0;
+    index->unverified = 0;
+    IndexFreeLinks(index);
+
+    for (int d = -1; d < index->treeCapacity && index->treeMode; d++) {
+        TreeNode* node = TreeNodeOf(index, d);
+        free(node->kids);
+        free(node->fenwick);
+    }
+    free(index->tree);
+    index->tree = NULL;
+    index->treeCapacity = 0;
+    memset(&index->treeTop, 0, sizeof(index->treeTop));
+    index->treeMode = 0;
+
+    // Nothing points into the snapshot any more
+    if (index->map != NULL) {
+        munmap(index->map, index->mapSize);
+        if (g_SnapshotMap == index->map) {
+            g_SnapshotMap = NULL;
+            g_SnapshotSize = 0;
+        }
+        index->map = NULL;
+        index->mapSize = 0;
+    }
+}
+
+// ====================================================================
+// --- Index Snapshot ---
+// ====================================================================
+
+// The snapshot is the index's own arrays written out verbatim, so loading
+// it is a single mmap() with no parsing: the directory tree, the file
+// entries and both hash tables are used in place, and the arena blocks
+// are pointed at the mapped names. The mapping is private, so later
+// updates copy pages on write and never touch the file.
+
+#define SNAPSHOT_MAGIC "RFDINDEX"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_ALIGN 64
+
+// Fixed header at the start of the file. Offsets count from the start of
+// the file, and every array section starts on a SNAPSHOT_ALIGN boundary.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dirNodeSize;       // sizeof(DirNode) of the writer
+    uint32_t fileEntrySize;     // sizeof(FileEntry) of the writer
+    uint32_t rootCount;
+    uint64_t dirCount;
+    uint64_t fileCount;
+    uint64_t blockCount;
+    uint64_t dirTableCapacity;
+    uint64_t fileTableCapacity;
+    uint64_t rootsOffset;       // rootCount NUL-terminated strings
+    uint64_t dirsOffset;        // DirNode[dirCount]
+    uint64_t filesOffset;       // FileEntry[fileCount]
+    uint64_t blocksOffset;      // SnapshotBlock[blockCount], then the names
+    uint64_t dirTableOffset;    // int64_t[dirTableCapacity]
+    uint64_t fileTableOffset;   // int64_t[fileTableCapacity]
+    uint64_t extCount;
+    uint64_t extOffset;         // extCount NUL-terminated extensions, in id order
+    uint64_t sizesOffset;       // int64_t[fileCount]
+    uint64_t mtimesOffset;      // int64_t[fileCount]
+    uint64_t extIdsOffset;      // uint32_t[fileCount]
+    uint64_t excludeHash;       // Of the exclude rules the index was built with
+    uint64_t scanFlags;         // SnapshotScanFlags() of the writer
+    uint64_t totalSize;
+} SnapshotHeader;
+
+// Where the names of one arena block were written
+typedef struct {
+    uint64_t offset;
+    uint64_t used;
+} SnapshotBlock;
+
+// Options that change which files a scan finds, so an index built
+// without them is not reused with them and vice versa
+static uint64_t SnapshotScanFlags(void) {
+    return (uint64_t)(g_FollowSymlinks ? 1 : 0) | (uint64_t)(g_DedupeHardlinks ? 2 : 0);
+}
+
+// Writes 'size' bytes and advances the running file position
+static int SnapshotWrite(FILE* fp, const void* data, size_t size, uint64_t* pos) {
+    if (size > 0 && fwrite(data, 1, size, fp) != size) return 0;
+    *pos += size;
+    return 1;
+}
+
+// Pads the file with zeros up to the next SNAPSHOT_ALIGN boundary
+static int SnapshotAlign(FILE* fp, uint64_t* pos) {
+    static const char zeros[SNAPSHOT_ALIGN] = {0};
+    size_t pad = (size_t)((SNAPSHOT_ALIGN - (*pos % SNAPSHOT_ALIGN)) % SNAPSHOT_ALIGN);
+    return SnapshotWrite(fp, zeros, pad, pos);
+}
+
+// Writes the index to 'path'. The file is written under a temporary name
+// and renamed into place, so readers never see a half-written snapshot.
+// The caller must hold g_IndexLock.
+int IndexSaveSnapshot(const FileIndex* index, const char* path) {
+    // The tree sampler keeps no files to save
+    if (!index->built || index->treeMode) return 0;
+
+    char tmpPath[PATH_MAX];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) return 0;
+
+    const PathStore* store = &index->store;
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.excludeHash = g_Excludes.hash;
+    header.scanFlags = SnapshotScanFlags();
+    header.dirNodeSize = sizeof(DirNode);
+    header.fileEntrySize = sizeof(FileEntry);
+    header.rootCount = (uint32_t)index->roots.count;
+    header.dirCount = (uint64_t)store->dirCount;
+    header.fileCount = (uint64_t)store->fileCount;
+    header.blockCount = (uint64_t)store->names.count;
+    header.dirTableCapacity = (uint64_t)index->dirTable.capacity;
+    header.fileTableCapacity = (uint64_t)index->table.capacity;
+
+    // The real header is written last, once every offset is known
+    uint64_t pos = 0;
+    int ok = SnapshotWrite(fp, &header, sizeof(header), &pos) && SnapshotAlign(fp, &pos);
+
+    header.rootsOffset = pos;
+    for (int i = 0; ok && i < index->roots.count; i++) {
+        ok = SnapshotWrite(fp, index->roots.items[i], strlen(index->roots.items[i]) + 1, &pos);
+    }
+    ok = ok && SnapshotAlign(fp, &pos);
+
+    // Extension ids are only meaningful together with the list they index
+    pthread_mutex_lock(&g_ExtensionLock);
+    header.extCount = (uint64_t)g_Extensions.count;
+    header.extOffset = pos;
+    for (int64_t i = 0; ok && i < g_Extensions.count; i++) {
+        ok = SnapshotWrite(fp, g_Extensions.items[i], strlen(g_Extensions.items[i]) + 1, &pos);
+    }
+    pthread_mutex_unlock(&g_ExtensionLock);
+    ok = ok && SnapshotAlign(fp, &pos);
+
+    header.dirsOffset = pos;
+    ok = ok && SnapshotWrite(fp, store->dirs, store->dirCount * sizeof(DirNode), &pos) && SnapshotAlign(fp, &pos);
+    header.filesOffset = pos;
+    ok = ok && SnapshotWrite(fp, store->files, store->fileCount * sizeof(FileEntry), &pos) && SnapshotAlign(fp, &pos);
+    header.sizesOffset = pos;
+    ok = ok && SnapshotWrite(fp, store->sizes, store->fileCount * sizeof(int64_t), &pos) && SnapshotAlign(fp, &pos);
+    header.mtimesOffset = pos;
+    ok = ok && SnapshotWrite(fp, store->mtimes, store->fileCount * sizeof(int64_t), &pos) && SnapshotAlign(fp, &pos);
+    header.extIdsOffset = pos;
+    ok = ok && SnapshotWrite(fp, store->exts, store->fileCount * sizeof(uint32_t), &pos) && SnapshotAlign(fp, &pos);
+
+    // Blocks come from several arenas (scan workers, earlier snapshots), so
+    // their sizes vary; write each one up to the end of its last name.
+    uint64_t* used = (uint64_t*)calloc(store->names.count + 1, sizeof(uint64_t));
+    if (used == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in IndexSaveSnapshot.\n");
+        exit(1);
+    }
+    for (int64_t i = 0; i < store->dirCount + store->fileCount; i++) {
+        NameRef ref = (i < store->dirCount) ? store->dirs[i].name : store->files[i - store->dirCount].name;
+        int block = (int)(ref >> ARENA_BLOCK_BITS);
+        uint64_t end = (ref & (ARENA_MAX_BLOCK_SIZE - 1)) + strlen(ArenaName(&store->names, ref)) + 1;
+        if (end > used[block]) used[block] = end;
+    }
+
+    // Block table first, then each block's names back to back
+    header.blocksOffset = pos;
+    uint64_t nameOffset = pos + store->names.count * sizeof(SnapshotBlock);
+    for (int i = 0; ok && i < store->names.count; i++) {
+        SnapshotBlock block;
+        block.offset = nameOffset;
+        block.used = used[i];
+        nameOffset += used[i];
+        ok = SnapshotWrite(fp, &block, sizeof(block), &pos);
+    }
+    for (int i = 0; ok && i < store->names.count; i++) {
+        ok = SnapshotWrite(fp, store->names.blocks[i], used[i], &pos);
+    }
+    free(used);
+    ok = ok && SnapshotAlign(fp, &pos);
+
+    header.dirTableOffset = pos;
+    ok = ok && SnapshotWrite(fp, index->dirTable.slots, index->dirTable.capacity * sizeof(int64_t), &pos) && SnapshotAlign(fp, &pos);
+    header.fileTableOffset = pos;
+    ok = ok && SnapshotWrite(fp, index->table.slots, index->table.capacity * sizeof(int64_t), &pos);
+    header.totalSize = pos;
+
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns non-zero if [offset, offset + size) lies inside a file of 'total' bytes
+static int SnapshotRangeOk(uint64_t offset, uint64_t size, uint64_t total) {
+    return offset <= total && size <= total - offset;
+}
+
+// Returns non-zero if 'ref' names a string inside one of the snapshot's
+// blocks. Every block ends with a NUL (checked once by the caller), so a
+// name starting inside one also ends inside it.
+static int SnapshotNameOk(const SnapshotHeader* h, const SnapshotBlock* blocks, NameRef ref) {
+    uint64_t block = ref >> ARENA_BLOCK_BITS;
+    return block < h->blockCount && (ref & (ARENA_MAX_BLOCK_SIZE - 1)) < blocks[block].used;
+}
+
+// Checks every reference inside a mapped snapshot whose header ranges are
+// already known to be good: names, parents, directories, extension ids
+// and hash table slots. A damaged or hostile file then costs a rescan
+// instead of reads outside the mapping later on.
+static int SnapshotContentOk(const SnapshotHeader* h, const char* base) {
+    uint64_t offsets = h->dirsOffset | h->filesOffset | h->blocksOffset | h->dirTableOffset |
+                       h->fileTableOffset | h->sizesOffset | h->mtimesOffset | h->extIdsOffset;
+    if (offsets % sizeof(int64_t) != 0) return 0;
+    const SnapshotBlock* blocks = (const SnapshotBlock*)(base + h->blocksOffset);
+    for (uint64_t i = 0; i < h->blockCount; i++) {
+        if (blocks[i].used > 0 && base[blocks[i].offset + blocks[i].used - 1] != '\0') return 0;
+    }
+    const DirNode* dirs = (const DirNode*)(base + h->dirsOffset);
+    for (uint64_t d = 0; d < h->dirCount; d++) {
+        int parent = dirs[d].parent;
+        if (parent != DIR_ROOT && parent != DIR_DETACHED && (parent < 0 || (uint64_t)parent >= h->dirCount)) return 0;
+        if (!SnapshotNameOk(h, blocks, dirs[d].name)) return 0;
+    }
+    const FileEntry* files = (const FileEntry*)(base + h->filesOffset);
+    const uint32_t* exts = (const uint32_t*)(base + h->extIdsOffset);
+    for (uint64_t i = 0; i < h->fileCount; i++) {
+        if (files[i].dir < 0 || (uint64_t)files[i].dir >= h->dirCount) return 0;
+        if (exts[i] > h->extCount || !SnapshotNameOk(h, blocks, files[i].name)) return 0;
+    }
+    // Every probe must end at an empty bucket, so each table needs one
+    const int64_t* tables[2] = {(const int64_t*)(base + h->dirTableOffset), (const int64_t*)(base + h->fileTableOffset)};
+    uint64_t capacities[2] = {h->dirTableCapacity, h->fileTableCapacity};
+    uint64_t counts[2] = {h->dirCount, h->fileCount};
+    for (int t = 0; t < 2; t++) {
+        uint64_t empty = 0;
+        for (uint64_t b = 0; b < capacities[t]; b++) {
+            int64_t slot = tables[t][b];
+            if (slot == -1) empty++;
+            else if (slot < 0 || (uint64_t)slot >= counts[t]) return 0;
+        }
+        if (empty == 0) return 0;
+    }
+    return 1;
+}
+
+// Maps the snapshot at 'path' and makes it the index, provided it was
+// written for exactly the directories in 'dirs' and every reference in it
+// checks out. The arrays are used in place; the index is marked unverified
+// until IndexRevalidate() has compared it with the disk. Returns non-zero
+// on success; on failure the caller scans the directories instead.
+int IndexLoadSnapshot(FileIndex* index, const StringList* dirs, const char* path) {
+    if (g_TreeSampler) return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const char* base = (const char*)map;
+    const SnapshotHeader* h = (const SnapshotHeader*)map;
+    int ok = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 &&
+             h->version == SNAPSHOT_VERSION && h->excludeHash == g_Excludes.hash &&
+             h->scanFlags == SnapshotScanFlags() &&
+             h->dirNodeSize == sizeof(DirNode) && h->fileEntrySize == sizeof(FileEntry) &&
+             h->totalSize == size && h->rootCount == (uint32_t)dirs->count &&
+             h->dirCount <= INT_MAX && h->blockCount <= INT_MAX && h->dirTableCapacity <= INT_MAX &&
+             h->fileCount <= size / sizeof(FileEntry) && h->fileTableCapacity <= size / sizeof(int64_t) &&
+             (h->dirTableCapacity & (h->dirTableCapacity - 1)) == 0 && h->dirTableCapacity > h->dirCount &&
+             (h->fileTableCapacity & (h->fileTableCapacity - 1)) == 0 && h->fileTableCapacity > h->fileCount &&
+             SnapshotRangeOk(h->dirsOffset, h->dirCount * sizeof(DirNode), size) &&
+             SnapshotRangeOk(h->filesOffset, h->fileCount * sizeof(FileEntry), size) &&
+             SnapshotRangeOk(h->sizesOffset, h->fileCount * sizeof(int64_t), size) &&
+             SnapshotRangeOk(h->mtimesOffset, h->fileCount * sizeof(int64_t), size) &&
+             SnapshotRangeOk(h->extIdsOffset, h->fileCount * sizeof(uint32_t), size) &&
+             h->extCount < UINT32_MAX && SnapshotRangeOk(h->extOffset, h->extCount, size) &&
+             SnapshotRangeOk(h->blocksOffset, h->blockCount * sizeof(SnapshotBlock), size) &&
+             SnapshotRangeOk(h->dirTableOffset, h->dirTableCapacity * sizeof(int64_t), size) &&
+             SnapshotRangeOk(h->fileTableOffset, h->fileTableCapacity * sizeof(int64_t), size);
+
+    // It must describe the same saved directories, in the same order
+    const char* root = base + h->rootsOffset;
+    for (int i = 0; ok && i < dirs->count; i++) {
+        size_t len = strlen(dirs->items[i]) + 1;
+        ok = SnapshotRangeOk((uint64_t)(root - base), len, size) && memcmp(root, dirs->items[i], len) == 0;
+        root += len;
+    }
+    const SnapshotBlock* blocks = (const SnapshotBlock*)(base + h->blocksOffset);
+    for (uint64_t i = 0; ok && i < h->blockCount; i++) {
+        ok = SnapshotRangeOk(blocks[i].offset, blocks[i].used, size) && blocks[i].used <= ARENA_MAX_BLOCK_SIZE;
+    }
+    if (ok) ok = SnapshotContentOk(h, base);
+
+    // The saved extension ids must mean the same here. Any extension this
+    // run has already seen has to sit at the same position; the rest are
+    // added in order, so their ids come out the same too.
+    pthread_mutex_lock(&g_ExtensionLock);
+    const char* ext = base + h->extOffset;
+    for (uint64_t i = 0; ok && i < h->extCount; i++) {
+        size_t room = size - (size_t)(ext - base);
+        size_t len = strnlen(ext, room);
+        ok = len < room && len <= EXT_MAX_LEN;
+        if (ok && (int64_t)i < g_Extensions.count) ok = strcmp(g_Extensions.items[i], ext) == 0;
+        ext += len + 1;
+    }
+    if (ok) {
+        ext = base + h->extOffset;
+        for (uint64_t i = 0; i < h->extCount; i++) {
+            if ((int64_t)i >= g_Extensions.count) ExtensionLookup(ext, 1);
+            ext += strlen(ext) + 1;
+        }
+    }
+    pthread_mutex_unlock(&g_ExtensionLock);
+    if (!ok) {
+        munmap(map, size);
+        return 0;
+    }
+
+    FreeFileIndex(index);
+    g_SnapshotMap = map;
+    g_SnapshotSize = size;
+    index->map = map;
+    index->mapSize = size;
+    for (int i = 0; i < dirs->count; i++) {
+        AddStringToList(&index->roots, dirs->items[i]);
+    }
+
+    PathStore* store = &index->store;
+    store->dirs = (DirNode*)(base + h->dirsOffset);
+    store->dirCount = store->dirCapacity = (int)h->dirCount;
+    store->files = (FileEntry*)(base + h->filesOffset);
+    store->fileCount = store->fileCapacity = (int64_t)h->fileCount;
+    store->sizes = (int64_t*)(base + h->sizesOffset);
+    store->mtimes = (int64_t*)(base + h->mtimesOffset);
+    store->exts = (uint32_t*)(base + h->extIdsOffset);
+
+    // The only per-block work: point the arena at the mapped names. New
+    // names go to a fresh heap block, never into the mapping.
+    if (h->blockCount > 0) {
+        store->names.blocks = (char**)malloc(h->blockCount * sizeof(char*));
+        if (store->names.blocks == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in IndexLoadSnapshot.\n");
+            exit(1);
+        }
+        for (uint64_t i = 0; i < h->blockCount; i++) {
+            store->names.blocks[i] = (char*)base + blocks[i].offset;
+        }
+    }
+    store->names.count = store->names.capacity = (int)h->blockCount;
+    store->names.used = store->names.size = 0;
+
+    index->dirTable.slots = (int64_t*)(base + h->dirTableOffset);
+    index->dirTable.capacity = (int64_t)h->dirTableCapacity;
+    index->table.slots = (int64_t*)(base + h->fileTableOffset);
+    index->table.capacity = (int64_t)h->fileTableCapacity;
+    index->built = 1;
+    index->unverified = 1;
+    return 1;
+}
+
+// Brings g_Index, loaded from a snapshot, up to date with the disk. Every
+// directory is stat()ed, but only those whose mtime or inode changed since
+// the snapshot are read again; vanished ones are dropped with everything
+// below them. The lock is only held while applying changes, so picks keep
+// working from the snapshot meanwhile. Runs on the watcher thread after
+// its watches are in place, so nothing that happens later can slip through.
+// The files of a directory read again get their size and age refreshed on
+// the way; a file rewritten in place, in a directory that did not change,
+// keeps the ones it had.
+void IndexRevalidate(void) {
+    pthread_mutex_lock(&g_IndexLock);
+    int dirCount = g_Index.unverified ? g_Index.store.dirCount : 0;
+    pthread_mutex_unlock(&g_IndexLock);
+    if (dirCount == 0) return;
+
+    char* changed = (char*)calloc(dirCount, 1);     // Directories read again
+    char* buffer = (char*)malloc(GETDENTS_BUF_SIZE);
+    if (changed == NULL || buffer == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in IndexRevalidate.\n");
+        exit(1);
+    }
+    FileIndex seen = {0};   // (directory, name) of every file found in them
+    StringList newDirs;     // Subdirectories the snapshot never knew
+    InitStringList(&newDirs);
+    int aborted = 0;
+
+    for (int d = 0; d < dirCount && !aborted && g_running; d++) {
+        char path[PATH_MAX];
+        pthread_mutex_lock(&g_IndexLock);
+        // Give up if the main thread rebuilt the index in the meantime
+        aborted = !g_Index.unverified;
+        DirNode node = g_Index.store.dirs[d];
+        int known = !aborted && node.parent != DIR_DETACHED && StoreDirPath(&g_Index.store, d, path, sizeof(path)) >= 0;
+        const char* root = known ? IndexRootOf(&g_Index, path) : NULL;
+        size_t rootLen = (root != NULL) ? strlen(root) : strlen(path);
+        pthread_mutex_unlock(&g_IndexLock);
+        if (!known || node.mtime == DIR_MTIME_ALIAS) continue;
+        const char* dirRel = PathBelowRoot(path, rootLen);
+
+        // Saved directories may be symlinks; anything below them may not
+        struct stat st;
+        int exists = (node.parent == DIR_ROOT ? stat(path, &st) : StatEntry(path, &st)) == 0 && S_ISDIR(st.st_mode);
+        if (!exists) {
+            pthread_mutex_lock(&g_IndexLock);
+            if (g_Index.unverified) IndexRemoveTreeAt(&g_Index, d);
+            pthread_mutex_unlock(&g_IndexLock);
+            continue;
+        }
+        int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        if (mtime == node.mtime && (uint64_t)st.st_ino == node.ino) continue;
+
+        // Changed: read its entries again
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) continue;
+        int64_t firstSeen = seen.store.fileCount;
+        StringList subdirs;
+        InitStringList(&subdirs);
+        StringList otherNames; // Files with more names (--dedupe-hardlinks)
+        InitStringList(&otherNames);
+        long length;
+        while ((length = syscall(SYS_getdents64, fd, buffer, GETDENTS_BUF_SIZE)) > 0) {
+            for (long offset = 0; offset < length; ) {
+                struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + offset);
+                offset += entry->d_reclen;
+                const char* name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+                struct stat entrySt;
+                int haveStat, isLink;
+                int type = EntryType(fd, name, entry->d_type, &entrySt, &haveStat, &isLink);
+                if (IsExcluded(dirRel, name, type == DT_DIR)) continue;
+                if (type == DT_REG) {
+                    if (!haveStat) haveStat = (fstatat(fd, name, &entrySt, AT_SYMLINK_NOFOLLOW) == 0);
+                    IndexAddEntry(&seen, d, name, haveStat ? (int64_t)entrySt.st_size : 0,
+                                  haveStat ? (int64_t)entrySt.st_mtime : 0);
+                    if (g_DedupeHardlinks && haveStat && entrySt.st_nlink > 1) AddStringToList(&otherNames, name);
+                } else if (type == DT_DIR && !(isLink && LinkEntryLeadsIntoRoots(path, name))) {
+                    AddStringToList(&subdirs, name);
+                }
+            }
+        }
+        close(fd);
+
+        pthread_mutex_lock(&g_IndexLock);
+        aborted = !g_Index.unverified;
+        if (!aborted) {
+            changed[d] = 1;
+            for (int64_t i = firstSeen; i < seen.store.fileCount; i++) {
+                const char* name = StoreFileName(&seen.store, i);
+                // A new name of a file with several is taken for one of a
+                // file indexed already
+                if (otherNames.count > 0 && StringListContains(&otherNames, name) &&
+                    (g_Index.table.capacity == 0 || g_Index.table.slots[FileTableProbe(&g_Index, d, name)] == -1)) {
+                    continue;
+                }
+                IndexAddEntry(&g_Index, d, name, seen.store.sizes[i], seen.store.mtimes[i]);
+            }
+            for (int i = 0; i < subdirs.count; i++) {
+                if (IndexFindChildDir(&g_Index, d, subdirs.items[i]) == -1) {
+                    char subPath[PATH_MAX];
+                    int len = snprintf(subPath, sizeof(subPath), "%s/%s", path, subdirs.items[i]);
+                    if (len > 0 && len < (int)sizeof(subPath)) AddStringToList(&newDirs, subPath);
+                }
+            }
+            g_Index.store.dirs[d].mtime = mtime;
+            g_Index.store.dirs[d].ino = (uint64_t)st.st_ino;
+        }
+        pthread_mutex_unlock(&g_IndexLock);
+        FreeStringList(&subdirs);
+        FreeStringList(&otherNames);
+    }
+
+    // Whole subtrees that appeared while we were not running
+    for (int i = 0; i < newDirs.count && !aborted && g_running; i++) {
+        pthread_mutex_lock(&g_IndexLock);
+        const char* root = IndexRootOf(&g_Index, newDirs.items[i]);
+        size_t rootLen = (root != NULL) ? strlen(root) : strlen(newDirs.items[i]);
+        pthread_mutex_unlock(&g_IndexLock);
+        PathStore found;
+        InitPathStore(&found);
+        ScanDirectory(newDirs.items[i], rootLen, &found);
+        pthread_mutex_lock(&g_IndexLock);
+        aborted = !g_Index.unverified;
+        if (!aborted) IndexAddScan(&g_Index, &found);
+        pthread_mutex_unlock(&g_IndexLock);
+        FreePathStore(&found);
+    }
+
+    // Files of re-read directories that are no longer there
+    pthread_mutex_lock(&g_IndexLock);
+    if (!aborted && g_Index.unverified) {
+        for (int64_t i = g_Index.store.fileCount - 1; i >= 0; i--) {
+            const FileEntry* entry = &g_Index.store.files[i];
+            if (entry->dir >= dirCount || !changed[entry->dir]) continue;
+            if (seen.table.capacity == 0 ||
+                seen.table.slots[FileTableProbe(&seen, entry->dir, StoreFileName(&g_Index.store, i))] == -1) {
+                IndexRemoveSlot(&g_Index, i);
+            }
+        }
+        g_Index.unverified = 0;
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+
+    FreeFileIndex(&seen);
+    FreeStringList(&newDirs);
+    free(changed);
+    free(buffer);
+}
+
+// ====================================================================
+// --- Filtered and Weighted Selection ---
+// ====================================================================
+
+// Returns non-zero if 'filter' restricts or skews picks at all
+int FilterIsActive(const FileFilter* filter) {
+    return filter->minSize >= 0 || filter->maxSize >= 0 || filter->newerAge >= 0 ||
+           filter->olderAge >= 0 || filter->exts.count > 0 || filter->weight != WEIGHT_UNIFORM;
+}
+
+// The files that match g_Filter, plus an alias table over them for
+// weighted picks (Vose's method): choose a column uniformly, then keep it
+// or switch to its alias with a precomputed probability. Building it is
+// one O(n) pass after the index changes; every pick after that is O(1).
+// Guarded by g_IndexLock, like the index it describes.
+typedef struct {
+    int valid;
+    uint64_t generation;    // Index generation it was built for
+    int64_t builtAt;        // time() it was built at, which ages count from
+    int64_t count;          // Number of matching files
+    int64_t capacity;
+    int64_t* slots;         // Their slots in the index
+    uint64_t* keep;         // Weighted only: keep column i if RandomNext() < keep[i]
+    int64_t* alias;         // Weighted only: otherwise take column alias[i]
+} Selection;
+
+static Selection g_Selection = {0};
+
+// Ages are measured from the pick, so a selection that depends on them
+// (--newer, --older, --weight recent) is built again once the clock has
+// moved on by this many seconds
+#define SELECTION_MAX_AGE 1
+
+// Relative chance of the file in 'slot' under 'weight'
+static double FileWeight(const PathStore* store, int64_t slot, int weight, int64_t now) {
+    if (weight == WEIGHT_SIZE) return (double)store->sizes[slot];
+    int64_t age = now - store->mtimes[slot];
+    return 1.0 / (1.0 + (double)(age > 0 ? age : 0) / 86400.0);
+}
+
+// Builds the alias table for the first 'sel->count' columns
+static void SelectionBuildAlias(Selection* sel, const PathStore* store, int weight, int64_t now) {
+    int64_t n = sel->count;
+    double* prob = (double*)malloc(n * sizeof(double));
+    int64_t* work = (int64_t*)malloc(n * sizeof(int64_t));
+    sel->keep = (uint64_t*)malloc(n * sizeof(uint64_t));
+    sel->alias = (int64_t*)malloc(n * sizeof(int64_t));
+    if (prob == NULL || work == NULL || sel->keep == NULL || sel->alias == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in SelectionBuildAlias.\n");
+        exit(1);
+    }
+
+    double total = 0.0;
+    for (int64_t i = 0; i < n; i++) {
+        prob[i] = FileWeight(store, sel->slots[i], weight, now);
+        total += prob[i];
+    }
+    // Scale so the average is 1, then sort columns into those below the
+    // average (front of 'work') and those at or above it (back)
+    int64_t small = 0, large = n;
+    for (int64_t i = 0; i < n; i++) {
+        prob[i] = (total > 0.0) ? prob[i] * (double)n / total : 1.0;
+        if (prob[i] < 1.0) {
+            work[small++] = i;
+        } else {
+            work[--large] = i;
+        }
+    }
+    // Top up each small column from a large one
+    while (small > 0 && large < n) {
+        int64_t s = work[--small];
+        int64_t l = work[large];
+        sel->keep[s] = (uint64_t)(prob[s] * 18446744073709551616.0);
+        sel->alias[s] = l;
+        prob[l] = (prob[l] + prob[s]) - 1.0;
+        if (prob[l] < 1.0) {
+            large++;
+            work[small++] = l;
+        }
+    }
+    // Whatever is left is full (up to rounding)
+    while (small > 0) {
+        int64_t s = work[--small];
+        sel->keep[s] = UINT64_MAX;
+        sel->alias[s] = s;
+    }
+    for (; large < n; large++) {
+        sel->keep[work[large]] = UINT64_MAX;
+        sel->alias[work[large]] = work[large];
+    }
+    free(prob);
+    free(work);
+}
+
+// Rebuilds 'sel' for the current contents of 'index'
+static void SelectionBuild(Selection* sel, const FileIndex* index, const FileFilter* filter) {
+    const PathStore* store = &index->store;
+    int64_t n = store->fileCount;
+    if (n > sel->capacity) {
+        int64_t* newSlots = (int64_t*)realloc(sel->slots, n * sizeof(int64_t));
+        if (newSlots == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in SelectionBuild.\n");
+            exit(1);
+        }
+        sel->slots = newSlots;
+        sel->capacity = n;
+    }
+    free(sel->keep);
+    free(sel->alias);
+    sel->keep = NULL;
+    sel->alias = NULL;
+
+    // Allowed extensions as a table by id. Id 0 (no extension) and ids
+    // outside the table only pass when no extension is asked for.
+    pthread_mutex_lock(&g_ExtensionLock);
+    uint32_t extLimit = (uint32_t)g_Extensions.count + 1;
+    pthread_mutex_unlock(&g_ExtensionLock);
+    uint8_t* extOk = (uint8_t*)malloc(extLimit);
+    if (extOk == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in SelectionBuild.\n");
+        exit(1);
+    }
+    memset(extOk, filter->exts.count == 0, extLimit);
+    for (int i = 0; i < filter->exts.count; i++) {
+        uint32_t id = ExtensionIdOf(filter->exts.items[i]);
+        if (id != 0 && id < extLimit) extOk[id] = 1;
+    }
+
+    int64_t minSize = (filter->minSize >= 0) ? filter->minSize : INT64_MIN;
+    int64_t maxSize = (filter->maxSize >= 0) ? filter->maxSize : INT64_MAX;
+    int64_t now = (int64_t)time(NULL);
+    int64_t minTime = (filter->newerAge >= 0) ? now - filter->newerAge : INT64_MIN;
+    int64_t maxTime = (filter->olderAge >= 0) ? now - filter->olderAge : INT64_MAX;
+
+    // One pass over the columns. Every slot is written and the count only
+    // advances on a match, so the loop has no data-dependent branches.
+    const int64_t* sizes = store->sizes;
+    const int64_t* mtimes = store->mtimes;
+    const uint32_t* exts = store->exts;
+    int64_t* slots = sel->slots;
+    int64_t count = 0;
+    for (int64_t i = 0; i < n; i++) {
+        uint32_t ext = exts[i];
+        int match = (sizes[i] >= minSize) & (sizes[i] <= maxSize) &
+                    (mtimes[i] >= minTime) & (mtimes[i] <= maxTime) &
+                    extOk[ext < extLimit ? ext : 0];
+        slots[count] = i;
+        count += match;
+    }
+    free(extOk);
+    sel->count = count;
+
+    if (filter->weight != WEIGHT_UNIFORM && count > 0) {
+        SelectionBuildAlias(sel, store, filter->weight, now);
+    }
+    sel->generation = index->generation;
+    sel->builtAt = now;
+    sel->valid = 1;
+}
+
+// Returns non-zero if 'sel', built for 'filter', still describes 'index' now
+static int SelectionIsCurrent(const Selection* sel, const FileIndex* index, const FileFilter* filter) {
+    if (!sel->valid || sel->generation != index->generation) return 0;
+    int usesAge = filter->newerAge >= 0 || filter->olderAge >= 0 || filter->weight == WEIGHT_RECENT;
+    return !usesAge || (int64_t)time(NULL) - sel->builtAt < SELECTION_MAX_AGE;
+}
+
+// Draws one slot from a non-empty selection in O(1)
+static int64_t SelectionPick(const Selection* sel) {
+    int64_t column = (int64_t)RandomBelow((uint64_t)sel->count);
+    if (sel->keep != NULL && RandomNext() >= sel->keep[column]) column = sel->alias[column];
+    return sel->slots[column];
+}
+
+// Returns the selection for g_Filter over 'index', rebuilding it if the
+// index changed since. Caller holds g_IndexLock.
+const Selection* IndexSelection(const FileIndex* index) {
+    if (!SelectionIsCurrent(&g_Selection, index, &g_Filter)) {
+        SelectionBuild(&g_Selection, index, &g_Filter);
+    }
+    return &g_Selection;
+}
+
+// Picks a random file slot honouring g_Filter, or returns -1 if no file
+// qualifies. Caller holds g_IndexLock.
+int64_t IndexPickSlot(const FileIndex* index) {
+    if (!FilterIsActive(&g_Filter)) {
+        if (index->store.fileCount == 0) return -1;
+        return (int64_t)RandomBelow((uint64_t)index->store.fileCount);
+    }
+    const Selection* sel = IndexSelection(index);
+    return (sel->count == 0) ? -1 : SelectionPick(sel);
+}
+
+// Picks a random file and writes its full path into 'buffer'. Returns 1 on
+// success, 0 if the index holds no files and -1 if none passes g_Filter.
+// Caller holds g_IndexLock; the tree sampler reads one directory under it.
+int IndexPickPath(const FileIndex* index, char* buffer, size_t size) {
+    if (index->treeMode) {
+        for (int attempt = 0; attempt < TREE_PICK_ATTEMPTS; attempt++) {
+            uint64_t nth = 0;
+            int dir = TreeChooseDir(index, &nth);
+            if (dir == -1) return 0;
+            if (TreeNthFile(index, dir, nth, buffer, size)) return 1;
+        }
+        return 0;
+    }
+    int64_t slot = IndexPickSlot(index);
+    if (slot == -1) return (index->store.fileCount > 0) ? -1 : 0;
+    IndexPathOf(index, slot, buffer, size);
+    return 1;
+}
+
+// Releases the selection tables
+void FreeSelection(void) {
+    free(g_Selection.slots);
+    free(g_Selection.keep);
+    free(g_Selection.alias);
+    memset(&g_Selection, 0, sizeof(g_Selection));
+}
+
+// Parses a size such as "500", "64K", "10M" or "2G" (powers of 1024).
+// Returns -1 if it is not one.
+int64_t ParseSize(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': value *= 1024.0; end++; break;
+        case 'm': case 'M': value *= 1024.0 * 1024.0; end++; break;
+        case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        case 't': case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0' || value >= 9.2e18) return -1;
+    return (int64_t)value;
+}
+
+// Parses an age such as "30s", "15m", "12h", "7d" or "2w" into seconds.
+// A bare number means days. Returns -1 if it is not one.
+int64_t ParseAge(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    switch (*end) {
+        case 's': end++; break;
+        case 'm': value *= 60.0; end++; break;
+        case 'h': value *= 3600.0; end++; break;
+        case '\0': case 'd': value *= 86400.0; if (*end) end++; break;
+        case 'w': value *= 7.0 * 86400.0; end++; break;
+        default: return -1;
+    }
+    if (*end != '\0' || value >= 9.2e18) return -1;
+    return (int64_t)value;
+}
+
+// ====================================================================
+// --- Batch Mode ---
+// ====================================================================
+
+// Output is collected in one large buffer and handed to write() in big
+// chunks, so printing millions of paths costs a few syscalls, not a
+// printf() per line.
+#define BATCH_BUF_SIZE ((size_t)1 << 20)
+
+typedef struct {
+    char* data;
+    size_t used;
+    size_t capacity;
+    int fd;             // -1: nothing is written, the buffer grows instead
+    int failed;         // Set once a write fails (e.g. the reader went away)
+} OutputBuffer;
+
+// Writes out everything buffered so far
+static void OutputFlush(OutputBuffer* out) {
+    if (out->fd < 0) return; // Kept for whoever owns the buffer
+    size_t done = 0;
+    while (done < out->used && !out->failed) {
+        ssize_t n = write(out->fd, out->data + done, out->used - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            out->failed = 1;
+        } else {
+            done += (size_t)n;
+        }
+    }
+    out->used = 0;
+}
+
+// Makes sure 'need' more bytes fit, by writing out what is buffered or,
+// for a buffer without a descriptor, by growing it
+static void OutputMakeRoom(OutputBuffer* out, size_t need) {
+    if (out->capacity - out->used >= need) return;
+    if (out->fd >= 0) {
+        OutputFlush(out);
+        return;
+    }
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity - out->used < need) capacity *= 2;
+    char* data = (char*)realloc(out->data, capacity);
+    if (data == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in OutputMakeRoom.\n");
+        exit(1);
+    }
+    out->data = data;
+    out->capacity = capacity;
+}
+
+// Appends the path of the file in 'slot', followed by 'terminator'
+static void OutputIndexPath(OutputBuffer* out, const FileIndex* index, int64_t slot, char terminator) {
+    OutputMakeRoom(out, PATH_MAX + 1);
+    char* at = out->data + out->used;
+    IndexPathOf(index, slot, at, PATH_MAX);
+    size_t len = strlen(at);
+    at[len] = terminator;
+    out->used += len + 1;
+}
+
+// Appends the path of a file drawn by the tree sampler. Returns 0 if no
+// file could be drawn.
+static int OutputTreePath(OutputBuffer* out, const FileIndex* index, char terminator) {
+    OutputMakeRoom(out, PATH_MAX + 1);
+    char* at = out->data + out->used;
+    if (IndexPickPath(index, at, PATH_MAX) != 1) return 0;
+    size_t len = strlen(at);
+    at[len] = terminator;
+    out->used += len + 1;
+    return 1;
+}
+
+// Appends a line of text, in 'color' if colours are on (NULL = plain)
+static void OutputText(OutputBuffer* out, const char* color, const char* text) {
+    size_t len = strlen(text);
+    int colored = g_UseColor && color != NULL;
+    size_t need = len + (colored ? strlen(color) + strlen(COLOR_RESET) : 0);
+    OutputMakeRoom(out, need);
+    if (need > out->capacity - out->used) return;
+    if (colored) {
+        memcpy(out->data + out->used, color, strlen(color));
+        out->used += strlen(color);
+    }
+    memcpy(out->data + out->used, text, len);
+    out->used += len;
+    if (colored) {
+        memcpy(out->data + out->used, COLOR_RESET, strlen(COLOR_RESET));
+        out->used += strlen(COLOR_RESET);
+    }
+}
+
+// The few positions a partial Fisher-Yates shuffle has touched, so drawing
+// k of n without replacement takes O(k) memory instead of an n-sized
+// permutation. Positions not in the map still hold their own value.
+typedef struct {
+    int64_t* keys;      // -1 marks an empty bucket
+    int64_t* values;
+    int64_t capacity;   // Power of two
+} SwapMap;
+
+// Returns the bucket holding 'key', or the empty bucket where it belongs
+static int64_t SwapMapProbe(const SwapMap* map, int64_t key) {
+    int64_t mask = map->capacity - 1;
+    int64_t i = (int64_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull >> 17) & (uint64_t)mask);
+    while (map->keys[i] != -1 && map->keys[i] != key) i = (i + 1) & mask;
+    return i;
+}
+
+// The value currently at position 'key'
+static int64_t SwapMapGet(const SwapMap* map, int64_t key) {
+    int64_t i = SwapMapProbe(map, key);
+    return (map->keys[i] == -1) ? key : map->values[i];
+}
+
+static void SwapMapSet(SwapMap* map, int64_t key, int64_t value) {
+    int64_t i = SwapMapProbe(map, key);
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+// Appends 'count' random indexed paths to 'out', drawn from 'sel' if it
+// is not NULL. With 'unique' no file is repeated (and at most every file
+// is printed once); otherwise each pick is independent. Returns the
+// number of paths appended. Caller holds g_IndexLock.
+static long long OutputRandomPaths(OutputBuffer* out, const FileIndex* index, const Selection* sel,
+                                   long long count, int unique, char terminator) {
+    int64_t n = index->treeMode ? index->treeTop.total : sel ? sel->count : index->store.fileCount;
+    if (n == 0 || count <= 0) return 0;
+    if (unique && count > n) count = n;
+
+    long long written = 0;
+    if (!unique) {
+        for (; written < count && !out->failed; written++) {
+            if (index->treeMode) {
+                // No slots to number: every pick walks the tree
+                if (!OutputTreePath(out, index, terminator)) break;
+                continue;
+            }
+            int64_t slot = sel ? SelectionPick(sel) : (int64_t)RandomBelow((uint64_t)n);
+            OutputIndexPath(out, index, slot, terminator);
+        }
+    } else {
+        // Each step swaps position i with a random later position j, like a
+        // shuffle, but only touched positions are stored. Every step adds at
+        // most two keys, so 4 * count buckets keep the load at or under 1/2.
+        SwapMap map;
+        map.capacity = 16;
+        while (map.capacity < 4 * count) map.capacity *= 2;
+        map.keys = (int64_t*)malloc(map.capacity * sizeof(int64_t));
+        map.values = (int64_t*)malloc(map.capacity * sizeof(int64_t));
+        if (map.keys == NULL || map.values == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in OutputRandomPaths.\n");
+            exit(1);
+        }
+        memset(map.keys, -1, map.capacity * sizeof(int64_t));
+        for (int64_t i = 0; i < count && !out->failed; i++) {
+            int64_t j = i + (int64_t)RandomBelow((uint64_t)(n - i));
+            int64_t picked = SwapMapGet(&map, j);
+            SwapMapSet(&map, j, SwapMapGet(&map, i));
+            OutputIndexPath(out, index, sel ? sel->slots[picked] : picked, terminator);
+            written++;
+        }
+        free(map.keys);
+        free(map.values);
+    }
+    return written;
+}
+
+// Writes 'count' random indexed paths to stdout, honouring g_Filter (see
+// OutputRandomPaths). Returns the number of paths written.
+long long WriteRandomPaths(const FileIndex* index, long long count, int unique, char terminator) {
+    // With a filter, picks are drawn from the matching files only
+    const Selection* sel = FilterIsActive(&g_Filter) ? IndexSelection(index) : NULL;
+
+    OutputBuffer out = {0};
+    out.fd = STDOUT_FILENO;
+    out.capacity = BATCH_BUF_SIZE;
+    out.data = (char*)malloc(BATCH_BUF_SIZE);
+    if (out.data == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in WriteRandomPaths.\n");
+        exit(1);
+    }
+    long long written = OutputRandomPaths(&out, index, sel, count, unique, terminator);
+    OutputFlush(&out);
+    free(out.data);
+    return written;
+}
+
+// Gets g_Index ready for a run without a watcher: the saved snapshot,
+// brought up to date, or else a fresh scan. Either way the result is saved.
+void PrepareIndexOffline(const StringList* dirs) {
+    if (IndexLoadSnapshot(&g_Index, dirs, INDEX_FILE)) {
+        IndexRevalidate();
+    } else {
+        BuildFileIndex(&g_Index, dirs);
+    }
+    if (!g_Index.unverified) IndexSaveSnapshot(&g_Index, INDEX_FILE);
+}
+
+// ====================================================================
+// --- Background Scan ---
+// ====================================================================
+// Reading whole trees can take a while, and nobody should wait for it
+// with the index locked. A background scan reads them on a thread of its
+// own and only takes g_IndexLock to make its result the index.
+//
+// Without a saved index, the first scan of big trees can take a while. At
+// the prompt it starts in the background as soon as the program does,
+// instead of on the first Enter. While it runs, Enter waits for it at most
+// --pick-budget milliseconds, then answers from the scan preview: a
+// partial pick among the files found so far, marked as such. Once the
+// scan is done its result becomes the index, and picks are uniform over
+// all files again. The tree sampler keeps no names to preview, so there
+// Enter waits for the scan to finish.
+//
+// The server starts one when a pick finds the index stale (a tree the
+// watcher does not keep current), and answers from the index as it is
+// until the scan is done.
+
+typedef struct {
+    pthread_t thread;
+    StringList roots;   // The trees it reads (its own copy)
+    int preview;        // Files found go to the scan preview
+    atomic_int done;    // The thread has nothing left to do
+    int started;        // Running, or finished but not yet joined
+} BackgroundScan;
+
+static BackgroundScan g_BackgroundScan = {0};
+
+// Changes the watcher sees while the scan runs are about trees it may
+// have read already, and the index it is about to replace ignores them.
+// They are held back instead, in order, and applied once the scan's result
+// is the index (see ReleaseHeldEvents). A held rename is its two halves: a
+// deletion and a creation, each read from the disk as it is by then.
+#define HELD_CREATE 0
+#define HELD_DELETE 1
+#define HELD_RESCAN 2   // The whole root (the event queue overflowed)
+
+typedef struct {
+    int op;             // HELD_*
+    int isDir;
+    char* root;         // Copies: the watcher may be gone when they are applied
+    char* path;
+} HeldEvent;
+
+static pthread_mutex_t g_HeldLock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int g_HoldEvents = 0;     // Set while the scan runs and its backlog is applied
+static HeldEvent* g_Held = NULL;        // The backlog, oldest first from g_HeldNext
+static int g_HeldCount = 0;
+static int g_HeldNext = 0;
+static int g_HeldCapacity = 0;
+static _Thread_local int g_ReleasingHeld = 0; // This thread applies the backlog
+
+static void ReleaseHeldEvents(void);
+
+// Queues a change for after the scan if one is running. Returns non-zero
+// if it was queued, zero if it is to be applied right away.
+static int HoldEvent(int op, const char* root, const char* path, int isDir) {
+    if (g_ReleasingHeld || !atomic_load(&g_HoldEvents)) return 0;
+    pthread_mutex_lock(&g_HeldLock);
+    // Checked again: the backlog may have run out since
+    int hold = atomic_load(&g_HoldEvents);
+    if (hold) {
+        if (g_HeldCount == g_HeldCapacity) {
+            g_HeldCapacity = (g_HeldCapacity == 0) ? 64 : g_HeldCapacity * 2;
+            g_Held = (HeldEvent*)realloc(g_Held, g_HeldCapacity * sizeof(HeldEvent));
+        }
+        HeldEvent* event = (g_Held != NULL) ? &g_Held[g_HeldCount++] : NULL;
+        if (event != NULL) {
+            event->op = op;
+            event->isDir = isDir;
+            event->root = strdup(root);
+            event->path = strdup(path);
+        }
+        if (event == NULL || event->root == NULL || event->path == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in HoldEvent.\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&g_HeldLock);
+    return hold;
+}
+
+static void* BackgroundScanThread(void* arg) {
+    (void)arg;
+    // A directory read before its watch is in place could change unseen
+    // in between, so the watches come first
+    WaitForWatcher();
+    // Now that they are, the index may turn out current after all (a
+    // snapshot the watcher vouches for)
+    pthread_mutex_lock(&g_IndexLock);
+    int stale = IndexIsStale(&g_Index, &g_BackgroundScan.roots);
+    pthread_mutex_unlock(&g_IndexLock);
+    if (stale) {
+        PathStore store = ScanSavedDirs(&g_BackgroundScan.roots, g_BackgroundScan.preview);
+        pthread_mutex_lock(&g_IndexLock);
+        // Abandoned half-way through if the program is exiting
+        if (g_running) {
+            IndexAdoptStore(&g_Index, &g_BackgroundScan.roots, store);
+            IndexSaveSnapshot(&g_Index, INDEX_FILE);
+        } else {
+            FreePathStore(&store);
+        }
+        pthread_mutex_unlock(&g_IndexLock);
+    }
+    pthread_mutex_lock(&g_IndexLock);
+    long long files = g_Index.treeMode ? g_Index.treeTop.total : g_Index.store.fileCount;
+    pthread_mutex_unlock(&g_IndexLock);
+    // Catch up with what changed while the trees were being read
+    ReleaseHeldEvents();
+    // Only news to someone who was shown partial picks
+    if (g_BackgroundScan.preview && PreviewFinish() > 0 && g_running) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "\n[Scan] Indexed %lld files; picks now cover them all.\n", files);
+        WriteColor(COLOR_GREEN, buffer);
+    }
+    atomic_store(&g_BackgroundScan.done, 1);
+    return NULL;
+}
+
+// Starts reading 'roots' in the background, with the scan preview if
+// 'preview' is set, unless a scan of them is running already. Returns zero
+// if there is none running and none could be started. Main thread only.
+int StartBackgroundScan(const StringList* roots, int preview) {
+    if (BackgroundScanRunning() && SameStringList(&g_BackgroundScan.roots, roots)) return 1;
+    FinishBackgroundScan(); // One of other trees is no use; it finishes first
+    if (preview) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&g_PreviewDone, &attr);
+        pthread_condattr_destroy(&attr);
+        PreviewStart();
+    }
+    g_BackgroundScan.roots = CopyStringList(roots);
+    g_BackgroundScan.preview = preview;
+    atomic_store(&g_BackgroundScan.done, 0);
+    // Before the scan reads anything: what changes from here on is held
+    atomic_store(&g_HoldEvents, 1);
+    if (pthread_create(&g_BackgroundScan.thread, NULL, BackgroundScanThread, NULL) != 0) {
+        atomic_store(&g_HoldEvents, 0);
+        if (preview) {
+            PreviewFinish();
+            pthread_cond_destroy(&g_PreviewDone);
+        }
+        FreeStringList(&g_BackgroundScan.roots);
+        return 0;
+    }
+    g_BackgroundScan.started = 1;
+    return 1;
+}
+
+// Returns non-zero if a background scan is still running. One that has
+// finished is joined. Main thread only.
+int BackgroundScanRunning(void) {
+    if (!g_BackgroundScan.started) return 0;
+    if (!atomic_load(&g_BackgroundScan.done)) return 1;
+    FinishBackgroundScan();
+    return 0;
+}
+
+// Returns non-zero if a background scan with the preview is still running
+// after waiting up to 'budgetMs' for it to finish (one without is never
+// waited for). A finished scan is
+// joined. If the saved directories are no longer 'roots', its files are
+// not the ones asked for, so this waits for it to the end, as it does for
+// the tree sampler. Main thread only.
+int BackgroundScanBusy(const StringList* roots, int budgetMs) {
+    if (!g_BackgroundScan.started || !g_BackgroundScan.preview) return 0;
+    int waitForAll = g_TreeSampler || !SameStringList(&g_BackgroundScan.roots, roots);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += budgetMs / 1000;
+    deadline.tv_nsec += (long)(budgetMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&g_PreviewLock);
+    while (g_PreviewActive) {
+        if (waitForAll) {
+            pthread_cond_wait(&g_PreviewDone, &g_PreviewLock);
+        } else if (pthread_cond_timedwait(&g_PreviewDone, &g_PreviewLock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int busy = g_PreviewActive;
+    pthread_mutex_unlock(&g_PreviewLock);
+    if (!busy) FinishBackgroundScan();
+    return busy;
+}
+
+// Gets the index read again if it no longer matches 'roots', without
+// holding g_IndexLock through the scan: in the background, while picks
+// come from the index as it is or, if it holds other trees, are partial
+// ones, as during the first scan. Main thread only.
+void RefreshIndex(const StringList* roots) {
+    pthread_mutex_lock(&g_IndexLock);
+    int stale = IndexIsStale(&g_Index, roots);
+    int sameTrees = g_Index.built && SameStringList(&g_Index.roots, roots);
+    pthread_mutex_unlock(&g_IndexLock);
+    if (!stale || StartBackgroundScan(roots, !sameTrees)) return;
+
+    // No thread for it: read them here, still without the lock
+    PathStore store = GetAllFiles(roots);
+    pthread_mutex_lock(&g_IndexLock);
+    IndexAdoptStore(&g_Index, roots, store);
+    IndexSaveSnapshot(&g_Index, INDEX_FILE);
+    pthread_mutex_unlock(&g_IndexLock);
+}
+
+// Waits for the background scan, if one was started, and releases it. On
+// the way out (g_running cleared) it gives up quickly. Main thread only.
+void FinishBackgroundScan(void) {
+    if (!g_BackgroundScan.started) return;
+    pthread_join(g_BackgroundScan.thread, NULL);
+    if (g_BackgroundScan.preview) pthread_cond_destroy(&g_PreviewDone);
+    FreeStringList(&g_BackgroundScan.roots);
+    g_BackgroundScan.started = 0;
+}
+
+// ====================================================================
+// --- Output and Command Helpers ---
+// ====================================================================
+
+// Helper function to print text with a specific ANSI color
+void WriteColor(const char* color, const char* message) {
+    if (g_UseColor) {
+        printf("%s%s" COLOR_RESET, color, message);
+    } else {
+        fputs(message, stdout);
+    }
+}
+
+// The environment handed to spawned openers
+extern char** environ;
+
+// Openers that could not be handed to the watcher's event loop (no pidfd).
+// Only the main thread touches these; each is waited for by its own pid,
+// so openers the event loop owns are never reaped from under it.
+#define MAX_UNWATCHED_OPENERS 64
+static pid_t g_UnwatchedOpeners[MAX_UNWATCHED_OPENERS];
+static int g_UnwatchedOpenerCount = 0;
+
+// Collects the unwatched openers that finished, and remembers 'pid' (if
+// not 0) as a new one. Returns 0 if there is no room for it.
+static int ReapUnwatchedOpeners(pid_t pid) {
+    int kept = 0;
+    for (int i = 0; i < g_UnwatchedOpenerCount; i++) {
+        if (waitpid(g_UnwatchedOpeners[i], NULL, WNOHANG) == 0) g_UnwatchedOpeners[kept++] = g_UnwatchedOpeners[i];
+    }
+    g_UnwatchedOpenerCount = kept;
+    if (pid == 0) return 1;
+    if (g_UnwatchedOpenerCount == MAX_UNWATCHED_OPENERS) return 0;
+    g_UnwatchedOpeners[g_UnwatchedOpenerCount++] = pid;
+    return 1;
+}
+
+// Splits the --opener command into words in place, the way a shell would
+// for plain words: blanks separate them, '...' keeps everything literally,
+// "..." does too except that \" and \\ stand for " and \, and a backslash
+// outside quotes keeps the next character. Returns the number of words,
+// or -1 if a quote is left open.
+static int SplitCommandLine(char* text, char** words, int maxWords) {
+    int count = 0;
+    char* in = text;
+    while (*in != '\0') {
+        while (*in == ' ' || *in == '\t') in++;
+        if (*in == '\0') break;
+        if (count == maxWords) return count;
+        char* out = in; // Words only ever shrink, so they are written over themselves
+        words[count++] = out;
+        while (*in != '\0' && *in != ' ' && *in != '\t') {
+            if (*in == '\'') {
+                char* end = strchr(in + 1, '\'');
+                if (end == NULL) return -1;
+                memmove(out, in + 1, (size_t)(end - in - 1));
+                out += end - in - 1;
+                in = end + 1;
+            } else if (*in == '"') {
+                for (in++; *in != '"'; in++) {
+                    if (*in == '\0') return -1;
+                    if (*in == '\\' && (in[1] == '"' || in[1] == '\\')) in++;
+                    *out++ = *in;
+                }
+                in++;
+            } else {
+                if (*in == '\\' && in[1] != '\0') in++;
+                *out++ = *in++;
+            }
+        }
+        int last = (*in != '\0');
+        *out = '\0';
+        if (last) in++;
+    }
+    return count;
+}
+
+// Collects an opener that finished. 'key' is the epoll data it was
+// registered with: its pid in the high half, its pidfd in the low half.
+static void ReapOpener(uint64_t key) {
+    pid_t pid = (pid_t)(key >> 32);
+    int pidfd = (int)(uint32_t)key;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "[Opener] Exited with code %d.\n", WEXITSTATUS(status));
+        WriteColor(COLOR_YELLOW, buffer);
+    }
+    close(pidfd); // Also takes it out of the epoll set
+}
+
+// Handles the "open" command logic
+void HandleOpenCommand() {
+    if (strlen(g_LastShownFile) == 0) {
+        WriteColor(COLOR_YELLOW, "No file has been displayed yet. Press Enter first.\n");
+        return;
+    }
+
+    // Check if the file still exists using access()
+    if (access(g_LastShownFile, F_OK) != 0) {
+        char buffer[PATH_MAX + 64];
+        snprintf(buffer, sizeof(buffer), "File not found. It may have been moved or deleted: %s\n", g_LastShownFile);
+        WriteColor(COLOR_RED, buffer);
+        return;
+    }
+
+    // Openers whose pidfd never reached the watcher are collected here
+    ReapUnwatchedOpeners(0);
+
+    // --- Start the opener (xdg-open by default) directly, without a shell ---
+
+    // 1. Split the opener into words and add the file as the last argument.
+    //    No shell is involved, so the path needs no quoting or escaping.
+    char opener[PATH_MAX];
+    snprintf(opener, sizeof(opener), "%s", g_Opener);
+    char* argv[64];
+    int argc = SplitCommandLine(opener, argv, 62);
+    if (argc < 0) {
+        WriteColor(COLOR_RED, "The opener has an unmatched quote.\n");
+        return;
+    }
+    if (argc == 0) {
+        WriteColor(COLOR_RED, "No opener configured.\n");
+        return;
+    }
+    argv[argc++] = g_LastShownFile;
+    argv[argc] = NULL;
+
+    // 2. Keep it off our input, and in its own process group so Ctrl+C
+    //    here doesn't close what it opened
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    // 3. Start it and return to the prompt right away
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        char buffer[PATH_MAX + 64];
+        snprintf(buffer, sizeof(buffer), "Failed to open file. Is '%s' installed? (%s)\n", argv[0], strerror(err));
+        WriteColor(COLOR_RED, buffer);
+        return;
+    }
+
+    // 4. Let the watcher's event loop collect it once it exits, or else
+    //    the next "open"
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    int watched = 0;
+    if (pidfd >= 0) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((uint64_t)(uint32_t)pid << 32) | (uint32_t)pidfd;
+        watched = (epoll_ctl(g_EpollFd, EPOLL_CTL_ADD, pidfd, &ev) == 0);
+        if (!watched) close(pidfd);
+    }
+    if (!watched && !ReapUnwatchedOpeners(pid)) {
+        // Nowhere to keep it: wait for it rather than leave a zombie
+        waitpid(pid, NULL, 0);
+    }
+
+    char buffer[PATH_MAX + 32];
+    snprintf(buffer, sizeof(buffer), "Opening: %s\n", g_LastShownFile);
+    WriteColor(COLOR_GREEN, buffer);
+}
+
+// ====================================================================
+// --- Statistics Report ---
+// ====================================================================
+
+// Writes a duration in the unit that suits it
+static void FormatDuration(char* buffer, size_t size, double ns) {
+    if (ns < 1e3) {
+        snprintf(buffer, size, "%.0f ns", ns);
+    } else if (ns < 1e6) {
+        snprintf(buffer, size, "%.1f us", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(buffer, size, "%.1f ms", ns / 1e6);
+    } else {
+        snprintf(buffer, size, "%.2f s", ns / 1e9);
+    }
+}
+
+// Upper bound (in ns) of the latency below which a fraction 'p' of the picks fell
+static double LatencyPercentile(const StatsBlock* total, double p) {
+    unsigned long long picks = atomic_load(&total->counters[STAT_TIMED_PICKS]);
+    unsigned long long seen = 0;
+    for (int b = 0; b < STAT_LATENCY_BUCKETS; b++) {
+        seen += atomic_load(&total->latency[b]);
+        if (seen > 0 && (double)seen >= p * (double)picks) return (double)(1ULL << b);
+    }
+    return (double)(1ULL << (STAT_LATENCY_BUCKETS - 1));
+}
+
+// Appends the statistics in machine-readable form: a "name value" line
+// per counter, a "pick_ns_lt_LIMIT count" line per latency bucket that
+// isn't empty, and per saved directory a line
+// "root_scan SCANS LAST MAX TOTAL DIRS FILES PATH", times in seconds
+static void StatsDump(OutputBuffer* out) {
+    StatsBlock total;
+    StatsCollect(&total);
+    char line[PATH_MAX + 160];
+    for (int i = 0; i < STAT_COUNT; i++) {
+        snprintf(line, sizeof(line), "%s %llu\n", g_StatNames[i], (unsigned long long)atomic_load(&total.counters[i]));
+        OutputText(out, NULL, line);
+    }
+    for (int b = 0; b < STAT_LATENCY_BUCKETS; b++) {
+        unsigned long long count = atomic_load(&total.latency[b]);
+        if (count == 0) continue;
+        snprintf(line, sizeof(line), "pick_ns_lt_%llu %llu\n", 1ULL << b, count);
+        OutputText(out, NULL, line);
+    }
+    pthread_mutex_lock(&g_StatsLock);
+    for (int i = 0; i < g_RootStatsCount; i++) {
+        const RootStats* root = &g_RootStats[i];
+        snprintf(line, sizeof(line), "root_scan %lld %.6f %.6f %.6f %lld %lld %s\n", root->scans, root->lastSeconds,
+                 root->maxSeconds, root->totalSeconds, root->dirs, root->files, root->path);
+        OutputText(out, NULL, line);
+    }
+    pthread_mutex_unlock(&g_StatsLock);
+}
+
+static int CompareRootsBySlowest(const void* a, const void* b) {
+    double x = (*(const RootStats* const*)a)->lastSeconds, y = (*(const RootStats* const*)b)->lastSeconds;
+    return (x < y) - (x > y);
+}
+
+// Appends the statistics for people to read (the "stats" command)
+static void StatsReport(OutputBuffer* out) {
+    StatsBlock total;
+    StatsCollect(&total);
+    unsigned long long c[STAT_COUNT];
+    for (int i = 0; i < STAT_COUNT; i++) c[i] = atomic_load(&total.counters[i]);
+    char line[PATH_MAX + 160];
+
+    OutputText(out, COLOR_CYAN, "Scanner:\n");
+    snprintf(line, sizeof(line),
+             "  %llu scans, %llu directories read (%llu could not be opened), %llu getdents calls\n"
+             "  %llu entries, %llu stat fallbacks, %llu files found, %.1f MiB allocated for file lists\n",
+             c[STAT_SCANS], c[STAT_DIRS_OPENED], c[STAT_DIRS_FAILED], c[STAT_GETDENTS_CALLS], c[STAT_ENTRIES_READ],
+             c[STAT_STAT_FALLBACKS], c[STAT_FILES_FOUND], (double)c[STAT_BYTES_ALLOCATED] / (1024.0 * 1024.0));
+    OutputText(out, NULL, line);
+
+    OutputText(out, COLOR_CYAN, "Watcher events:\n");
+    snprintf(line, sizeof(line),
+             "  %llu created, %llu deleted, %llu moved out, %llu moved in, %llu changed, %llu gone\n",
+             c[STAT_EVENTS_CREATE], c[STAT_EVENTS_DELETE], c[STAT_EVENTS_MOVED_FROM], c[STAT_EVENTS_MOVED_TO],
+             c[STAT_EVENTS_CHANGE], c[STAT_EVENTS_GONE]);
+    OutputText(out, NULL, line);
+    if (c[STAT_QUEUE_OVERFLOWS] > 0) {
+        snprintf(line, sizeof(line), "  %llu queue overflows (events dropped, trees rescanned)\n", c[STAT_QUEUE_OVERFLOWS]);
+        OutputText(out, COLOR_YELLOW, line);
+    }
+
+    OutputText(out, COLOR_CYAN, "Picks:\n");
+    if (c[STAT_TIMED_PICKS] == 0) {
+        OutputText(out, NULL, "  none yet\n");
+    } else {
+        char mean[32], p50[32], p99[32], p999[32];
+        FormatDuration(mean, sizeof(mean), (double)c[STAT_PICK_NS] / (double)c[STAT_TIMED_PICKS]);
+        FormatDuration(p50, sizeof(p50), LatencyPercentile(&total, 0.5));
+        FormatDuration(p99, sizeof(p99), LatencyPercentile(&total, 0.99));
+        FormatDuration(p999, sizeof(p999), LatencyPercentile(&total, 0.999));
+        snprintf(line, sizeof(line), "  %llu picks, mean %s; p50 < %s, p99 < %s, p99.9 < %s\n", c[STAT_TIMED_PICKS],
+                 mean, p50, p99, p999);
+        OutputText(out, NULL, line);
+    }
+
+    // Slowest first, so the roots worth a look come on top
+    pthread_mutex_lock(&g_StatsLock);
+    if (g_RootStatsCount > 0) {
+        OutputText(out, COLOR_CYAN, "Scan time per saved directory (last scan, slowest first):\n");
+        const RootStats** order = (const RootStats**)malloc(g_RootStatsCount * sizeof(RootStats*));
+        if (order == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in StatsReport.\n");
+            exit(1);
+        }
+        for (int i = 0; i < g_RootStatsCount; i++) order[i] = &g_RootStats[i];
+        qsort(order, g_RootStatsCount, sizeof(RootStats*), CompareRootsBySlowest);
+        for (int i = 0; i < g_RootStatsCount; i++) {
+            char last[32], worst[32];
+            FormatDuration(last, sizeof(last), order[i]->lastSeconds * 1e9);
+            FormatDuration(worst, sizeof(worst), order[i]->maxSeconds * 1e9);
+            snprintf(line, sizeof(line), "  %10s (max %s, %lld scans, %lld dirs, %lld files)  %s\n", last, worst,
+                     order[i]->scans, order[i]->dirs, order[i]->files, order[i]->path);
+            OutputText(out, NULL, line);
+        }
+        free(order);
+    }
+    pthread_mutex_unlock(&g_StatsLock);
+}
+
+// Prints StatsReport() (the "stats" command)
+void PrintStats(void) {
+    OutputBuffer out;
+    memset(&out, 0, sizeof(out));
+    out.fd = -1;
+    StatsReport(&out);
+    fwrite(out.data, 1, out.used, stdout);
+    free(out.data);
+}
+
+// Writes StatsDump() to 'path' (--stats-file). Returns 0 on failure.
+int WriteStatsFile(const char* path) {
+    OutputBuffer out;
+    memset(&out, 0, sizeof(out));
+    out.fd = -1;
+    StatsDump(&out);
+    FILE* fp = fopen(path, "w");
+    int ok = fp != NULL && fwrite(out.data, 1, out.used, fp) == out.used;
+    if (fp != NULL && fclose(fp) != 0) ok = 0;
+    if (!ok) {
+        char buffer[PATH_MAX + 64];
+        snprintf(buffer, sizeof(buffer), "Warning: Could not write statistics to %s.\n", path);
+        WriteColor(COLOR_YELLOW, buffer);
+    }
+    free(out.data);
+    return ok;
+}
+
+// ====================================================================
+// --- Server Mode (--serve, --client) ---
+// ====================================================================
+
+// Longest request line a client may send
+#define SERVER_MAX_REQUEST 4096
+
+// Most paths a single request may ask for
+#define SERVER_MAX_PICKS 100000
+
+// Filtered selections kept between requests, so asking again with the
+// same filter costs a pick rather than a pass over the index
+#define SERVER_SELECTIONS 8
+
+// A connected client. Requests are lines of text; every reply is a run of
+// lines ended by an empty one.
+typedef struct {
+    int fd;
+    int slot;           // Position in Server.clients
+    int closing;        // The client is done sending; close once the replies are out
+    char request[SERVER_MAX_REQUEST]; // Start of a request line still incomplete
+    size_t requestLen;
+    OutputBuffer reply; // Replies not yet sent (no descriptor, so it grows)
+    size_t sent;        // Bytes of 'reply' already sent
+} ServerClient;
+
+// A selection for one filter a client asked for
+typedef struct {
+    char* key;          // The filter options as the client wrote them, NULL = unused
+    Selection sel;
+    uint64_t lastUse;
+} ServerSelection;
+
+typedef struct {
+    int listenFd;
+    int epollFd;
+    const StringList* roots;
+    ServerClient** clients;
+    int clientCount;
+    int clientCapacity;
+    long long accepted; // Connections since the start
+    long long requests;
+    long long picks;    // Paths sent
+    int64_t startedAt;
+    uint64_t useClock;  // Orders ServerSelection.lastUse
+    ServerSelection selections[SERVER_SELECTIONS];
+} Server;
+
+// Opens the listening socket at 'path'. A socket file left behind by a
+// server that died is taken over; one that still answers is not, and
+// neither is anything at 'path' that is not a socket.
+int ServerListen(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, COLOR_RED "[Server] Socket path too long: %s\n" COLOR_RESET, path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Whatever is at 'path' already: nothing, a server, or a socket nobody
+    // listens on any more
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, COLOR_RED "[Server] %s exists and is not a socket\n" COLOR_RESET, path);
+            return -1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            perror(COLOR_RED "[Server] socket failed" COLOR_RESET);
+            return -1;
+        }
+        int alive = (connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+        int error = alive ? 0 : errno;
+        close(probe);
+        if (alive || error == EAGAIN) {
+            // EAGAIN: a server with a full backlog, but a server
+            fprintf(stderr, COLOR_RED "[Server] Another server is already running on %s\n" COLOR_RESET, path);
+            return -1;
+        }
+        if (error == ECONNREFUSED) {
+            // Left behind by a server that died
+            if (unlink(path) != 0 && errno != ENOENT) {
+                fprintf(stderr, COLOR_RED "[Server] Could not remove the stale socket %s: %s\n" COLOR_RESET, path,
+                        strerror(errno));
+                return -1;
+            }
+        } else if (error != ENOENT) {
+            // Gone meanwhile (ENOENT) is fine; anything else is not ours to judge
+            fprintf(stderr, COLOR_RED "[Server] Could not check %s: %s\n" COLOR_RESET, path, strerror(error));
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        fprintf(stderr, COLOR_RED "[Server] Could not check %s: %s\n" COLOR_RESET, path, strerror(errno));
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror(COLOR_RED "[Server] socket failed" COLOR_RESET);
+        return -1;
+    }
+    // Only our own user may connect
+    mode_t oldMask = umask(077);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(oldMask);
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, COLOR_RED "[Server] Could not listen on %s: %s\n" COLOR_RESET, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sets what the event loop waits for on 'client'
+static void ServerWatchClient(Server* server, ServerClient* client, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = client;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+static void ServerCloseClient(Server* server, ServerClient* client) {
+    close(client->fd); // Also takes it out of the epoll set
+    ServerClient* last = server->clients[--server->clientCount];
+    server->clients[client->slot] = last;
+    last->slot = client->slot;
+    free(client->reply.data);
+    free(client);
+}
+
+// Takes every connection that is waiting
+static void ServerAccept(Server* server) {
+    while (1) {
+        int fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return; // EAGAIN: none left (or out of descriptors for now)
+        if (server->clientCount == server->clientCapacity) {
+            int capacity = server->clientCapacity ? server->clientCapacity * 2 : 16;
+            ServerClient** clients = (ServerClient**)realloc(server->clients, capacity * sizeof(ServerClient*));
+            if (clients == NULL) {
+                WriteColor(COLOR_RED, "Fatal: Out of memory in ServerAccept.\n");
+                exit(1);
+            }
+            server->clients = clients;
+            server->clientCapacity = capacity;
+        }
+        ServerClient* client = (ServerClient*)calloc(1, sizeof(ServerClient));
+        if (client == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ServerAccept.\n");
+            exit(1);
+        }
+        client->fd = fd;
+        client->reply.fd = -1;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        client->slot = server->clientCount;
+        server->clients[server->clientCount++] = client;
+        server->accepted++;
+    }
+}
+
+// Returns the selection for a filter a client asked for, from the cache
+// if the index has not changed since. NULL means every file qualifies.
+// Caller holds g_IndexLock.
+static const Selection* ServerSelectionFor(Server* server, const char* key, const FileFilter* filter) {
+    if (!FilterIsActive(filter)) return NULL;
+    ServerSelection* entry = NULL;
+    ServerSelection* oldest = &server->selections[0];
+    for (int i = 0; i < SERVER_SELECTIONS && entry == NULL; i++) {
+        ServerSelection* candidate = &server->selections[i];
+        if (candidate->key != NULL && strcmp(candidate->key, key) == 0) entry = candidate;
+        if (candidate->lastUse < oldest->lastUse) oldest = candidate;
+    }
+    if (entry == NULL) {
+        entry = oldest;
+        free(entry->key);
+        entry->key = strdup(key);
+        if (entry->key == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in strdup.\n");
+            exit(1);
+        }
+        entry->sel.valid = 0;
+    }
+    if (!SelectionIsCurrent(&entry->sel, &g_Index, filter)) SelectionBuild(&entry->sel, &g_Index, filter);
+    entry->lastUse = ++server->useClock;
+    return &entry->sel;
+}
+
+// Parses the words after "pick": an optional count, "unique", and filter
+// options such as "ext=jpg,png", "min-size=64K" or "newer=7d". The filter
+// options alone are copied to 'key'. Returns NULL, or what is wrong.
+static const char* ServerParsePick(char* args, long long* count, int* unique, FileFilter* filter, char* key, size_t keySize) {
+    size_t keyLen = 0;
+    char* save = NULL;
+    for (char* word = strtok_r(args, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        char* value = strchr(word, '=');
+        if (value == NULL && word[0] >= '0' && word[0] <= '9') {
+            char* end;
+            *count = strtoll(word, &end, 10);
+            if (*end != '\0' || *count < 1) return "bad count";
+            if (*count > SERVER_MAX_PICKS) return "too many picks in one request";
+            continue;
+        }
+        if (value == NULL && strcmp(word, "unique") == 0) {
+            *unique = 1;
+            continue;
+        }
+        if (value == NULL) return "unknown option";
+        keyLen += (size_t)snprintf(key + keyLen, keySize - keyLen, "%s ", word);
+        if (keyLen >= keySize) return "request too long";
+        *value++ = '\0';
+        if (strcmp(word, "ext") == 0) {
+            char* extSave = NULL;
+            for (char* ext = strtok_r(value, ",", &extSave); ext != NULL; ext = strtok_r(NULL, ",", &extSave)) {
+                AddStringToList(&filter->exts, ext);
+            }
+        } else if (strcmp(word, "min-size") == 0 || strcmp(word, "max-size") == 0) {
+            int64_t size = ParseSize(value);
+            if (size < 0) return "bad size";
+            if (word[1] == 'i') {
+                filter->minSize = size;
+            } else {
+                filter->maxSize = size;
+            }
+        } else if (strcmp(word, "newer") == 0 || strcmp(word, "older") == 0) {
+            int64_t age = ParseAge(value);
+            if (age < 0) return "bad age";
+            if (word[0] == 'n') {
+                filter->newerAge = age;
+            } else {
+                filter->olderAge = age;
+            }
+        } else if (strcmp(word, "weight") == 0) {
+            if (strcmp(value, "size") == 0) {
+                filter->weight = WEIGHT_SIZE;
+            } else if (strcmp(value, "recent") == 0) {
+                filter->weight = WEIGHT_RECENT;
+            } else if (strcmp(value, "uniform") == 0) {
+                filter->weight = WEIGHT_UNIFORM;
+            } else {
+                return "unknown weight";
+            }
+        } else {
+            return "unknown option";
+        }
+    }
+    return NULL;
+}
+
+// Answers "pick [N] [unique] [filter options]". Without filter options the
+// filters given on the server's command line apply.
+static void ServerPick(Server* server, ServerClient* client, char* args) {
+    long long count = 1;
+    int unique = 0;
+    FileFilter filter = {-1, -1, -1, -1, {0}, WEIGHT_UNIFORM};
+    char key[SERVER_MAX_REQUEST];
+    key[0] = '\0';
+    const char* error = ServerParsePick(args, &count, &unique, &filter, key, sizeof(key));
+    const FileFilter* active = (key[0] != '\0') ? &filter : &g_Filter;
+    if (error == NULL && unique && active->weight != WEIGHT_UNIFORM) error = "unique can't be combined with a weight";
+    if (error == NULL && g_TreeSampler && (unique || FilterIsActive(active))) error = "the tree sampler can't filter";
+    if (error != NULL) {
+        OutputText(&client->reply, NULL, "error: ");
+        OutputText(&client->reply, NULL, error);
+        OutputText(&client->reply, NULL, "\n\n");
+        FreeStringList(&filter.exts);
+        return;
+    }
+
+    int64_t startNs = MonotonicNs();
+    pthread_mutex_lock(&g_IndexLock);
+    // As at the prompt, trees the watcher does not keep current are read
+    // again, but in the background: this pick comes from the index as it
+    // is, and those after the scan from the new one
+    int stale = IndexIsStale(&g_Index, server->roots);
+    const Selection* sel = (key[0] != '\0') ? ServerSelectionFor(server, key, &filter)
+                         : FilterIsActive(&g_Filter) ? IndexSelection(&g_Index) : NULL;
+    long long written = OutputRandomPaths(&client->reply, &g_Index, sel, count, unique, '\n');
+    int haveFiles = g_Index.treeMode ? g_Index.treeTop.total > 0 : g_Index.store.fileCount > 0;
+    pthread_mutex_unlock(&g_IndexLock);
+    StatPickLatency(MonotonicNs() - startNs);
+    FreeStringList(&filter.exts);
+    if (stale) StartBackgroundScan(server->roots, 0);
+
+    if (written == 0) {
+        OutputText(&client->reply, NULL, haveFiles ? "error: no file matches the filters\n" : "error: no files indexed\n");
+    }
+    OutputText(&client->reply, NULL, "\n");
+    server->picks += written;
+}
+
+// Answers "stats" with a "name value" line per figure
+static void ServerStats(Server* server, ServerClient* client) {
+    pthread_mutex_lock(&g_IndexLock);
+    long long files = g_Index.treeMode ? g_Index.treeTop.total : g_Index.store.fileCount;
+    long long dirs = g_Index.store.dirCount;
+    long long roots = g_Index.roots.count;
+    unsigned long long generation = (unsigned long long)g_Index.generation;
+    pthread_mutex_unlock(&g_IndexLock);
+
+    char text[1024];
+    snprintf(text, sizeof(text),
+             "files %lld\ndirectories %lld\nroots %lld\nwatching %s\ngeneration %llu\n"
+             "clients %d\nconnections %lld\nrequests %lld\npicks %lld\nuptime %lld\n",
+             files, dirs, roots, atomic_load(&g_WatcherReady) ? "yes" : "no", generation,
+             server->clientCount, server->accepted, server->requests, server->picks,
+             (long long)((int64_t)time(NULL) - server->startedAt));
+    OutputText(&client->reply, NULL, text);
+    // Then the counters of every thread (see StatsDump)
+    StatsDump(&client->reply);
+    OutputText(&client->reply, NULL, "\n");
+}
+
+// Answers one request line
+static void ServerHandleRequest(Server* server, ServerClient* client, char* line) {
+    server->requests++;
+    char* args = line + strcspn(line, " \t");
+    if (*args != '\0') *args++ = '\0';
+    if (strcmp(line, "pick") == 0) {
+        ServerPick(server, client, args);
+    } else if (strcmp(line, "stats") == 0) {
+        ServerStats(server, client);
+    } else {
+        OutputText(&client->reply, NULL, "error: unknown request (use pick or stats)\n\n");
+    }
+}
+
+// Sends as much of the pending replies as the socket takes, then waits
+// for more requests, for room to send the rest, or closes the connection.
+// Returns 0 if the client was closed.
+static int ServerSend(Server* server, ServerClient* client) {
+    OutputBuffer* reply = &client->reply;
+    while (client->sent < reply->used) {
+        ssize_t n = send(client->fd, reply->data + client->sent, reply->used - client->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // No more requests are read until the client catches up
+            ServerWatchClient(server, client, EPOLLOUT);
+            return 1;
+        }
+        if (n < 0) {
+            ServerCloseClient(server, client);
+            return 0;
+        }
+        client->sent += (size_t)n;
+    }
+    reply->used = 0;
+    client->sent = 0;
+    // One huge reply doesn't keep its memory for good
+    if (reply->capacity > BATCH_BUF_SIZE) {
+        free(reply->data);
+        reply->data = NULL;
+        reply->capacity = 0;
+    }
+    if (client->closing) {
+        ServerCloseClient(server, client);
+        return 0;
+    }
+    ServerWatchClient(server, client, EPOLLIN);
+    return 1;
+}
+
+// Reads what the client sent and answers every complete request in it
+static void ServerReceive(Server* server, ServerClient* client) {
+    ssize_t n = recv(client->fd, client->request + client->requestLen, sizeof(client->request) - client->requestLen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        // The client is done (or gone): finish the replies, then close
+        client->closing = 1;
+        ServerSend(server, client);
+        return;
+    }
+    client->requestLen += (size_t)n;
+
+    size_t start = 0;
+    char* newline;
+    while ((newline = memchr(client->request + start, '\n', client->requestLen - start)) != NULL) {
+        *newline = '\0';
+        char* line = client->request + start;
+        line[strcspn(line, "\r")] = '\0';
+        start = (size_t)(newline - client->request) + 1;
+        ServerHandleRequest(server, client, line);
+    }
+    memmove(client->request, client->request + start, client->requestLen - start);
+    client->requestLen -= start;
+    if (client->requestLen == sizeof(client->request)) {
+        OutputText(&client->reply, NULL, "error: request too long\n\n");
+        client->requestLen = 0;
+        client->closing = 1;
+    }
+    ServerSend(server, client);
+}
+
+// Runs the server until g_running is cleared: one thread and one epoll
+// loop serve every client from the shared index, which the watcher thread
+// keeps current meanwhile. 'listenFd' comes from ServerListen() and is
+// closed, and its socket file removed, on the way out.
+void RunServer(int listenFd, const char* socketPath, const StringList* roots) {
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.roots = roots;
+    server.startedAt = (int64_t)time(NULL);
+    server.listenFd = listenFd;
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollFd < 0) {
+        perror(COLOR_RED "[Server] Failed to create epoll instance" COLOR_RESET);
+        close(listenFd);
+        unlink(socketPath);
+        return;
+    }
+
+    // The listening socket is tagged NULL, the wake-up eventfd by its address
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &ev);
+    ev.data.ptr = &g_WakeFd;
+    epoll_ctl(server.epollFd, EPOLL_CTL_ADD, g_WakeFd, &ev);
+
+    char buffer[PATH_MAX + 64];
+    snprintf(buffer, sizeof(buffer), "[Server] Listening on %s\n", socketPath);
+    WriteColor(COLOR_GREEN, buffer);
+    fflush(stdout);
+
+    while (g_running) {
+        struct epoll_event ready[64];
+        int n = epoll_wait(server.epollFd, ready, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(COLOR_RED "[Server] epoll_wait error" COLOR_RESET);
+            break;
+        }
+        for (int r = 0; r < n; r++) {
+            void* tag = ready[r].data.ptr;
+            if (tag == NULL) {
+                ServerAccept(&server);
+            } else if (tag != &g_WakeFd) {
+                ServerClient* client = (ServerClient*)tag;
+                if (ready[r].events & EPOLLERR) {
+                    ServerCloseClient(&server, client);
+                } else if (ready[r].events & EPOLLOUT) {
+                    ServerSend(&server, client);
+                } else {
+                    ServerReceive(&server, client); // Also sees the hang-up
+                }
+            }
+            // Woken up: g_running tells us why
+        }
+    }
+
+    while (server.clientCount > 0) ServerCloseClient(&server, server.clients[0]);
+    free(server.clients);
+    for (int i = 0; i < SERVER_SELECTIONS; i++) {
+        free(server.selections[i].key);
+        free(server.selections[i].sel.slots);
+        free(server.selections[i].sel.keep);
+        free(server.selections[i].sel.alias);
+    }
+    close(server.listenFd);
+    close(server.epollFd);
+    unlink(socketPath);
+}
+
+// Sends one request to a running server and prints the reply, each line
+// ended by 'terminator'. Returns the exit status.
+int RunClient(const char* socketPath, const char* request, char terminator) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to %s: %s. Is a server running (--serve)?\n", socketPath, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // One line out, then nothing more, so the server may close once it is done
+    size_t length = strlen(request);
+    size_t done = 0;
+    while (done <= length) {
+        const char* data = (done < length) ? request + done : "\n";
+        size_t size = (done < length) ? length - done : 1;
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Could not send the request");
+            close(fd);
+            return 1;
+        }
+        done += (size_t)n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // The reply ends with an empty line; an error reply starts with "error: "
+    FILE* stream = fdopen(fd, "r");
+    if (stream == NULL) {
+        close(fd);
+        return 1;
+    }
+    int status = 1; // Until the reply is complete
+    int first = 1;
+    char* line = NULL;
+    size_t lineSize = 0;
+    ssize_t lineLen;
+    while ((lineLen = getline(&line, &lineSize, stream)) > 0) {
+        if (line[lineLen - 1] == '\n') line[--lineLen] = '\0';
+        if (lineLen == 0) {
+            if (status == 1 && !first) status = 0;
+            break;
+        }
+        if (first && strncmp(line, "error: ", 7) == 0) {
+            fprintf(stderr, "%s\n", line + 7);
+            status = 2; // Complete, but an error
+        } else if (status == 1) {
+            fwrite(line, 1, (size_t)lineLen, stdout);
+            putchar(terminator);
+        }
+        first = 0;
+    }
+    free(line);
+    fclose(stream);
+    return (status == 0) ? 0 : 1;
+}
+
+// ====================================================================
+// --- File Watcher Thread ---
+// ====================================================================
+
+// A MOVED_FROM event still waiting for the MOVED_TO with the same cookie
+typedef struct {
+    uint32_t cookie;
+    int isDir;
+    char* root;         // The watched root the entry was moved out of
+    char* path;         // Full path the entry had before the move
+} PendingMove;
+
+#define MAX_PENDING_MOVES 64
+
+// How long a MOVED_FROM waits for its MOVED_TO before it counts as a delete
+#define MOVE_PAIR_TIMEOUT_MS 10
+
+// Returns non-zero if the index was built from 'root'. Caller holds g_IndexLock.
+static int IndexCoversRoot(const FileIndex* index, const char* root) {
+    return index->built && StringListContains(&index->roots, root);
+}
+
+// --- Tree sampler counts ---
+// The tree sampler keeps a count per directory rather than names, so file
+// events are not applied one by one: the directories they touched are
+// counted again from the disk once per batch of events. Only the watcher
+// thread touches the list.
+static StringList g_TreeDirtyDirs = {0};
+static StringList g_TreeDirtyRoots = {0}; // The saved directory of each
+
+// Sets the count of 'dirPath' below 'root' to what is on disk. The
+// directory is read without holding the index lock.
+static void TreeRecountDir(const char* root, const char* dirPath) {
+    int64_t count = TreeCountFiles(dirPath, strlen(root));
+    pthread_mutex_lock(&g_IndexLock);
+    if (IndexCoversRoot(&g_Index, root)) IndexSetDirFiles(&g_Index, dirPath, (count > 0) ? count : 0);
+    pthread_mutex_unlock(&g_IndexLock);
+}
+
+// Notes that a file came or went in the directory holding 'path'
+static void TreeMarkDirty(const char* root, const char* path) {
+    char dirPath[PATH_MAX];
+    if (SplitPath(path, dirPath, sizeof(dirPath)) == NULL) return;
+    if (g_ReleasingHeld) {
+        TreeRecountDir(root, dirPath); // Replayed by the scan thread, not batched
+        return;
+    }
+    if (StringListContains(&g_TreeDirtyDirs, dirPath)) return;
+    AddStringToList(&g_TreeDirtyDirs, dirPath);
+    AddStringToList(&g_TreeDirtyRoots, root);
+}
+
+// Counts every directory noted since the last call again
+static void TreeRecountDirty(void) {
+    if (g_TreeDirtyDirs.count == 0) return;
+    for (int i = 0; i < g_TreeDirtyDirs.count; i++) {
+        TreeRecountDir(g_TreeDirtyRoots.items[i], g_TreeDirtyDirs.items[i]);
+    }
+    FreeStringList(&g_TreeDirtyDirs);
+    FreeStringList(&g_TreeDirtyRoots);
+}
+
+// Brings a file or directory that appeared below 'root' into the index
+static void ApplyCreate(const char* root, const char* path, int isDir) {
+    if (HoldEvent(HELD_CREATE, root, path, isDir)) return;
+    if (!isDir && g_TreeSampler) {
+        TreeMarkDirty(root, path); // It may replace a file, or not be one
+        return;
+    }
+    if (!isDir) {
+        // Only regular files are indexed, with their size and age
+        struct stat st;
+        if (StatEntry(path, &st) != 0 || !S_ISREG(st.st_mode)) return;
+        pthread_mutex_lock(&g_IndexLock);
+        // With --dedupe-hardlinks a new name of a file with several is
+        // taken for one of a file indexed already
+        int otherName = g_DedupeHardlinks && st.st_nlink > 1 && IndexFindFile(&g_Index, path) == -1;
+        if (IndexCoversRoot(&g_Index, root) && !otherName) IndexAddFile(&g_Index, path, &st);
+        pthread_mutex_unlock(&g_IndexLock);
+        return;
+    }
+    // A directory may arrive with content (e.g. moved in), so scan it
+    // without holding the lock and merge the result afterwards
+    PathStore found;
+    InitPathStore(&found);
+    ScanDirectory(path, strlen(root), &found);
+    pthread_mutex_lock(&g_IndexLock);
+    if (IndexCoversRoot(&g_Index, root)) IndexAddScan(&g_Index, &found);
+    pthread_mutex_unlock(&g_IndexLock);
+    FreePathStore(&found);
+}
+
+// Drops a file or a whole directory that disappeared below 'root'
+static void ApplyDelete(const char* root, const char* path, int isDir) {
+    if (HoldEvent(HELD_DELETE, root, path, isDir)) return;
+    if (!isDir && g_TreeSampler) {
+        TreeMarkDirty(root, path); // It may not have been a regular file
+        return;
+    }
+    pthread_mutex_lock(&g_IndexLock);
+    if (IndexCoversRoot(&g_Index, root)) {
+        if (isDir) {
+            IndexRemoveTree(&g_Index, path);
+        } else {
+            IndexRemoveFile(&g_Index, path);
+        }
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+}
+
+// Applies a move whose MOVED_FROM and MOVED_TO halves were both seen
+static void ApplyRename(const PendingMove* from, const char* newRoot, const char* newPath) {
+    if (HoldEvent(HELD_DELETE, from->root, from->path, from->isDir)) {
+        ApplyCreate(newRoot, newPath, from->isDir); // Held as well, unless the backlog just ran out
+        return;
+    }
+    if (!from->isDir && g_TreeSampler) {
+        // The file may land on another one
+        TreeMarkDirty(from->root, from->path);
+        TreeMarkDirty(newRoot, newPath);
+        return;
+    }
+    pthread_mutex_lock(&g_IndexLock);
+    int oldCovered = IndexCoversRoot(&g_Index, from->root);
+    int newCovered = IndexCoversRoot(&g_Index, newRoot);
+    if (oldCovered && newCovered) {
+        if (from->isDir) {
+            IndexRenameTree(&g_Index, from->path, newPath);
+        } else {
+            IndexRenameFile(&g_Index, from->path, newPath);
+        }
+        pthread_mutex_unlock(&g_IndexLock);
+        return;
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+
+    // Moved between an indexed root and one we do not index
+    if (oldCovered) ApplyDelete(from->root, from->path, from->isDir);
+    if (newCovered) ApplyCreate(newRoot, newPath, from->isDir);
+}
+
+// --- Watch descriptors ---
+// Every directory below the saved ones gets its own inotify watch. Their
+// descriptors are mapped back to the directory in an open-addressing hash
+// table that grows with the tree, so the only limit is the kernel's
+// max_user_watches. Only the watcher thread touches it.
+
+// Events asked for on every directory: entries coming and going, writes
+// and attribute changes that alter a file's size or age, and the
+// directory itself disappearing. Symlinks to directories are not followed.
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+// A watched directory
+typedef struct {
+    int wd;             // Watch descriptor, -1 for an empty bucket
+    char* path;         // Full path of the directory
+    const char* root;   // The saved directory it lies under
+    uint64_t dev;       // Device key and inode of the directory (see WatchInode)
+    uint64_t ino;
+} WatchEntry;
+
+// A watched directory by (device, inode). With --follow-symlinks this
+// tells whether a link leads to a directory watched already, without
+// asking the kernel for a watch just to find out.
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;       // 0 = empty bucket
+    int wd;
+} WatchInode;
+
+typedef struct {
+    int fd;             // The inotify instance
+    WatchEntry* buckets;
+    int capacity;       // Power of two
+    int count;
+    WatchInode* inodes; // Open addressing as well, --follow-symlinks only
+    int inodeCapacity;  // Power of two, or 0
+    int inodeCount;
+} WatchMap;
+
+static WatchMap g_Watches = {-1, NULL, 0, 0, NULL, 0, 0};
+
+// Returns the bucket holding 'wd', or the empty bucket where it belongs
+static int WatchMapProbe(int wd) {
+    int mask = g_Watches.capacity - 1;
+    int b = (int)(((uint32_t)wd * 0x9E3779B9u) >> 7) & mask;
+    while (g_Watches.buckets[b].wd != -1 && g_Watches.buckets[b].wd != wd) b = (b + 1) & mask;
+    return b;
+}
+
+// Returns the directory watched by 'wd', or NULL
+static WatchEntry* WatchMapFind(int wd) {
+    if (g_Watches.count == 0) return NULL;
+    WatchEntry* entry = &g_Watches.buckets[WatchMapProbe(wd)];
+    return (entry->wd == -1) ? NULL : entry;
+}
+
+// Records that 'wd' watches 'path' (which the map takes over)
+static void WatchMapPut(int wd, char* path, const char* root) {
+    // Keep the load factor under 3/4
+    if ((g_Watches.count + 1) * 4 > g_Watches.capacity * 3) {
+        WatchEntry* old = g_Watches.buckets;
+        int oldCapacity = g_Watches.capacity;
+        g_Watches.capacity = (oldCapacity == 0) ? 64 : oldCapacity * 2;
+        g_Watches.buckets = (WatchEntry*)malloc(g_Watches.capacity * sizeof(WatchEntry));
+        if (g_Watches.buckets == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in WatchMapPut.\n");
+            exit(1);
+        }
+        for (int b = 0; b < g_Watches.capacity; b++) g_Watches.buckets[b].wd = -1;
+        for (int b = 0; b < oldCapacity; b++) {
+            if (old[b].wd != -1) g_Watches.buckets[WatchMapProbe(old[b].wd)] = old[b];
+        }
+        free(old);
+    }
+    WatchEntry* entry = &g_Watches.buckets[WatchMapProbe(wd)];
+    if (entry->wd == -1) {
+        g_Watches.count++;
+        entry->dev = entry->ino = 0;
+    } else {
+        free(entry->path); // Watched again (e.g. after an overflow); same directory
+    }
+    entry->wd = wd;
+    entry->path = path;
+    entry->root = root;
+}
+
+static inline int WatchInodeHome(uint64_t dev, uint64_t ino, int mask) {
+    uint64_t hash = (ino ^ dev * 0x9E3779B97F4A7C15ull) * 0xBF58476D1CE4E5B9ull;
+    return (int)((hash ^ (hash >> 31)) & (uint64_t)mask);
+}
+
+// Returns the bucket holding (dev, ino), or the empty bucket where it belongs
+static int WatchInodeProbe(uint64_t dev, uint64_t ino) {
+    int mask = g_Watches.inodeCapacity - 1;
+    int b = WatchInodeHome(dev, ino, mask);
+    while (g_Watches.inodes[b].ino != 0 && (g_Watches.inodes[b].ino != ino || g_Watches.inodes[b].dev != dev)) {
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+// Returns the watch on directory (dev, ino), or -1 if it is not watched
+static int WatchInodeFind(uint64_t dev, uint64_t ino) {
+    if (g_Watches.inodeCount == 0) return -1;
+    const WatchInode* slot = &g_Watches.inodes[WatchInodeProbe(dev, ino)];
+    return (slot->ino == 0) ? -1 : slot->wd;
+}
+
+// Records which directory 'wd' watches
+static void WatchInodeAdd(int wd, uint64_t dev, uint64_t ino) {
+    WatchEntry* entry = WatchMapFind(wd);
+    if (entry == NULL || ino == 0 || entry->ino != 0) return;
+    if ((g_Watches.inodeCount + 1) * 4 > g_Watches.inodeCapacity * 3) {
+        WatchInode* old = g_Watches.inodes;
+        int oldCapacity = g_Watches.inodeCapacity;
+        g_Watches.inodeCapacity = (oldCapacity == 0) ? 64 : oldCapacity * 2;
+        g_Watches.inodes = (WatchInode*)calloc(g_Watches.inodeCapacity, sizeof(WatchInode));
+        if (g_Watches.inodes == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in WatchInodeAdd.\n");
+            exit(1);
+        }
+        for (int b = 0; b < oldCapacity; b++) {
+            if (old[b].ino != 0) g_Watches.inodes[WatchInodeProbe(old[b].dev, old[b].ino)] = old[b];
+        }
+        free(old);
+    }
+    WatchInode* slot = &g_Watches.inodes[WatchInodeProbe(dev, ino)];
+    if (slot->ino == 0) g_Watches.inodeCount++;
+    slot->dev = dev;
+    slot->ino = ino;
+    slot->wd = wd;
+    entry->dev = dev;
+    entry->ino = ino;
+}
+
+// Forgets directory (dev, ino), shifting its probe run back like WatchMapRemove
+static void WatchInodeRemove(uint64_t dev, uint64_t ino) {
+    if (g_Watches.inodeCount == 0) return;
+    int b = WatchInodeProbe(dev, ino);
+    if (g_Watches.inodes[b].ino == 0) return;
+    g_Watches.inodeCount--;
+    int mask = g_Watches.inodeCapacity - 1;
+    int hole = b;
+    for (int next = (hole + 1) & mask; g_Watches.inodes[next].ino != 0; next = (next + 1) & mask) {
+        int home = WatchInodeHome(g_Watches.inodes[next].dev, g_Watches.inodes[next].ino, mask);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            g_Watches.inodes[hole] = g_Watches.inodes[next];
+            hole = next;
+        }
+    }
+    g_Watches.inodes[hole].ino = 0;
+}
+
+// Forgets 'wd'. Later entries of its probe run are shifted back so no
+// tombstones are needed.
+static void WatchMapRemove(int wd) {
+    if (g_Watches.count == 0) return;
+    int b = WatchMapProbe(wd);
+    if (g_Watches.buckets[b].wd == -1) return;
+    free(g_Watches.buckets[b].path);
+    if (g_Watches.buckets[b].ino != 0) WatchInodeRemove(g_Watches.buckets[b].dev, g_Watches.buckets[b].ino);
+    g_Watches.count--;
+    int mask = g_Watches.capacity - 1;
+    int hole = b;
+    for (int next = (hole + 1) & mask; g_Watches.buckets[next].wd != -1; next = (next + 1) & mask) {
+        int home = (int)(((uint32_t)g_Watches.buckets[next].wd * 0x9E3779B9u) >> 7) & mask;
+        // Move it into the hole unless its home lies cyclically in (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            g_Watches.buckets[hole] = g_Watches.buckets[next];
+            hole = next;
+        }
+    }
+    g_Watches.buckets[hole].wd = -1;
+}
+
+// Releases the map (the watches go with the inotify descriptor)
+static void WatchMapFree(void) {
+    for (int b = 0; b < g_Watches.capacity; b++) {
+        if (g_Watches.buckets[b].wd != -1) free(g_Watches.buckets[b].path);
+    }
+    free(g_Watches.buckets);
+    g_Watches.buckets = NULL;
+    g_Watches.capacity = 0;
+    g_Watches.count = 0;
+    free(g_Watches.inodes);
+    g_Watches.inodes = NULL;
+    g_Watches.inodeCapacity = 0;
+    g_Watches.inodeCount = 0;
+}
+
+// Watches 'path' and every directory below it that is not excluded.
+// Returns 0 if some of them could not be watched.
+static int WatchTree(const char* root, const char* path) {
+    static int warnedLimit = 0;
+    size_t rootLen = strlen(root);
+    int complete = 1;
+    StringList stack;
+    InitStringList(&stack);
+    AddStringToList(&stack, path);
+    while (stack.count > 0) {
+        char* dir = stack.items[--stack.count];
+        // Following links, watch what they point to rather than the link
+        int wd = inotify_add_watch(g_Watches.fd, dir, WATCH_MASK & ~(g_FollowSymlinks ? IN_DONT_FOLLOW : 0));
+        if (wd < 0) {
+            // A directory that vanished meanwhile is no loss
+            if (errno != ENOENT && errno != ENOTDIR) complete = 0;
+            if (errno == ENOSPC && !warnedLimit) {
+                WriteColor(COLOR_YELLOW, "[Watcher] Out of inotify watches. Raise /proc/sys/fs/inotify/max_user_watches "
+                                         "to see changes everywhere.\n");
+                warnedLimit = 1;
+            }
+            free(dir);
+            continue;
+        }
+        if (WatchMapFind(wd) != NULL) {
+            // Already watched under another path (a link, or a cycle)
+            free(dir);
+            continue;
+        }
+        WatchMapPut(wd, dir, root);
+
+        // Watched first, listed second: a subdirectory created in between
+        // shows up either here or as an event
+        DIR* handle = opendir(dir);
+        if (handle == NULL) continue;
+        struct stat dirSt;
+        if (g_FollowSymlinks && fstat(dirfd(handle), &dirSt) == 0) {
+            WatchInodeAdd(wd, StatDeviceKey(&dirSt), (uint64_t)dirSt.st_ino);
+        }
+        struct dirent* entry;
+        while ((entry = readdir(handle)) != NULL) {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            char child[PATH_MAX];
+            if (snprintf(child, sizeof(child), "%s/%s", dir, name) >= (int)sizeof(child)) continue;
+            int type = g_IgnoreDType ? DT_UNKNOWN : entry->d_type;
+            int isDir = (type == DT_DIR);
+            int isLink = (type == DT_LNK);
+            struct stat st;
+            if (type == DT_UNKNOWN) StatAdd(STAT_STAT_FALLBACKS, 1);
+            if (type == DT_UNKNOWN && lstat(child, &st) == 0) {
+                isDir = S_ISDIR(st.st_mode);
+                isLink = S_ISLNK(st.st_mode);
+            }
+            if (isLink && g_FollowSymlinks) {
+                // Links into the saved trees are not followed, as in the scanner
+                isDir = (stat(child, &st) == 0 && S_ISDIR(st.st_mode) && !LinkLeadsIntoRoots(child));
+            }
+            if (isDir && !IsPathExcluded(child, rootLen, 1)) AddStringToList(&stack, child);
+        }
+        closedir(handle);
+    }
+    FreeStringList(&stack);
+    return complete;
+}
+
+// Points the watches of 'oldPath' and everything below it at 'newPath'
+// after a rename; the kernel keeps the watches themselves
+static void WatchMoveTree(const char* oldPath, const char* newPath, const char* root) {
+    size_t oldLen = strlen(oldPath);
+    for (int b = 0; b < g_Watches.capacity; b++) {
+        WatchEntry* entry = &g_Watches.buckets[b];
+        if (entry->wd == -1 || !IsPathAtOrUnder(entry->path, oldPath)) continue;
+        char moved[PATH_MAX];
+        if (snprintf(moved, sizeof(moved), "%s%s", newPath, entry->path + oldLen) >= (int)sizeof(moved)) continue;
+        char* copy = strdup(moved);
+        if (copy == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in strdup.\n");
+            exit(1);
+        }
+        free(entry->path);
+        entry->path = copy;
+        entry->root = root;
+    }
+}
+
+// Stops watching 'path' and everything below it (it left our directories)
+static void WatchForgetTree(const char* path) {
+    int* doomed = (int*)malloc((g_Watches.count + 1) * sizeof(int));
+    if (doomed == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in WatchForgetTree.\n");
+        exit(1);
+    }
+    int count = 0;
+    for (int b = 0; b < g_Watches.capacity; b++) {
+        if (g_Watches.buckets[b].wd != -1 && IsPathAtOrUnder(g_Watches.buckets[b].path, path)) {
+            doomed[count++] = g_Watches.buckets[b].wd;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        inotify_rm_watch(g_Watches.fd, doomed[i]);
+        WatchMapRemove(doomed[i]);
+    }
+    free(doomed);
+}
+
+// Treats every unpaired MOVED_FROM as a deletion: the entry left the
+// watched directories
+static void FlushPendingMoves(PendingMove* pending, int* pendingCount) {
+    for (int i = 0; i < *pendingCount; i++) {
+        if (pending[i].isDir) WatchForgetTree(pending[i].path);
+        ApplyDelete(pending[i].root, pending[i].path, pending[i].isDir);
+        free(pending[i].path);
+    }
+    *pendingCount = 0;
+}
+
+// With --follow-symlinks, tells whether an event without IN_ISDIR is
+// about a link standing for a directory: by what it points to when it
+// arrives, by what the index holds at 'path' when it leaves. Links into
+// the saved trees are never taken for directories, as in the scanner.
+static int LinkIsDir(const char* path, uint32_t mask) {
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        struct stat st;
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode) && !LinkLeadsIntoRoots(path);
+    }
+    if (!(mask & (IN_DELETE | IN_MOVED_FROM))) return 0;
+    pthread_mutex_lock(&g_IndexLock);
+    int dir = g_Index.built ? IndexWalkDirPath(&g_Index, path, 0) : -1;
+    pthread_mutex_unlock(&g_IndexLock);
+    return dir != -1;
+}
+
+// Returns non-zero if the directory 'path' leads to is watched already,
+// under whatever path. 'st' receives what stat() says about it.
+static int IsWatchedDir(const char* path, struct stat* st) {
+    return stat(path, st) == 0 && WatchInodeFind(StatDeviceKey(st), (uint64_t)st->st_ino) != -1;
+}
+
+// Records the link 'path' to a directory read along another path, the
+// way the scanner does (DIR_MTIME_ALIAS), so it can take over should
+// that path go away (see RemoveLinkedDir)
+static void IndexAddAlias(const char* root, const char* path, const struct stat* st) {
+    pthread_mutex_lock(&g_IndexLock);
+    int dir = IndexCoversRoot(&g_Index, root) ? IndexWalkDirPath(&g_Index, path, 1) : -1;
+    if (dir != -1) {
+        g_Index.store.dirs[dir].mtime = DIR_MTIME_ALIAS;
+        g_Index.store.dirs[dir].ino = (uint64_t)st->st_ino;
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+}
+
+// Returns the watched root 'path' lies in (the longest one), or NULL
+static const char* WatchedRootOf(const StringList* roots, const char* path) {
+    const char* best = NULL;
+    for (int i = 0; i < roots->count; i++) {
+        if (IsPathAtOrUnder(path, roots->items[i]) && (best == NULL || strlen(roots->items[i]) > strlen(best))) {
+            best = roots->items[i];
+        }
+    }
+    return best;
+}
+
+// A link standing for a directory was deleted (--follow-symlinks). The
+// directory stays; only what the watches and the index knew through the
+// link goes. If the link was the path the directory was watched along,
+// another path to it the index knows (a recorded alias, or the path the
+// scanner happened to read it along) takes over, and only that one tree
+// is watched and scanned again.
+static void RemoveLinkedDir(const StringList* roots, const char* root, const char* path) {
+    // What the link led to, as its watch knew it
+    uint64_t dev = 0, ino = 0;
+    for (int b = 0; b < g_Watches.capacity; b++) {
+        if (g_Watches.buckets[b].wd != -1 && strcmp(g_Watches.buckets[b].path, path) == 0) {
+            dev = g_Watches.buckets[b].dev;
+            ino = g_Watches.buckets[b].ino;
+            break;
+        }
+    }
+    WatchForgetTree(path);
+    ApplyDelete(root, path, 1);
+    if (ino == 0 || WatchInodeFind(dev, ino) != -1) return; // An alias itself, or watched elsewhere too
+
+    // Other paths to the same directory, of which the first still there wins
+    StringList aliases;
+    InitStringList(&aliases);
+    pthread_mutex_lock(&g_IndexLock);
+    for (int d = 0; d < g_Index.store.dirCount && g_Index.built; d++) {
+        const DirNode* node = &g_Index.store.dirs[d];
+        char aliasPath[PATH_MAX];
+        if (node->ino == ino && node->parent != DIR_DETACHED &&
+            StoreDirPath(&g_Index.store, d, aliasPath, sizeof(aliasPath)) >= 0) {
+            AddStringToList(&aliases, aliasPath);
+        }
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+    for (int i = 0; i < aliases.count; i++) {
+        struct stat st;
+        const char* aliasRoot = WatchedRootOf(roots, aliases.items[i]);
+        if (aliasRoot == NULL || stat(aliases.items[i], &st) != 0 || !S_ISDIR(st.st_mode) ||
+            StatDeviceKey(&st) != dev || (uint64_t)st.st_ino != ino) {
+            continue;
+        }
+        WatchTree(aliasRoot, aliases.items[i]);
+        ApplyCreate(aliasRoot, aliases.items[i], 1);
+        break;
+    }
+    FreeStringList(&aliases);
+}
+
+// Replaces everything the index holds below 'root' with a fresh scan
+static void RescanRoot(const char* root) {
+    if (HoldEvent(HELD_RESCAN, root, root, 1)) return;
+    PathStore found;
+    InitPathStore(&found);
+    ScanDirectory(root, strlen(root), &found);
+    pthread_mutex_lock(&g_IndexLock);
+    if (IndexCoversRoot(&g_Index, root)) {
+        IndexRemoveTree(&g_Index, root);
+        IndexAddScan(&g_Index, &found);
+    }
+    pthread_mutex_unlock(&g_IndexLock);
+    FreePathStore(&found);
+}
+
+// Applies the changes held back while the first scan ran (see HoldEvent),
+// oldest first, and stops holding once none are left. Changes that come
+// in meanwhile join the end of the queue. On the way out they are dropped.
+static void ReleaseHeldEvents(void) {
+    g_ReleasingHeld = 1;
+    for (;;) {
+        pthread_mutex_lock(&g_HeldLock);
+        if (g_HeldNext == g_HeldCount) {
+            free(g_Held);
+            g_Held = NULL;
+            g_HeldCount = g_HeldNext = g_HeldCapacity = 0;
+            atomic_store(&g_HoldEvents, 0);
+            pthread_mutex_unlock(&g_HeldLock);
+            break;
+        }
+        HeldEvent event = g_Held[g_HeldNext++];
+        pthread_mutex_unlock(&g_HeldLock);
+        if (g_running && event.op == HELD_CREATE) {
+            ApplyCreate(event.root, event.path, event.isDir);
+        } else if (g_running && event.op == HELD_DELETE) {
+            ApplyDelete(event.root, event.path, event.isDir);
+        } else if (g_running) {
+            RescanRoot(event.root);
+        }
+        free(event.root);
+        free(event.path);
+    }
+    g_ReleasingHeld = 0;
+}
+
+// Recovers from a lost event queue by rescanning the watched roots only
+static void RescanWatchedRoots(void) {
+    WriteColor(COLOR_YELLOW, "[Watcher] Event queue overflowed. Rescanning watched directories.\n");
+    for (int i = 0; i < g_WatchedRoots.count; i++) {
+        RescanRoot(g_WatchedRoots.items[i]);
+    }
+}
+
+// --- Watcher output ---
+// A mass change (an untar, an rsync) fires an event per file. Printing each
+// one would make the terminal the bottleneck and let the inotify queue
+// overflow, so events are collected over a short window and written out
+// in one go: line by line while there are few, as totals when many.
+
+// Events are reported in windows of this length
+#define REPORT_WINDOW_MS 250
+
+// With VERBOSITY_SUMMARY, a window with more file events than this is
+// reported as totals per root instead of line by line
+#define REPORT_DETAIL_LIMIT 20
+
+// File events seen below one root during the current window
+typedef struct {
+    const char* root;
+    long long created;
+    long long deleted;
+    long long renamed;
+} ReportTally;
+
+typedef struct {
+    OutputBuffer out;           // Lines for the current window
+    int lines;                  // File events seen in the window
+    int64_t windowStart;        // When its first event arrived (ms), 0 = no open window
+    ReportTally* tallies;
+    int tallyCount;
+    int tallyCapacity;
+} WatchReport;
+
+// Milliseconds on a clock that never jumps
+static int64_t MonotonicMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Milliseconds until 'deadline', as an epoll_wait() timeout
+static int TimeLeft(int64_t deadline, int64_t now) {
+    int64_t left = deadline - now;
+    if (left < 0) return 0;
+    return (left > INT_MAX) ? INT_MAX : (int)left;
+}
+
+// Writes 'n' with thousands separators ("12,340")
+static void FormatCount(long long n, char* buffer, size_t size) {
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%lld", n);
+    char grouped[48];
+    int out = 0;
+    for (int i = 0; i < len; i++) {
+        if (i > 0 && digits[i - 1] != '-' && (len - i) % 3 == 0) grouped[out++] = ',';
+        grouped[out++] = digits[i];
+    }
+    grouped[out] = '\0';
+    snprintf(buffer, size, "%s", grouped);
+}
+
+// Returns the tally for 'root', adding it if this window has none yet
+static ReportTally* ReportTallyFor(WatchReport* report, const char* root) {
+    for (int i = 0; i < report->tallyCount; i++) {
+        if (report->tallies[i].root == root) return &report->tallies[i];
+    }
+    if (report->tallyCount == report->tallyCapacity) {
+        int newCapacity = (report->tallyCapacity == 0) ? 8 : report->tallyCapacity * 2;
+        ReportTally* newTallies = (ReportTally*)realloc(report->tallies, newCapacity * sizeof(ReportTally));
+        if (newTallies == NULL) {
+            WriteColor(COLOR_RED, "Fatal: Out of memory in ReportTallyFor.\n");
+            exit(1);
+        }
+        report->tallies = newTallies;
+        report->tallyCapacity = newCapacity;
+    }
+    ReportTally* tally = &report->tallies[report->tallyCount++];
+    memset(tally, 0, sizeof(*tally));
+    tally->root = root;
+    return tally;
+}
+
+// Records an event about the file 'name' below 'root'
+static void ReportEvent(WatchReport* report, const char* root, uint32_t mask, const char* name) {
+    if (g_Verbosity == VERBOSITY_QUIET) return;
+    ReportTally* tally = ReportTallyFor(report, root);
+    char msg[PATH_MAX + 64];
+    const char* color = NULL;
+    if (mask & IN_CREATE) {
+        tally->created++;
+        snprintf(msg, sizeof(msg), "[+] %s gestures a salutation!\n", name);
+        color = COLOR_GREEN;
+    } else if (mask & IN_DELETE) {
+        tally->deleted++;
+        snprintf(msg, sizeof(msg), "[-] %s bid farewell.\n", name);
+        color = COLOR_RED;
+    } else if (mask & IN_MOVED_FROM) {
+        tally->renamed++;
+        snprintf(msg, sizeof(msg), "[?] %s had changed its identity.\n", name);
+        color = COLOR_MAGENTA;
+    } else if (mask & IN_MOVED_TO) {
+        snprintf(msg, sizeof(msg), "    ==> %s\n", name); // No color
+    } else {
+        return;
+    }
+    if (report->windowStart == 0) report->windowStart = MonotonicMs();
+    report->lines++;
+    // Past the limit lines are no longer kept; the window ends in totals
+    if (g_Verbosity == VERBOSITY_ALL || report->lines <= REPORT_DETAIL_LIMIT) {
+        OutputText(&report->out, color, msg);
+    }
+}
+
+// Writes out the current window and starts a new one
+static void ReportFlush(WatchReport* report) {
+    if (report->windowStart == 0) return;
+    if (g_Verbosity == VERBOSITY_SUMMARY && report->lines > REPORT_DETAIL_LIMIT) {
+        // Too many to list: one line per root and kind of change instead
+        report->out.used = 0;
+        for (int i = 0; i < report->tallyCount; i++) {
+            const ReportTally* tally = &report->tallies[i];
+            char count[48];
+            char msg[PATH_MAX + 96];
+            if (tally->created > 0) {
+                FormatCount(tally->created, count, sizeof(count));
+                snprintf(msg, sizeof(msg), "[+] %s file%s appeared under %s\n", count, (tally->created == 1) ? "" : "s", tally->root);
+                OutputText(&report->out, COLOR_GREEN, msg);
+            }
+            if (tally->deleted > 0) {
+                FormatCount(tally->deleted, count, sizeof(count));
+                snprintf(msg, sizeof(msg), "[-] %s file%s left %s\n", count, (tally->deleted == 1) ? "" : "s", tally->root);
+                OutputText(&report->out, COLOR_RED, msg);
+            }
+            if (tally->renamed > 0) {
+                FormatCount(tally->renamed, count, sizeof(count));
+                snprintf(msg, sizeof(msg), "[?] %s file%s changed identity under %s\n", count, (tally->renamed == 1) ? "" : "s", tally->root);
+                OutputText(&report->out, COLOR_MAGENTA, msg);
+            }
+        }
+    }
+    fflush(stdout); // Anything printed through stdio goes first
+    OutputFlush(&report->out);
+    report->lines = 0;
+    report->windowStart = 0;
+    report->tallyCount = 0;
+}
+
+// This function runs in a separate thread to watch for file changes
+void* WatcherThread(void* arg) {
+    (void)arg;
+    int fd; // File descriptor for the inotify instance
+
+    // Initialize the inotify system. IN_NONBLOCK means 'read' won't block,
+    // so we can drain it completely each time epoll says it is readable.
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror(COLOR_RED "[Watcher] inotify_init1 failed" COLOR_RESET);
+        MarkWatcherSettled();
+        return NULL;
+    }
+    g_Watches.fd = fd;
+
+    // Sleep until there are events or the main thread wants us to stop
+    int epollFd = g_EpollFd;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    ev.data.fd = g_WakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, g_WakeFd, &ev);
+
+    // The trees to watch, from the directory list published at the time.
+    // Our own copy stays put whatever the main thread publishes later; the
+    // watches point into it.
+    int slot = EpochEnter();
+    const DirSet* set = atomic_load(&g_DirSet);
+    StringList dirs = CopyStringList(&set->roots);
+    EpochExit(slot);
+
+    // Add a "watch" for each directory in our list and every directory below it.
+    StringList roots;
+    InitStringList(&roots);
+    int watch_count = 0;
+    for (int i = 0; i < dirs.count; i++) {
+        int wd = inotify_add_watch(fd, dirs.items[i], WATCH_MASK);
+        if (wd < 0) {
+            fprintf(stderr, COLOR_RED "[Watcher] Could not watch %s: %s\n" COLOR_RESET, dirs.items[i], strerror(errno));
+            continue;
+        }
+        AddStringToList(&roots, dirs.items[i]);
+        const char* root = roots.items[roots.count - 1];
+        // Only a root watched all the way down keeps the index current
+        if (WatchTree(root, root)) AddStringToList(&g_WatchedRoots, root);
+        watch_count++;
+    }
+    FreeStringList(&dirs);
+    
+    // From now on the main thread may rely on us to keep the index current
+    atomic_store(&g_WatcherReady, 1);
+    MarkWatcherSettled();
+
+    // An index loaded from a snapshot may have missed changes made while we
+    // were not running; catch up now that new ones will be seen
+    IndexRevalidate();
+
+    if (watch_count == 0) {
+        WriteColor(COLOR_RED, "[Watcher] No valid directories to watch. Thread exiting.\n");
+        FreeStringList(&roots);
+        close(fd);
+        return NULL;
+    }
+
+    // Buffer to read events into
+    #define EVENT_BUF_LEN (1024 * (sizeof(struct inotify_event) + 16))
+    char buffer[EVENT_BUF_LEN];
+
+    // MOVED_FROM halves waiting for their MOVED_TO partner
+    PendingMove pending[MAX_PENDING_MOVES];
+    int pendingCount = 0;
+    int64_t lastEventMs = 0;    // When inotify events were last read
+
+    // Messages about the changes, written out once per window
+    WatchReport report;
+    memset(&report, 0, sizeof(report));
+    report.out.fd = STDOUT_FILENO;
+    report.out.capacity = BATCH_BUF_SIZE;
+    report.out.data = (char*)malloc(BATCH_BUF_SIZE);
+    if (report.out.data == NULL) {
+        WriteColor(COLOR_RED, "Fatal: Out of memory in WatcherThread.\n");
+        exit(1);
+    }
+
+    // Loop until the main thread sets g_running to 0
+    while (g_running) {
+        // Block until something happens. A MOVED_FROM still waiting for its
+        // MOVED_TO only gets a short grace period before it counts as gone,
+        // and an open report window is written out when it ends.
+        int64_t now = MonotonicMs();
+        int timeout = (pendingCount > 0) ? TimeLeft(lastEventMs + MOVE_PAIR_TIMEOUT_MS, now) : -1;
+        if (report.windowStart != 0) {
+            int left = TimeLeft(report.windowStart + REPORT_WINDOW_MS, now);
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+        struct epoll_event ready[8];
+        int n = epoll_wait(epollFd, ready, 8, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(COLOR_RED "[Watcher] epoll_wait error" COLOR_RESET);
+            atomic_store(&g_WatcherReady, 0);
+            break;
+        }
+        if (n == 0) {
+            now = MonotonicMs();
+            if (pendingCount > 0 && now - lastEventMs >= MOVE_PAIR_TIMEOUT_MS) {
+                // Nothing arrived in time: the entries left our directories
+                FlushPendingMoves(pending, &pendingCount);
+                TreeRecountDirty();
+            }
+            if (report.windowStart != 0 && now - report.windowStart >= REPORT_WINDOW_MS) ReportFlush(&report);
+            continue;
+        }
+        int haveEvents = 0;
+        for (int r = 0; r < n; r++) {
+            if (ready[r].data.u64 >> 32) {
+                ReapOpener(ready[r].data.u64); // An opener process finished
+            } else if (ready[r].data.fd == fd) {
+                haveEvents = 1;
+            }
+        }
+        if (!haveEvents) continue; // Woken up; g_running tells us why
+
+        // Read events from the inotify file descriptor
+        int length = read(fd, buffer, EVENT_BUF_LEN);
+
+        if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        } else if (length < 0) {
+            // A real error occurred
             perror(COLOR_RED "[Watcher] read error" COLOR_RESET);
+            // Stop vouching for the index so the main thread rescans again
+            atomic_store(&g_WatcherReady, 0);
             break;
         }
 
@@ -550,35 +7436,121 @@ void* WatcherThread(void* arg) {
         int i = 0;
         while (i < length) {
             struct inotify_event* event = (struct inotify_event*)&buffer[i];
-            if (event->len) {
-                // Ignore events for directories themselves
-                if (!(event->mask & IN_ISDIR)) {
-                    // Print messages based on the event type
-                    if (event->mask & IN_CREATE) {
-                        char msg[PATH_MAX + 64];
-                        snprintf(msg, sizeof(msg), "[+] %s gestures a salutation!\n", event->name);
-                        WriteColor(COLOR_GREEN, msg);
-                    } else if (event->mask & IN_DELETE) {
-                        char msg[PATH_MAX + 64];
-                        snprintf(msg, sizeof(msg), "[-] %s bid farewell.\n", event->name);
-                        WriteColor(COLOR_RED, msg);
-                    } else if (event->mask & IN_MOVED_FROM) {
-                        char msg[PATH_MAX + 64];
-                        snprintf(msg, sizeof(msg), "[?] %s had changed its identity.\n", event->name);
-                        WriteColor(COLOR_MAGENTA, msg);
-                    } else if (event->mask & IN_MOVED_TO) {
-                        char msg[PATH_MAX + 64];
-                        snprintf(msg, sizeof(msg), "    ==> %s\n", event->name);
-                        printf("%s", msg); // No color reset
+            // Move to the next event in the buffer
+            i += sizeof(struct inotify_event) + event->len;
+            StatCountEvent(event->mask);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were dropped; the pending moves can no longer be trusted
+                for (int p = 0; p < pendingCount; p++) free(pending[p].path);
+                pendingCount = 0;
+                // and neither can the watches: directories may have come,
+                // gone or moved unseen. Register every tree afresh.
+                for (int r = 0; r < roots.count; r++) {
+                    WatchForgetTree(roots.items[r]);
+                    WatchTree(roots.items[r], roots.items[r]);
+                }
+                RescanWatchedRoots();
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                // The directory is gone, or no longer watched
+                WatchMapRemove(event->wd);
+                continue;
+            }
+            const WatchEntry* watch = (event->len > 0) ? WatchMapFind(event->wd) : NULL;
+            if (watch == NULL) continue;
+
+            // Full path of the entry the event is about
+            const char* root = watch->root;
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", watch->path, event->name) >= (int)sizeof(path)) continue;
+            int isDir = (event->mask & IN_ISDIR) != 0;
+            // Excluded entries are neither watched nor indexed. Renames in
+            // or out of them count as a deletion or a creation.
+            if (IsPathExcluded(path, strlen(root), isDir)) continue;
+            int isLink = 0; // A link standing for a directory
+            if (g_FollowSymlinks && !isDir) isDir = isLink = LinkIsDir(path, event->mask);
+            // A link to a directory that is watched already adds nothing
+            // new; it is only remembered in case the other path goes
+            struct stat linkSt;
+            if (isDir && g_FollowSymlinks && (event->mask & (IN_CREATE | IN_MOVED_TO)) && IsWatchedDir(path, &linkSt)) {
+                IndexAddAlias(root, path, &linkSt);
+                continue;
+            }
+            // Directories carry their counts along when they move or go,
+            // so bring those up to date first
+            if (isDir) TreeRecountDirty();
+
+            // Keep the watches and the index in step with the change. New
+            // directories are watched before they are scanned, so nothing
+            // created in them meanwhile can slip through.
+            if (event->mask & IN_CREATE) {
+                if (isDir) WatchTree(root, path);
+                ApplyCreate(root, path, isDir);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_ATTRIB)) {
+                // Same file, new size or age (the tree sampler keeps neither)
+                if (!isDir && !g_TreeSampler) ApplyCreate(root, path, 0);
+            } else if (event->mask & IN_DELETE && isLink) {
+                // The target stays, and other links to it may have been
+                // skipped as duplicates of this one
+                RemoveLinkedDir(&roots, root, path);
+            } else if (event->mask & IN_DELETE) {
+                ApplyDelete(root, path, isDir);
+            } else if (event->mask & IN_MOVED_FROM) {
+                if (pendingCount == MAX_PENDING_MOVES) {
+                    FlushPendingMoves(pending, &pendingCount);
+                }
+                PendingMove* move = &pending[pendingCount++];
+                move->cookie = event->cookie;
+                move->isDir = isDir;
+                move->root = (char*)root;
+                move->path = strdup(path);
+                if (move->path == NULL) {
+                    WriteColor(COLOR_RED, "Fatal: Out of memory in strdup.\n");
+                    exit(1);
+                }
+            } else if (event->mask & IN_MOVED_TO) {
+                // Pair it with its MOVED_FROM half to turn it into a rename
+                int match = -1;
+                for (int p = 0; p < pendingCount; p++) {
+                    if (pending[p].cookie == event->cookie) {
+                        match = p;
+                        break;
                     }
                 }
+                if (match == -1) {
+                    // Moved in from somewhere we do not watch
+                    if (isDir) WatchTree(root, path);
+                    ApplyCreate(root, path, isDir);
+                } else {
+                    if (isDir) WatchMoveTree(pending[match].path, path, root);
+                    ApplyRename(&pending[match], root, path);
+                    free(pending[match].path);
+                    pending[match] = pending[--pendingCount];
+                }
             }
-            // Move to the next event in the buffer
-            i += sizeof(struct inotify_event) + event->len;
+
+            // Ignore events for directories themselves
+            if (!isDir) ReportEvent(&report, root, event->mask, event->name);
         }
+
+        TreeRecountDirty();
+
+        // Under a steady stream of events epoll never times out, so check here too
+        lastEventMs = MonotonicMs();
+        if (report.windowStart != 0 && lastEventMs - report.windowStart >= REPORT_WINDOW_MS) ReportFlush(&report);
     }
 
-    // Clean up the inotify file descriptor
+    // Clean up the inotify file descriptor (the main thread owns the epoll one)
+    ReportFlush(&report);
+    free(report.out.data);
+    free(report.tallies);
+    for (int p = 0; p < pendingCount; p++) free(pending[p].path);
+    FreeStringList(&g_TreeDirtyDirs);
+    FreeStringList(&g_TreeDirtyRoots);
+    WatchMapFree();
+    FreeStringList(&roots);
     close(fd);
     return NULL;
-}
\ No newline at end of file
+}